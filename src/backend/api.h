@@ -12,24 +12,33 @@ struct InferencePackage {
     Model* model_ptr;
     Tokenizer* tokenizer_ptr;
     std::string model_name;
+    // Maximum number of tokens predicted by an inference. It stops there if the model has not
+    // predicted the end of text token by then.
+    int max_new_tokens;
 
-    InferencePackage(Model* mptr, Tokenizer* tptr, const std::string& model_name_)
-        : model_ptr{mptr}, tokenizer_ptr{tptr}, model_name{model_name_}
+    InferencePackage(Model* mptr, Tokenizer* tptr, const std::string& model_name_, int max_new_tokens_)
+        : model_ptr{mptr}, tokenizer_ptr{tptr}, model_name{model_name_}, max_new_tokens{max_new_tokens_}
     {}
 };
 
 
-void* init_inference_package(const std::string& model_name, Dtype model_dtype, const std::string& model_path, const std::string& tokenizer_path, int n_ctx)
+// `kv_dtype` is the dtype of the attention key and value caches and `acv_dtype` the dtype of
+// the activations. With fp32 activations, the residual stream and the elementwise ops stay in
+// fp32 and the activations are only quantized (to q8, for quantized models) at the inputs of
+// the matmuls.
+void* init_inference_package(const std::string& model_name, Dtype model_dtype, Dtype kv_dtype, Dtype acv_dtype, const std::string& model_path, const std::string& tokenizer_path, int n_ctx)
 {
     std::cout << "Loading package ...\n";
 
     ModuleDtype dtype;
     if (model_dtype == kFloat16) {
-        dtype = { .wdtype=kFloat16, .adtype=kFloat16 };
+        dtype = { .wdtype=kFloat16, .adtype=acv_dtype, .kvdtype=kv_dtype };
+    } else if (model_dtype == kBFloat16) {
+        dtype = { .wdtype=kBFloat16, .adtype=acv_dtype, .kvdtype=kv_dtype };
     } else if (model_dtype == kQint8) {
-        dtype = { .wdtype=kQint8, .adtype=kQint8 };
+        dtype = { .wdtype=kQint8, .adtype=acv_dtype, .kvdtype=kv_dtype };
     } else {
-        dtype = { .wdtype=kQint4, .adtype=kQint8 };
+        dtype = { .wdtype=kQint4, .adtype=acv_dtype, .kvdtype=kv_dtype };
     }
 
     std::ifstream fin{model_path, std::ios_base::binary};
@@ -48,7 +57,7 @@ void* init_inference_package(const std::string& model_name, Dtype model_dtype, c
         const std::string prompt_suffix = "<AI>";
         LLamaTokenizer* tok_ptr = new LLamaTokenizer{tokenizer_path.c_str(), minicpm_cfg.n_vocab, minicpm_cfg.eos, prompt_prefix, prompt_suffix, {}, {}};
 
-        infpkg_ptr = new InferencePackage{model_ptr, tok_ptr, model_name};
+        infpkg_ptr = new InferencePackage{model_ptr, tok_ptr, model_name, /*max_new_tokens=*/n_ctx};
     }
     else if (model_name == "tinyllama") {
         TinyLLama* model_ptr = new TinyLLama{n_ctx, dtype};
@@ -59,14 +68,14 @@ void* init_inference_package(const std::string& model_name, Dtype model_dtype, c
         const std::vector<int> suffix_tokens = {32002, 29871, 13, 32001, 20255, 13};
         LLamaTokenizer* tok_ptr = new LLamaTokenizer{tokenizer_path.c_str(), vocab_size, tinyllama_cfg.eos, "user\n", "", prefix_tokens, suffix_tokens};
 
-        infpkg_ptr = new InferencePackage{model_ptr, tok_ptr, model_name};
+        infpkg_ptr = new InferencePackage{model_ptr, tok_ptr, model_name, /*max_new_tokens=*/n_ctx};
     } else {
         Zephyr* model_ptr = new Zephyr{n_ctx, dtype};
         model_ptr->load_from_ckpt(fin);
 
         Gpt2Tokenizer* tok_ptr = new Gpt2Tokenizer{tokenizer_path, zephyr_cfg.n_vocab, zephyr_cfg.eos};
 
-        infpkg_ptr = new InferencePackage{model_ptr, tok_ptr, model_name};
+        infpkg_ptr = new InferencePackage{model_ptr, tok_ptr, model_name, /*max_new_tokens=*/n_ctx};
     }
 
     std::cout << "Loading package complete!\n";
@@ -75,33 +84,65 @@ void* init_inference_package(const std::string& model_name, Dtype model_dtype, c
 }
 
 
+// Sets the maximum number of tokens in the context of the next inferences and the maximum
+// number of tokens that they predict. The kv cache and the activations grow with the context
+// so it can be raised past the size the package was loaded with without reloading the model.
+void set_inference_ctx(void* pkg_ptr, int n_ctx, int max_new_tokens)
+{
+    InferencePackage* pkg = reinterpret_cast<InferencePackage*>(pkg_ptr);
+    pkg->model_ptr->m_max_inference_ctx = n_ctx;
+    pkg->max_new_tokens = max_new_tokens;
+}
+
+
 void perform_inference(void* pkg_ptr, std::string& prompt, std::function<void(const char*)> callback_function)
 {
     std::random_device rd;
     std::mt19937 gen(rd());
 
     InferencePackage* pkg = reinterpret_cast<InferencePackage*>(pkg_ptr);
+    Model* model = pkg->model_ptr;
+    // Each inference starts a new sequence, the pages of the previous one are freed.
+    model->reset_kv_cache();
 
     std::vector<int> tokens = pkg->tokenizer_ptr->encode(prompt);
-    const int n_predict = pkg->model_ptr->m_max_inference_ctx;
-    tokens.reserve(n_predict);
+
+    // When the context is full, it is shifted: the first `n_keep` (sink) tokens are kept, the
+    // oldest half of the following ones are evicted and the rest are moved back, so that the
+    // generation can go on with a bounded context.
+    const int n_ctx = model->m_max_inference_ctx;
+    const int n_keep = std::min(model->m_n_sink_tokens, n_ctx / 2);
+    if (int(tokens.size()) > n_ctx) {
+        // The start of a prompt that does not fit is evicted before it is fed to the model,
+        // leaving half of the context for the end of the prompt.
+        const int n_retained = std::max(1, (n_ctx - n_keep) / 2);
+        const int n_discard = tokens.size() - n_keep - n_retained;
+        tokens.erase(tokens.begin() + n_keep, tokens.begin() + n_keep + n_discard);
+    }
+    tokens.reserve(n_ctx + 1);
 
     std::vector<std::pair<double, int>> logits_probs;
 
     const float temp = 0.9f;
     const int top_k = 50;
     const int eot_token = pkg->tokenizer_ptr->m_eos_token;
-    const int max_iters = n_predict - tokens.size();
-    int n_iters = 0;
     bool reached_eot = false;
-    for (int i = 0; i < max_iters; i++)
+    // The context shifts let the generation go on past the context size so it is bounded by
+    // the number of predicted tokens instead.
+    for (int i = 0; i < pkg->max_new_tokens; i++)
     {
-        n_iters += 1;
+        if (i > 0 && int(tokens.size()) > n_ctx) {
+            // All the tokens but the last one, which is fed next, are in the kv cache.
+            const int n_past = tokens.size() - 1;
+            const int n_discard = std::max(1, (n_past - n_keep) / 2);
+            model->shift_kv_cache(n_keep, n_discard, n_past);
+            tokens.erase(tokens.begin() + n_keep, tokens.begin() + n_keep + n_discard);
+        }
 
         Tensor input{tokens.data(), {(int)tokens.size()}, kInt32};
 
         const int start_pos = (i == 0) ? 0 : input.numel() - 1; 
-        Tensor logits = pkg->model_ptr->logits(input, start_pos);
+        Tensor logits = model->logits(input, start_pos);
 
         const float* logits_data = logits.data_ptr<float>();
         const int logits_size = logits.numel(); 
@@ -14,11 +14,20 @@ namespace js_api {
 
 
 // Load model and tokenizer.
-// inp: model_name, model_type, model_path, tokenizer_path, n_ctx
+// inp: model_name, model_type, model_path, tokenizer_path, n_ctx, [n_threads, pin_threads, kv_type, acv_type]
+// n_threads (0 = one per cpu) and pin_threads configure the thread pool that runs the ops.
+// If they are not given, the pool is configured from the environment (see thread_pool.h).
+// model_type is one of "fp16", "bf16", "q8" or "q4".
+// kv_type ("fp16", "q8" or "q4") is the dtype of the kv cache, which defaults to fp16 for
+// fp16 and bf16 models and q8 otherwise.
+// acv_type is the dtype of the activations: "fp32" keeps the residual stream and elementwise
+// ops in fp32 and only quantizes the matmul inputs. It defaults to the model type for fp16
+// and bf16 models and q8 otherwise.
 napi_value api_init_inference_package(napi_env env, napi_callback_info info) {
     const size_t expected_inp_argc = 5;
-    size_t inp_argc = expected_inp_argc;
-    napi_value inp_args[expected_inp_argc];
+    const size_t max_inp_argc = 9;
+    size_t inp_argc = max_inp_argc;
+    napi_value inp_args[max_inp_argc];
 
     napi_status status = napi_get_cb_info(env, info, &inp_argc, inp_args, NULL, NULL);
     ASSERT_NAPI_STATUS(env, status, "fn `napi_get_cb_info` failed.");
@@ -74,6 +83,50 @@ napi_value api_init_inference_package(napi_env env, napi_callback_info info) {
             napi_throw_type_error(env, nullptr, "api_init_inference_package: arg 4 has incorrect type.");
             return nullptr;
         }
+
+        if (inp_argc > 5) {
+            napi_valuetype arg5_type;
+            status = napi_typeof(env, inp_args[5], &arg5_type);
+            ASSERT_NAPI_STATUS(env, status, "fn napi_typeof failed.");
+
+            if (arg5_type != napi_number) {
+                napi_throw_type_error(env, nullptr, "api_init_inference_package: arg 5 has incorrect type.");
+                return nullptr;
+            }
+        }
+
+        if (inp_argc > 6) {
+            napi_valuetype arg6_type;
+            status = napi_typeof(env, inp_args[6], &arg6_type);
+            ASSERT_NAPI_STATUS(env, status, "fn napi_typeof failed.");
+
+            if (arg6_type != napi_boolean) {
+                napi_throw_type_error(env, nullptr, "api_init_inference_package: arg 6 has incorrect type.");
+                return nullptr;
+            }
+        }
+
+        if (inp_argc > 7) {
+            napi_valuetype arg7_type;
+            status = napi_typeof(env, inp_args[7], &arg7_type);
+            ASSERT_NAPI_STATUS(env, status, "fn napi_typeof failed.");
+
+            if (arg7_type != napi_string) {
+                napi_throw_type_error(env, nullptr, "api_init_inference_package: arg 7 has incorrect type.");
+                return nullptr;
+            }
+        }
+
+        if (inp_argc > 8) {
+            napi_valuetype arg8_type;
+            status = napi_typeof(env, inp_args[8], &arg8_type);
+            ASSERT_NAPI_STATUS(env, status, "fn napi_typeof failed.");
+
+            if (arg8_type != napi_string) {
+                napi_throw_type_error(env, nullptr, "api_init_inference_package: arg 8 has incorrect type.");
+                return nullptr;
+            }
+        }
     }
 
     const int string_bufsize = 1024;
@@ -91,8 +144,44 @@ napi_value api_init_inference_package(napi_env env, napi_callback_info info) {
     
     Dtype model_dtype;
     if (model_type_id == "fp16") {model_dtype = kFloat16; }
+    else if (model_type_id == "bf16") {model_dtype = kBFloat16; }
     else if (model_type_id == "q8") {model_dtype = kQint8; } 
     else {model_dtype = kQint4; } 
+    const bool model_is_quantized = model_dtype == kQint8 || model_dtype == kQint4;
+
+    Dtype kv_dtype = model_is_quantized ? kQint8 : kFloat16;
+    std::string kv_type_id = model_is_quantized ? "q8" : "fp16";
+    if (inp_argc > 7) {
+        status = napi_get_value_string_utf8(env, inp_args[7], string_buf, string_bufsize, &string_size);
+        ASSERT_NAPI_STATUS(env, status, "fn napi_get_value_string_utf8 failed.");
+        kv_type_id = string_buf;
+
+        if (kv_type_id == "fp16") { kv_dtype = kFloat16; }
+        else if (kv_type_id == "q8") { kv_dtype = kQint8; }
+        else if (kv_type_id == "q4") { kv_dtype = kQint4; }
+        else {
+            napi_throw_type_error(env, nullptr, "api_init_inference_package: arg 7 must be one of fp16, q8 or q4.");
+            return nullptr;
+        }
+    }
+
+    // The matmuls of the quantized weights take q8 (or fp32) inputs and those of the fp16 and
+    // bf16 weights take inputs of the same dtype (or fp32).
+    Dtype acv_dtype = model_is_quantized ? kQint8 : model_dtype;
+    std::string acv_type_id = model_is_quantized ? "q8" : model_type_id;
+    if (inp_argc > 8) {
+        status = napi_get_value_string_utf8(env, inp_args[8], string_buf, string_bufsize, &string_size);
+        ASSERT_NAPI_STATUS(env, status, "fn napi_get_value_string_utf8 failed.");
+        const std::string type_id{string_buf};
+
+        if (type_id == "fp32") { acv_dtype = kFloat32; }
+        else if (type_id != acv_type_id) {
+            const std::string error_msg = "api_init_inference_package: arg 8 must be fp32 or " + acv_type_id + ".";
+            napi_throw_type_error(env, nullptr, error_msg.c_str());
+            return nullptr;
+        }
+        acv_type_id = type_id;
+    }
 
     status = napi_get_value_string_utf8(env, inp_args[2], string_buf, string_bufsize, &string_size);
     ASSERT_NAPI_STATUS(env, status, "fn napi_get_value_string_utf8 failed.");
@@ -111,8 +200,24 @@ napi_value api_init_inference_package(napi_env env, napi_callback_info info) {
     std::cout<< "mdirn: " << model_path << "\n"; 
     std::cout<< "mtokp: " << tokenizer_path << "\n"; 
     std::cout<< "mnctx: " << n_ctx << "\n"; 
+    std::cout<< "mkvdt: " << kv_type_id << "\n"; 
+    std::cout<< "macvt: " << acv_type_id << "\n"; 
+
+    if (inp_argc > 5) {
+        ThreadPoolConfig pool_config;
+        status = napi_get_value_int32(env, inp_args[5], &pool_config.n_threads);
+        ASSERT_NAPI_STATUS(env, status, "fn napi_get_value_int32 failed.");
+
+        if (inp_argc > 6) {
+            status = napi_get_value_bool(env, inp_args[6], &pool_config.pin_threads);
+            ASSERT_NAPI_STATUS(env, status, "fn napi_get_value_bool failed.");
+        }
 
-    void* pkg_ptr = init_inference_package(model_name, model_dtype, model_path, tokenizer_path, n_ctx);
+        std::cout<< "mthrd: " << pool_config.n_threads << (pool_config.pin_threads ? " (pinned)" : "") << "\n";
+        configure_thread_pool(pool_config);
+    }
+
+    void* pkg_ptr = init_inference_package(model_name, model_dtype, kv_dtype, acv_dtype, model_path, tokenizer_path, n_ctx);
     // TODO: Could 'napi_create_external' be used to carry the pointer?
     const uint64_t ptr_int = (uint64_t)pkg_ptr;
 
@@ -216,10 +321,90 @@ napi_value api_perform_inference(napi_env env, napi_callback_info info) {
 }
 
 
+// input: inference_pkg_ptr, n_ctx, [max_new_tokens]
+// max_new_tokens is the maximum number of tokens predicted by an inference, which defaults to
+// n_ctx.
+napi_value api_set_inference_ctx(napi_env env, napi_callback_info info) {
+    const size_t expected_inp_argc = 2;
+    const size_t max_inp_argc = 3;
+    size_t inp_argc = max_inp_argc;
+    napi_value inp_args[max_inp_argc];
+
+    napi_status status = napi_get_cb_info(env, info, &inp_argc, inp_args, NULL, NULL);
+    ASSERT_NAPI_STATUS(env, status, "fn `napi_get_cb_info` failed.");
+
+    { // INPUT ARGS ERROR CHECKING
+        if (inp_argc < expected_inp_argc) {
+            napi_throw_type_error(env, nullptr, "api_set_inference_ctx: Incorrect number of arguments");
+            return nullptr;
+        }
+
+        napi_valuetype arg0_type;
+        status = napi_typeof(env, inp_args[0], &arg0_type);
+        ASSERT_NAPI_STATUS(env, status, "fn napi_typeof failed.");
+
+        if (arg0_type != napi_bigint) {
+            napi_throw_type_error(env, nullptr, "api_set_inference_ctx: arg 0 has incorrect type.");
+            return nullptr;
+        }
+
+        napi_valuetype arg1_type;
+        status = napi_typeof(env, inp_args[1], &arg1_type);
+        ASSERT_NAPI_STATUS(env, status, "fn napi_typeof failed.");
+
+        if (arg1_type != napi_number) {
+            napi_throw_type_error(env, nullptr, "api_set_inference_ctx: arg 1 has incorrect type.");
+            return nullptr;
+        }
+
+        if (inp_argc > 2) {
+            napi_valuetype arg2_type;
+            status = napi_typeof(env, inp_args[2], &arg2_type);
+            ASSERT_NAPI_STATUS(env, status, "fn napi_typeof failed.");
+
+            if (arg2_type != napi_number) {
+                napi_throw_type_error(env, nullptr, "api_set_inference_ctx: arg 2 has incorrect type.");
+                return nullptr;
+            }
+        }
+    }
+
+    uint64_t inference_pkg_ptr_int;
+    bool conversion_is_lossless;
+    status = napi_get_value_bigint_uint64(env, inp_args[0], &inference_pkg_ptr_int, &conversion_is_lossless);
+    ASSERT_NAPI_STATUS(env, status, "fn napi_get_value_bigint_uint64 failed.");
+    assert(conversion_is_lossless);
+    void* inference_pkg_ptr = reinterpret_cast<void*>(inference_pkg_ptr_int);
+
+    int n_ctx;
+    status = napi_get_value_int32(env, inp_args[1], &n_ctx);
+    ASSERT_NAPI_STATUS(env, status, "fn napi_get_value_int32 failed.");
+    if (n_ctx <= 0) {
+        napi_throw_range_error(env, nullptr, "api_set_inference_ctx: n_ctx must be positive.");
+        return nullptr;
+    }
+
+    int max_new_tokens = n_ctx;
+    if (inp_argc > 2) {
+        status = napi_get_value_int32(env, inp_args[2], &max_new_tokens);
+        ASSERT_NAPI_STATUS(env, status, "fn napi_get_value_int32 failed.");
+        if (max_new_tokens <= 0) {
+            napi_throw_range_error(env, nullptr, "api_set_inference_ctx: max_new_tokens must be positive.");
+            return nullptr;
+        }
+    }
+
+    set_inference_ctx(inference_pkg_ptr, n_ctx, max_new_tokens);
+
+    return nullptr;
+}
+
+
 napi_value init(napi_env env, napi_value exports) {
     const napi_property_descriptor desc[] = {
         {"init_inference_engine", 0, api_init_inference_package, 0, 0, 0, napi_default, 0},
         {"perform_inference", 0, api_perform_inference, 0, 0, 0, napi_default, 0},
+        {"set_inference_ctx", 0, api_set_inference_ctx, 0, 0, 0, napi_default, 0},
     };
 
     const size_t desc_size = sizeof(desc) / sizeof(*desc);
@@ -15,6 +15,10 @@ public:
     int m_sample_time_ms = 0;
     int m_max_inference_ctx;
     int m_max_train_ctx;
+    // Number of tokens at the start of the context that are always kept when the context is
+    // shifted. The attention puts a large weight on the first tokens so evicting them
+    // degrades the predictions much more than evicting the following ones.
+    int m_n_sink_tokens = 4;
 
 public:
     Model(int inference_ctx, int train_ctx)
@@ -23,6 +27,13 @@ public:
     {
     }
     virtual Tensor logits(const Tensor& tokens, const int start_pos=0) = 0;
+    // Frees the kv caches and the context-sized activations of the attention layers, e.g
+    // before starting a new sequence.
+    virtual void reset_kv_cache() = 0;
+    // Evicts the positions [n_keep, n_keep + n_discard) of the `n_past` positions in the kv
+    // caches of the attention layers and moves the following positions back, so that the
+    // tokens after the evicted ones can be fed again at their new positions.
+    virtual void shift_kv_cache(int n_keep, int n_discard, int n_past) = 0;
     virtual void load_from_ckpt(std::ifstream& ckpt) = 0;
     virtual void print_perf(const int n_pred_tokens) = 0;
 };
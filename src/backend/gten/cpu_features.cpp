@@ -0,0 +1,115 @@
+#include <cstdint>
+
+#include "cpu_features.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define GTEN_ARCH_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+
+namespace gten {
+
+#if defined(GTEN_ARCH_X86)
+
+// Executes cpuid for the given leaf and subleaf and writes eax, ebx, ecx, edx to `regs`.
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuidex(info, leaf, subleaf);
+    for (int i = 0; i < 4; i++) {
+        regs[i] = static_cast<uint32_t>(info[i]);
+    }
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Reads the XCR0 register which tells us which register states the OS saves.
+static uint64_t read_xcr0()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+}
+
+static bool bit_is_set(uint32_t reg, int bit) {
+    return (reg >> bit) & 1;
+}
+
+static CpuFeatures query_cpu_features()
+{
+    CpuFeatures features;
+
+    uint32_t regs[4];
+    cpuid(0, 0, regs);
+    const uint32_t max_leaf = regs[0];
+    if (max_leaf < 1) {
+        return features;
+    }
+
+    cpuid(1, 0, regs);
+    const uint32_t leaf1_ecx = regs[2];
+    features.sse4_1 = bit_is_set(leaf1_ecx, 19);
+
+    // The AVX registers can only be used if the OS saves them (XCR0 bits 1 and 2).
+    const bool os_uses_xsave = bit_is_set(leaf1_ecx, 27);
+    const uint64_t xcr0 = os_uses_xsave ? read_xcr0() : 0;
+    const bool os_saves_avx = (xcr0 & 0x6) == 0x6;
+    // The AVX-512 registers additionally require XCR0 bits 5, 6 and 7.
+    const bool os_saves_avx512 = os_saves_avx && (xcr0 & 0xE0) == 0xE0;
+
+    features.avx = os_saves_avx && bit_is_set(leaf1_ecx, 28);
+    features.f16c = features.avx && bit_is_set(leaf1_ecx, 29);
+    features.fma = features.avx && bit_is_set(leaf1_ecx, 12);
+
+    if (max_leaf >= 7) {
+        cpuid(7, 0, regs);
+        const uint32_t leaf7_max_subleaf = regs[0];
+        const uint32_t leaf7_ebx = regs[1];
+        const uint32_t leaf7_ecx = regs[2];
+
+        features.avx2 = features.avx && bit_is_set(leaf7_ebx, 5);
+        features.avx512f = os_saves_avx512 && bit_is_set(leaf7_ebx, 16);
+        features.avx512bw = features.avx512f && bit_is_set(leaf7_ebx, 30);
+        features.avx512vl = features.avx512f && bit_is_set(leaf7_ebx, 31);
+        features.avx512vnni = features.avx512f && bit_is_set(leaf7_ecx, 11);
+
+        if (leaf7_max_subleaf >= 1) {
+            cpuid(7, 1, regs);
+            const uint32_t leaf7_1_eax = regs[0];
+            features.avxvnni = features.avx && bit_is_set(leaf7_1_eax, 4);
+            features.avx512bf16 = features.avx512f && bit_is_set(leaf7_1_eax, 5);
+        }
+    }
+
+    return features;
+}
+
+#else
+
+static CpuFeatures query_cpu_features()
+{
+    // No x86 extensions available.
+    return CpuFeatures{};
+}
+
+#endif
+
+
+const CpuFeatures& cpu_features()
+{
+    static const CpuFeatures features = query_cpu_features();
+    return features;
+}
+
+} // namespace gten
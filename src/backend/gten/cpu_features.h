@@ -0,0 +1,27 @@
+#pragma once
+
+
+namespace gten {
+
+// Instruction set extensions supported by the cpu we are running on. An extension is only
+// reported as supported if the OS also saves the registers it uses on context switches.
+struct CpuFeatures {
+    bool sse4_1 = false;
+    bool avx = false;
+    bool f16c = false;
+    bool fma = false;
+    bool avx2 = false;
+    bool avx512f = false;
+    bool avx512bw = false;
+    bool avx512vl = false;
+    bool avx512vnni = false;
+    bool avx512bf16 = false;
+    // 256-bit (VEX encoded) VNNI of client cpus without AVX-512.
+    bool avxvnni = false;
+};
+
+// Returns the features of the current cpu. The features are queried (with cpuid on x86)
+// once, on the first call.
+const CpuFeatures& cpu_features();
+
+} // namespace gten
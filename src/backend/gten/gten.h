@@ -3,9 +3,12 @@
 
 #include "abc.h"
 #include "gten_types.h"
+#include "kv_cache.h"
 #include "log.h"
 #include "modules.h"
 #include "ops.h"
+#include "rope_table.h"
 #include "tensor.h"
+#include "thread_pool.h"
 #include "tokenizer.h"
 #include "utils.h"
@@ -0,0 +1,23 @@
+#include "gten_types.h"
+
+
+namespace gten {
+
+namespace fpcvt {
+
+static float* init_cache() {
+    // TODO: fix memory leak.
+    float* cache = new float[65536];
+    Float16 idx = 0;
+    for (int i = 0; i < 65536; i++) {
+        cache[i] = fp16_to_fp32(idx);
+        idx += 1;
+    }
+    return cache;
+}
+
+const float* G_fp16_to_fp32_table = init_cache();
+
+} // namespace fpcvt
+
+} // namespace gten
@@ -16,13 +16,20 @@ typedef int32_t Int32;
 typedef uint16_t Float16;
 typedef int8_t Qint8;
 typedef uint8_t Qint4;
+// The upper 16 bits of an fp32. Unlike Float16, it is a distinct type rather than a typedef
+// of uint16_t so that the functions that load floats from their storage type can overload
+// on it.
+struct BFloat16 {
+    uint16_t bits;
+};
 
 enum class Dtype {
     Int32,
     Float16,
     Float32,
     Qint8,
-    Qint4
+    Qint4,
+    BFloat16
 };
 
 // Convenient shorthands for the enum class above.
@@ -31,15 +38,19 @@ static const Dtype kFloat16 = Dtype::Float16;
 static const Dtype kFloat32 = Dtype::Float32;
 static const Dtype kQint8 = Dtype::Qint8;
 static const Dtype kQint4 = Dtype::Qint4;
+static const Dtype kBFloat16 = Dtype::BFloat16;
 
 struct ModuleDtype {
     Dtype wdtype;
     Dtype adtype;
+    // Dtype of the attention key and value caches: kFloat16, kQint8 or kQint4.
+    Dtype kvdtype;
 };
 
-static const ModuleDtype mFloat16 = {.wdtype=kFloat16, .adtype=kFloat16};
-static const ModuleDtype mQint8 = {.wdtype=kQint8, .adtype=kQint8};
-static const ModuleDtype mQint4 = {.wdtype=kQint4, .adtype=kQint8};
+static const ModuleDtype mFloat16 = {.wdtype=kFloat16, .adtype=kFloat16, .kvdtype=kFloat16};
+static const ModuleDtype mQint8 = {.wdtype=kQint8, .adtype=kQint8, .kvdtype=kQint8};
+static const ModuleDtype mQint4 = {.wdtype=kQint4, .adtype=kQint8, .kvdtype=kQint8};
+static const ModuleDtype mBFloat16 = {.wdtype=kBFloat16, .adtype=kBFloat16, .kvdtype=kFloat16};
 
 
 // fpcvt_stoh
@@ -48,7 +59,7 @@ static const ModuleDtype mQint4 = {.wdtype=kQint4, .adtype=kQint8};
 namespace fpcvt {
 
 // FP32 <-> FP16 Conversions.
-inline float fp32_from_bits(uint32_t w) {
+static inline float fp32_from_bits(uint32_t w) {
     union {
         uint32_t as_bits;
         float as_value;
@@ -57,7 +68,7 @@ inline float fp32_from_bits(uint32_t w) {
     return fp32.as_value;
 }
 
-inline uint32_t fp32_to_bits(float f) {
+static inline uint32_t fp32_to_bits(float f) {
     union {
         float as_value;
         uint32_t as_bits;
@@ -66,7 +77,7 @@ inline uint32_t fp32_to_bits(float f) {
     return fp32.as_bits;
 }
 
-inline float fp16_to_fp32(Float16 h) noexcept
+static inline float fp16_to_fp32(Float16 h) noexcept
 {
     const uint32_t w = (uint32_t) h << 16;
     const uint32_t sign = w & UINT32_C(0x80000000);
@@ -86,7 +97,7 @@ inline float fp16_to_fp32(Float16 h) noexcept
     return fp32_from_bits(result);
 }
 
-inline Float16 fp32_to_fp16(float f) noexcept
+static inline Float16 fp32_to_fp16(float f) noexcept
 {
     const float scale_to_inf = fp32_from_bits(UINT32_C(0x77800000));
     const float scale_to_zero = fp32_from_bits(UINT32_C(0x08800000));
@@ -108,35 +119,55 @@ inline Float16 fp32_to_fp16(float f) noexcept
     return (sign >> 16) | (shl1_w > UINT32_C(0xFF000000) ? UINT16_C(0x7E00) : nonsign);
 }
 
+// FP32 <-> BF16 Conversions. bf16 is the upper half of an fp32 so the conversion to fp32 is
+// exact. The conversion from fp32 rounds to the nearest, ties to even, and keeps NaNs NaNs.
+static inline float bf16_to_fp32(BFloat16 h) noexcept
+{
+    return fp32_from_bits(static_cast<uint32_t>(h.bits) << 16);
+}
 
-static float* init_cache() {
-    // TODO: fix memory leak.
-    float* cache = new float[65536];
-    Float16 idx = 0;
-    for (int i = 0; i < 65536; i++) {
-        cache[i] = fp16_to_fp32(idx);
-        idx += 1;
+static inline BFloat16 fp32_to_bf16(float f) noexcept
+{
+    const uint32_t w = fp32_to_bits(f);
+    if ((w & UINT32_C(0x7FFFFFFF)) > UINT32_C(0x7F800000)) {
+        return BFloat16{static_cast<uint16_t>((w >> 16) | UINT32_C(0x40))};
     }
-    return cache;
+    const uint32_t rounding_bias = UINT32_C(0x7FFF) + ((w >> 16) & 1);
+    return BFloat16{static_cast<uint16_t>((w + rounding_bias) >> 16)};
 }
 
-// Global lookup table for fp16->fp32 to avoid recomputations.
-static const float* G_fp16_to_fp32_table = init_cache();
+// Global lookup table for fp16->fp32 to avoid recomputations. It is defined (once) in
+// gten_types.cpp so that the kernels translation units, which are compiled with different
+// instruction sets, do not each run an initializer for it at startup.
+extern const float* G_fp16_to_fp32_table;
 
 } // namespace fpcvt
 
 
 // Convert 16-bit float to 32-bit float.
 [[nodiscard]]
-inline float fp16_to_fp32(Float16 half) {
+static inline float fp16_to_fp32(Float16 half) {
     return fpcvt::G_fp16_to_fp32_table[half];
 }
 
 // Convert 32-bit float to 16-bit float.
 [[nodiscard]]
-inline Float16 fp32_to_fp16(float flt) {
+static inline Float16 fp32_to_fp16(float flt) {
     return fpcvt::fp32_to_fp16(flt);
 }
 
 
+// Convert 16-bit brain float to 32-bit float.
+[[nodiscard]]
+static inline float bf16_to_fp32(BFloat16 bf) {
+    return fpcvt::bf16_to_fp32(bf);
+}
+
+// Convert 32-bit float to 16-bit brain float.
+[[nodiscard]]
+static inline BFloat16 fp32_to_bf16(float flt) {
+    return fpcvt::fp32_to_bf16(flt);
+}
+
+
 } // namespace gten.
\ No newline at end of file
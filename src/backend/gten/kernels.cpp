@@ -0,0 +1,213 @@
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "cpu_features.h"
+#include "kernels.h"
+
+
+namespace gten {
+
+const char* kernel_tier_str(KernelTier tier)
+{
+    switch (tier) {
+        case KernelTier::Scalar:     return "scalar";
+        case KernelTier::SSE4:       return "sse4";
+        case KernelTier::AVX:        return "avx";
+        case KernelTier::AVX2:       return "avx2";
+        case KernelTier::AVXVNNI:    return "avxvnni";
+        case KernelTier::AVX512:     return "avx512";
+        case KernelTier::AVX512VNNI: return "avx512vnni";
+        case KernelTier::AVX512BF16: return "avx512bf16";
+    }
+    return "unknown";
+}
+
+// Returns the kernels of the given tier or nullptr if the tier was not built.
+static const Kernels* get_tier_kernels(KernelTier tier)
+{
+    switch (tier) {
+        case KernelTier::Scalar:     return get_kernels_scalar();
+#if defined(GTEN_HAVE_KERNELS_SSE4)
+        case KernelTier::SSE4:       return get_kernels_sse4();
+#endif
+#if defined(GTEN_HAVE_KERNELS_AVX)
+        case KernelTier::AVX:        return get_kernels_avx();
+#endif
+#if defined(GTEN_HAVE_KERNELS_AVX2)
+        case KernelTier::AVX2:       return get_kernels_avx2();
+#endif
+#if defined(GTEN_HAVE_KERNELS_AVXVNNI)
+        case KernelTier::AVXVNNI:    return get_kernels_avxvnni();
+#endif
+#if defined(GTEN_HAVE_KERNELS_AVX512)
+        case KernelTier::AVX512:     return get_kernels_avx512();
+#endif
+#if defined(GTEN_HAVE_KERNELS_AVX512VNNI)
+        case KernelTier::AVX512VNNI: return get_kernels_avx512vnni();
+#endif
+#if defined(GTEN_HAVE_KERNELS_AVX512BF16)
+        case KernelTier::AVX512BF16: return get_kernels_avx512bf16();
+#endif
+        default: return nullptr;
+    }
+}
+
+// Returns true if the current cpu can execute the code of the given tier.
+static bool cpu_supports_tier(KernelTier tier)
+{
+    const CpuFeatures& f = cpu_features();
+    const bool avx2 = f.avx2 && f.fma && f.f16c;
+    const bool avx512 = avx2 && f.avx512f && f.avx512bw && f.avx512vl;
+    switch (tier) {
+        case KernelTier::Scalar:     return true;
+        case KernelTier::SSE4:       return f.sse4_1;
+        case KernelTier::AVX:        return f.avx && f.f16c;
+        case KernelTier::AVX2:       return avx2;
+        case KernelTier::AVXVNNI:    return avx2 && f.avxvnni;
+        case KernelTier::AVX512:     return avx512;
+        case KernelTier::AVX512VNNI: return avx512 && f.avx512vnni;
+        case KernelTier::AVX512BF16: return avx512 && f.avx512vnni && f.avx512bf16;
+    }
+    return false;
+}
+
+static const KernelTier kTiers[] = {
+    KernelTier::Scalar, KernelTier::SSE4, KernelTier::AVX, KernelTier::AVX2,
+    KernelTier::AVXVNNI, KernelTier::AVX512, KernelTier::AVX512VNNI, KernelTier::AVX512BF16
+};
+static const int kNumTiers = sizeof(kTiers) / sizeof(kTiers[0]);
+
+const Kernels* tier_kernels(KernelTier tier)
+{
+    return cpu_supports_tier(tier) ? get_tier_kernels(tier) : nullptr;
+}
+
+// A cheap check that the given kernels produce the results of the scalar kernels on a small
+// fixed input, which catches a miscompiled tier before it is used. The thorough test of each
+// tier is tests/kernels_test.cpp. Checks the integer dot products (including the packed ones
+// if the tier has them), the bf16 dot product and the exp approximation.
+static bool kernels_pass_smoke_check(const Kernels& k)
+{
+    const Kernels& ref = *get_kernels_scalar();
+
+    // Odd number of blocks (and of elements below) so that the kernels that process several
+    // blocks or elements at a time also run their tail code.
+    const int n_blocks = 3;
+    const int vec_size = n_blocks * globs::q8_block_size;
+    Q8Block a[n_blocks];
+    Q8Block b[n_blocks];
+    Q4Block c[n_blocks];
+    for (int i = 0; i < n_blocks; i++) {
+        a[i].delta = fp32_to_fp16(0.01f * (i + 1));
+        b[i].delta = fp32_to_fp16(0.02f / (i + 1));
+        c[i].delta = fp32_to_fp16(0.03f * (i + 1));
+        for (int j = 0; j < globs::q8_block_size; j++) {
+            // Cover the full range of the quants, [-127, 127] for q8 and [0, 15] for q4.
+            a[i].data[j] = static_cast<Qint8>((i * 37 + j * 11) % 255 - 127);
+            b[i].data[j] = static_cast<Qint8>((i * 53 + j * 29) % 255 - 127);
+        }
+        for (int j = 0; j < globs::q4_block_size / 2; j++) {
+            c[i].data[j] = static_cast<Qint8>((((i + j * 7) % 16) << 4) | ((i * 3 + j) % 16));
+        }
+    }
+
+    const float tol = 1e-4f;
+    auto matches = [tol](float actual, float expected) {
+        return std::fabs(actual - expected) <= tol * (1.0f + std::fabs(expected));
+    };
+    if (!matches(k.vec_dot_product_q8(a, b, vec_size), ref.vec_dot_product_q8(a, b, vec_size))
+        || !matches(k.vec_dot_product_q8_q4(a, c, vec_size), ref.vec_dot_product_q8_q4(a, c, vec_size))) {
+        return false;
+    }
+
+    if (k.vec_dot_product_q8_q4_packed) {
+        // A row group of copies of `c`.
+        const int n_rows = globs::q_pack_rows;
+        Q4Block c_rows[n_rows * n_blocks];
+        for (int r = 0; r < n_rows; r++) {
+            std::memcpy(c_rows + r * n_blocks, c, sizeof(c));
+        }
+        alignas(globs::q_pack_align) uint8_t c_group[ops::q4_packed_group_nbytes(n_blocks)];
+        ops::q4_pack_row_group(c_rows, c_group, vec_size);
+        float packed_actual[n_rows];
+        k.vec_dot_product_q8_q4_packed(a, ops::q_packed_group_deltas(c_group, 0), ops::q4_packed_group_quants(c_group, n_blocks, 0), packed_actual, vec_size);
+        if (!matches(packed_actual[n_rows - 1], ref.vec_dot_product_q8_q4(a, c, vec_size))) {
+            return false;
+        }
+    }
+
+    const int n = vec_size - 1;
+    BFloat16 bf16_a[n];
+    BFloat16 bf16_b[n];
+    float x[n];
+    for (int i = 0; i < n; i++) {
+        bf16_a[i] = fp32_to_bf16(0.01f * ((i * 37) % 255 - 127));
+        bf16_b[i] = fp32_to_bf16(0.02f * ((i * 53) % 255 - 127));
+        x[i] = -20.0f * static_cast<float>(i) / static_cast<float>(n);
+    }
+    if (!matches(k.vec_dot_product_bf16(bf16_a, bf16_b, n), ref.vec_dot_product_bf16(bf16_a, bf16_b, n))) {
+        return false;
+    }
+    // A shift of 0 gives exp(x).
+    k.vec_exp_sum_f32(x, 0.0f, n);
+    for (int i = 0; i < n; i++) {
+        const float expected = std::exp(-20.0f * static_cast<float>(i) / static_cast<float>(n));
+        if (std::fabs(x[i] - expected) > 1e-6f * expected) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static const Kernels* select_kernels()
+{
+    // Allow a lower tier to be forced, mostly for testing and benchmarking.
+    const char* requested = std::getenv("GTEN_KERNELS");
+    const bool has_request = requested && requested[0] != '\0';
+    int max_tier_idx = kNumTiers - 1;
+    if (has_request) {
+        int requested_idx = -1;
+        for (int i = 0; i < kNumTiers; i++) {
+            if (std::strcmp(requested, kernel_tier_str(kTiers[i])) == 0) {
+                requested_idx = i;
+                break;
+            }
+        }
+
+        if (requested_idx >= 0 && get_tier_kernels(kTiers[requested_idx]) && cpu_supports_tier(kTiers[requested_idx])) {
+            max_tier_idx = requested_idx;
+        } else {
+            std::cerr << "GTEN: ignoring GTEN_KERNELS=" << requested << " (unknown or unsupported tier)\n";
+        }
+    }
+
+    // The best tier that is built, supported by the cpu and passes the smoke check.
+    const Kernels* selected = get_kernels_scalar();
+    for (int i = max_tier_idx; i > 0; i--) {
+        const Kernels* candidate = tier_kernels(kTiers[i]);
+        if (!candidate) {
+            continue;
+        }
+        if (!kernels_pass_smoke_check(*candidate)) {
+            std::cerr << "GTEN: " << kernel_tier_str(kTiers[i]) << " kernels failed the startup check, "
+                      << "falling back to a lower tier\n";
+            continue;
+        }
+        selected = candidate;
+        break;
+    }
+
+    std::cerr << "GTEN: using the " << kernel_tier_str(selected->tier) << " kernels\n";
+    return selected;
+}
+
+const Kernels& kernels()
+{
+    static const Kernels* selected = select_kernels();
+    return *selected;
+}
+
+} // namespace gten
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "gten_types.h"
+#include "quants.h"
+
+
+namespace gten {
+
+// Instruction set tiers that we compile the kernels for, in increasing order of preference
+// when the cpu supports more than one.
+enum class KernelTier {
+    Scalar,
+    SSE4,
+    AVX,        // AVX + F16C
+    AVX2,       // AVX2 + FMA + F16C
+    AVXVNNI,    // AVX-VNNI + AVX2 + FMA + F16C
+    AVX512,     // AVX-512 F/BW/VL + AVX2 + FMA + F16C
+    AVX512VNNI, // AVX-512 VNNI + AVX512
+    AVX512BF16  // AVX-512 BF16 + AVX512VNNI
+};
+
+const char* kernel_tier_str(KernelTier tier);
+
+// The set of low-level kernels used by the ops. Each kernel tier is compiled in a separate
+// translation unit with the compiler flags for its instruction set (see CMakeLists.txt) and
+// the best tier supported by the cpu we are running on is selected at startup.
+struct Kernels {
+    KernelTier tier;
+
+    // Dot products.
+    float (*vec_dot_product_f16)(const Float16* vec_a, const Float16* vec_b, int vec_size);
+    float (*vec_dot_product_f32)(const float* vec_a, const float* vec_b, int vec_size);
+    float (*vec_dot_product_f32_f16)(const float* vec_a, const Float16* vec_b, int vec_size);
+    float (*vec_dot_product_bf16)(const BFloat16* vec_a, const BFloat16* vec_b, int vec_size);
+    float (*vec_dot_product_f32_bf16)(const float* vec_a, const BFloat16* vec_b, int vec_size);
+    float (*vec_dot_product_q8)(const Q8Block* inp0, const Q8Block* inp1, int vec_size);
+    float (*vec_dot_product_q8_q4)(const Q8Block* inp0, const Q4Block* inp1, int vec_size);
+
+    // Dot products of an input row with each of the `globs::q_pack_rows` weight rows of a row
+    // group of a packed weight (see quants.h) which are written to `out`. `w_deltas` and
+    // `w_quants` point to the first block of the group to use, which allows computing the dot
+    // products over a range of the blocks. These are null for the tiers that do not have
+    // packed kernels, in which case the weights are not packed.
+    void (*vec_dot_product_q8_packed)(const Q8Block* inp, const Float16* w_deltas, const Qint8* w_quants, float* out, int vec_size);
+    void (*vec_dot_product_q8_q4_packed)(const Q8Block* inp, const Float16* w_deltas, const Qint8* w_quants, float* out, int vec_size);
+
+    // Quantization and dtype conversions.
+    void (*q8_quantize_row)(const float* inp, Q8Block* out, int rowsize);
+    void (*q8_dequantize_row)(const Q8Block* inp, float* out, int rowsize);
+    void (*q4_quantize_row)(const float* inp, Q4Block* out, int rowsize);
+    void (*q4_dequantize_row)(const Q4Block* inp, float* out, int rowsize);
+    void (*fp16_to_fp32_row)(const Float16* inp, float* out, int rowsize);
+    void (*fp32_to_fp16_row)(const float* inp, Float16* out, int rowsize);
+    void (*bf16_to_fp32_row)(const BFloat16* inp, float* out, int rowsize);
+    void (*fp32_to_bf16_row)(const float* inp, BFloat16* out, int rowsize);
+
+    // Elementwise ops.
+    void (*vec_add_f32)(const float* a, const float* b, float* out, int vec_size);
+    void (*vec_scale_f32)(float* a, float scalar, int vec_size);
+    // Rotates the pairs (x[j], x[j + d_half]) for j in [0, d_half) by the angles whose
+    // cosines and sines are cos[j] and sin[j], i.e the rotary embedding of a head.
+    void (*vec_rope_f32)(float* x, const float* cos, const float* sin, int d_half);
+
+    // Math. The SIMD tiers compute exp with a polynomial approximation (see simd_ops.h)
+    // which is checked against std::exp by the kernel tests.
+    float (*vec_max_f32)(const float* x, int vec_size);
+    float (*vec_sum_f32)(const float* x, int vec_size);
+    // Returns the sum of (x[i] - shift)^2.
+    float (*vec_sum_squares_f32)(const float* x, float shift, int vec_size);
+    // Replaces x[i] by exp(x[i] - shift) and returns their sum, e.g the softmax numerators.
+    float (*vec_exp_sum_f32)(float* x, float shift, int vec_size);
+    // out = x / (1 + exp(-x)), `out` may be `x`.
+    void (*vec_silu_f32)(const float* x, float* out, int vec_size);
+    // out = silu(gate) * up, `out` may be `gate`.
+    void (*vec_silu_mul_f32)(const float* gate, const float* up, float* out, int vec_size);
+    // out = (x - shift) * scale * weight + bias, the last step of the layer and rms norms.
+    // `bias` may be null.
+    void (*vec_norm_f32)(const float* x, const Float16* weight, const Float16* bias, float shift, float scale, float* out, int vec_size);
+
+    // Weighted sums. out += w * x, where x is a row of fp16, q8 or q4 values, e.g a value row
+    // of the kv cache weighted by its attention probability.
+    void (*vec_axpy_f16)(float w, const Float16* x, float* out, int vec_size);
+    void (*vec_axpy_q8)(float w, const Q8Block* x, float* out, int vec_size);
+    void (*vec_axpy_q4)(float w, const Q4Block* x, float* out, int vec_size);
+};
+
+// Returns the kernels for the best tier supported by the cpu. The tier is selected on the
+// first call and can be lowered (e.g for testing) by setting the `GTEN_KERNELS` environment
+// variable to one of: scalar, sse4, avx, avx2, avxvnni, avx512, avx512vnni, avx512bf16. A few
+// kernels of the selected tier are checked against the scalar kernels on a small input before
+// it is used and we fall back to a lower tier (with a message) if they do not match. The
+// selected tier is printed once, to stderr.
+const Kernels& kernels();
+
+// Returns the kernels of the given tier, or nullptr if the tier was not built or the cpu
+// cannot run it. Used by the tests to check each tier against the scalar kernels.
+const Kernels* tier_kernels(KernelTier tier);
+
+// Kernel tables for each tier. Only the tiers that the compiler supports are built.
+const Kernels* get_kernels_scalar();
+const Kernels* get_kernels_sse4();
+const Kernels* get_kernels_avx();
+const Kernels* get_kernels_avx2();
+const Kernels* get_kernels_avxvnni();
+const Kernels* get_kernels_avx512();
+const Kernels* get_kernels_avx512vnni();
+const Kernels* get_kernels_avx512bf16();
+
+} // namespace gten
@@ -0,0 +1,8 @@
+// Kernels compiled with the AVX instruction set flags (see CMakeLists.txt).
+#if defined(GTEN_HAVE_KERNELS_AVX)
+
+#define GTEN_KERNELS_GETTER get_kernels_avx
+#define GTEN_KERNELS_TIER KernelTier::AVX
+#include "kernels_impl.h"
+
+#endif
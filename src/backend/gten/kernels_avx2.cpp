@@ -0,0 +1,8 @@
+// Kernels compiled with the AVX2 instruction set flags (see CMakeLists.txt).
+#if defined(GTEN_HAVE_KERNELS_AVX2)
+
+#define GTEN_KERNELS_GETTER get_kernels_avx2
+#define GTEN_KERNELS_TIER KernelTier::AVX2
+#include "kernels_impl.h"
+
+#endif
@@ -0,0 +1,8 @@
+// Kernels compiled with the AVX512 instruction set flags (see CMakeLists.txt).
+#if defined(GTEN_HAVE_KERNELS_AVX512)
+
+#define GTEN_KERNELS_GETTER get_kernels_avx512
+#define GTEN_KERNELS_TIER KernelTier::AVX512
+#include "kernels_impl.h"
+
+#endif
@@ -0,0 +1,8 @@
+// Kernels compiled with the AVX512BF16 instruction set flags (see CMakeLists.txt).
+#if defined(GTEN_HAVE_KERNELS_AVX512BF16)
+
+#define GTEN_KERNELS_GETTER get_kernels_avx512bf16
+#define GTEN_KERNELS_TIER KernelTier::AVX512BF16
+#include "kernels_impl.h"
+
+#endif
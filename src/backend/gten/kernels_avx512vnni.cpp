@@ -0,0 +1,8 @@
+// Kernels compiled with the AVX512VNNI instruction set flags (see CMakeLists.txt).
+#if defined(GTEN_HAVE_KERNELS_AVX512VNNI)
+
+#define GTEN_KERNELS_GETTER get_kernels_avx512vnni
+#define GTEN_KERNELS_TIER KernelTier::AVX512VNNI
+#include "kernels_impl.h"
+
+#endif
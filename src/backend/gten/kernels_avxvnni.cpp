@@ -0,0 +1,8 @@
+// Kernels compiled with the AVXVNNI instruction set flags (see CMakeLists.txt).
+#if defined(GTEN_HAVE_KERNELS_AVXVNNI)
+
+#define GTEN_KERNELS_GETTER get_kernels_avxvnni
+#define GTEN_KERNELS_TIER KernelTier::AVXVNNI
+#include "kernels_impl.h"
+
+#endif
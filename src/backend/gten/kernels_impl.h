@@ -0,0 +1,1519 @@
+// KERNELS IMPLEMENTATION.
+// This file is included by each of the kernels_<tier>.cpp files which are compiled with the
+// compiler flags of their instruction set tier. The code below selects the best instructions
+// it can use with the ISA macros (__AVX2__, __F16C__, etc) defined for the tier.
+//
+// NOTE: Every function here must have internal linkage (static) and must not call non-static
+// inline functions defined in other headers (e.g std::max). Otherwise, the linker could merge
+// a copy compiled for a higher tier into code that runs on cpus that do not support it.
+
+#pragma once
+
+#include <math.h>
+#include <string.h>
+
+#include "gten_types.h"
+#include "kernels.h"
+#include "log.h"
+#include "quants.h"
+#include "simd_ops.h"
+
+#if defined(__AVX512F__) && defined(__GNUC__) && !defined(__clang__)
+// GCC 12 reports false uninitialized warnings inside the AVX-512 intrinsics headers
+// (_mm256_undefined_si256 etc) which break the -Werror build.
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+#if defined(__SSE4_1__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+#if !defined(GTEN_KERNELS_GETTER) || !defined(GTEN_KERNELS_TIER)
+#error "GTEN_KERNELS_GETTER and GTEN_KERNELS_TIER must be defined before including kernels_impl.h"
+#endif
+
+
+namespace gten {
+namespace impl {
+
+using namespace ops;
+
+// fp16 -> fp32 conversion of a single value. Note: The lookup table is faster than F16C
+// (_cvtsh_ss) for single values, which needs a move to a vector register.
+static inline float fp16_to_fp32_single(Float16 x) {
+    return fp16_to_fp32(x);
+}
+
+// fp32 -> fp16 conversion of a single value.
+static inline Float16 fp32_to_fp16_single(float x) {
+#if defined(__F16C__)
+    return _cvtss_sh(x, 0);
+#else
+    return fp32_to_fp16(x);
+#endif
+}
+
+#if defined(__AVX512F__)
+static inline float vec_f32x16_sum(__m512 vec) {
+    return _mm512_reduce_add_ps(vec);
+}
+#endif
+
+
+/* ----------------------------------------------------------------------------------- */
+/*                                   ELEMENTWISE                                       */
+/* ----------------------------------------------------------------------------------- */
+
+static void vec_scale_f32(float* a, const float scalar, int vec_size)
+{
+#if defined(__AVX__)
+    const int simd_vec_size = (vec_size / GTEN_SIMD_VEC_SIZE) * GTEN_SIMD_VEC_SIZE;
+
+    const Vec_f32x8 scalar_vec = _mm256_set1_ps(scalar);
+    for (int i = 0; i < simd_vec_size; i += GTEN_SIMD_VEC_SIZE) {
+        const Vec_f32x8 x = vec_f32x8_load(a + i);
+        vec_f32x8_store(vec_f32x8_mul(x, scalar_vec), a + i);
+    }
+
+    for (int i = simd_vec_size; i < vec_size; i++) {
+        a[i] = a[i] * scalar;
+    }
+#else
+    const int unrolled_vec_size = (vec_size / 8) * 8;
+
+    for (int i = 0; i < unrolled_vec_size; i += 8) {
+        a[i + 0] = a[i + 0] * scalar;
+        a[i + 1] = a[i + 1] * scalar;
+        a[i + 2] = a[i + 2] * scalar;
+        a[i + 3] = a[i + 3] * scalar;
+        a[i + 4] = a[i + 4] * scalar;
+        a[i + 5] = a[i + 5] * scalar;
+        a[i + 6] = a[i + 6] * scalar;
+        a[i + 7] = a[i + 7] * scalar;
+    }
+
+    // leftovers
+    for (int i = unrolled_vec_size; i < vec_size; i++) {
+        a[i] = a[i] * scalar;
+    }
+#endif
+}
+
+static void vec_add_f32(const float* a, const float* b, float* out, int vec_size)
+{
+#if defined(__AVX512F__)
+    const int simd_vec_size = (vec_size / 16) * 16;
+
+    for (int i = 0; i < simd_vec_size; i += 16) {
+        const __m512 x0 = _mm512_loadu_ps(a + i);
+        const __m512 x1 = _mm512_loadu_ps(b + i);
+        _mm512_storeu_ps(out + i, _mm512_add_ps(x0, x1));
+    }
+
+    for (int i = simd_vec_size; i < vec_size; i++) {
+        out[i] = a[i] + b[i];
+    }
+
+#elif defined(__AVX__)
+
+    const int simd_vec_size = (vec_size / GTEN_SIMD_VEC_SIZE) * GTEN_SIMD_VEC_SIZE;
+
+    for (int i = 0; i < simd_vec_size; i += GTEN_SIMD_VEC_SIZE) {
+        Vec_f32x8 x0 = vec_f32x8_load(a + i);
+        Vec_f32x8 x1 = vec_f32x8_load(b + i);
+        Vec_f32x8 x_sum = vec_f32x8_add(x0, x1);
+        vec_f32x8_store(x_sum, out + i);
+    }
+
+    for (int i = simd_vec_size; i < vec_size; i++) {
+        const float x0 = a[i];
+        const float x1 = b[i];
+        out[i] = x0 + x1;
+    }
+
+#else
+    const int unrolled_vec_size = (vec_size / 8) * 8;
+
+    for (int i = 0; i < unrolled_vec_size; i += 8) {
+        out[i] = a[i] + b[i];
+        out[i + 1] = a[i + 1] + b[i + 1];
+        out[i + 2] = a[i + 2] + b[i + 2];
+        out[i + 3] = a[i + 3] + b[i + 3];
+        out[i + 4] = a[i + 4] + b[i + 4];
+        out[i + 5] = a[i + 5] + b[i + 5];
+        out[i + 6] = a[i + 6] + b[i + 6];
+        out[i + 7] = a[i + 7] + b[i + 7];
+    }
+
+    // leftovers
+    for (int i = unrolled_vec_size; i < vec_size; i++) {
+        out[i] = a[i] + b[i];
+    }
+
+#endif
+}
+
+static void vec_rope_f32(float* x, const float* cos, const float* sin, int d_half)
+{
+    float* x0 = x;
+    float* x1 = x + d_half;
+#if defined(__AVX__)
+    const int simd_vec_size = (d_half / GTEN_SIMD_VEC_SIZE) * GTEN_SIMD_VEC_SIZE;
+
+    for (int j = 0; j < simd_vec_size; j += GTEN_SIMD_VEC_SIZE) {
+        const Vec_f32x8 a = vec_f32x8_load(x0 + j);
+        const Vec_f32x8 b = vec_f32x8_load(x1 + j);
+        const Vec_f32x8 c = vec_f32x8_load(cos + j);
+        const Vec_f32x8 s = vec_f32x8_load(sin + j);
+        vec_f32x8_store(vec_f32x8_sub(vec_f32x8_mul(a, c), vec_f32x8_mul(b, s)), x0 + j);
+        vec_f32x8_store(vec_f32x8_add(vec_f32x8_mul(a, s), vec_f32x8_mul(b, c)), x1 + j);
+    }
+#else
+    const int simd_vec_size = 0;
+#endif
+
+    for (int j = simd_vec_size; j < d_half; j++) {
+        const float a = x0[j];
+        const float b = x1[j];
+        x0[j] = a * cos[j] - b * sin[j];
+        x1[j] = a * sin[j] + b * cos[j];
+    }
+}
+
+
+/* ----------------------------------------------------------------------------------- */
+/*                                       MATH                                          */
+/* ----------------------------------------------------------------------------------- */
+
+static float vec_max_f32(const float* x, int vec_size)
+{
+    float max = -INFINITY;
+    int i = 0;
+#if defined(__AVX__)
+    if (vec_size >= GTEN_SIMD_VEC_SIZE) {
+        Vec_f32x8 max_vec = vec_f32x8_load(x);
+        for (i = GTEN_SIMD_VEC_SIZE; i + GTEN_SIMD_VEC_SIZE <= vec_size; i += GTEN_SIMD_VEC_SIZE) {
+            max_vec = vec_f32x8_max(max_vec, vec_f32x8_load(x + i));
+        }
+        max = vec_f32x8_max_reduce(max_vec);
+    }
+#endif
+    for (; i < vec_size; i++) {
+        max = x[i] > max ? x[i] : max;
+    }
+    return max;
+}
+
+static float vec_sum_f32(const float* x, int vec_size)
+{
+    float sum = 0.0f;
+    int i = 0;
+#if defined(__AVX__)
+    Vec_f32x8 sum_vec = vec_f32x8_setzero();
+    for (; i + GTEN_SIMD_VEC_SIZE <= vec_size; i += GTEN_SIMD_VEC_SIZE) {
+        sum_vec = vec_f32x8_add(sum_vec, vec_f32x8_load(x + i));
+    }
+    sum = vec_f32x8_sum(sum_vec);
+#endif
+    for (; i < vec_size; i++) {
+        sum += x[i];
+    }
+    return sum;
+}
+
+static float vec_sum_squares_f32(const float* x, const float shift, int vec_size)
+{
+    float sum = 0.0f;
+    int i = 0;
+#if defined(__AVX__)
+    const Vec_f32x8 shift_vec = vec_f32x8_set1(shift);
+    Vec_f32x8 sum_vec = vec_f32x8_setzero();
+    for (; i + GTEN_SIMD_VEC_SIZE <= vec_size; i += GTEN_SIMD_VEC_SIZE) {
+        const Vec_f32x8 d = vec_f32x8_sub(vec_f32x8_load(x + i), shift_vec);
+        sum_vec = vec_f32x8_fma(d, d, sum_vec);
+    }
+    sum = vec_f32x8_sum(sum_vec);
+#endif
+    for (; i < vec_size; i++) {
+        const float d = x[i] - shift;
+        sum += d * d;
+    }
+    return sum;
+}
+
+static float vec_exp_sum_f32(float* x, const float shift, int vec_size)
+{
+    float sum = 0.0f;
+    int i = 0;
+#if defined(__AVX__)
+    const Vec_f32x8 shift_vec = vec_f32x8_set1(shift);
+    Vec_f32x8 sum_vec = vec_f32x8_setzero();
+    for (; i + GTEN_SIMD_VEC_SIZE <= vec_size; i += GTEN_SIMD_VEC_SIZE) {
+        const Vec_f32x8 e = vec_f32x8_exp(vec_f32x8_sub(vec_f32x8_load(x + i), shift_vec));
+        vec_f32x8_store(e, x + i);
+        sum_vec = vec_f32x8_add(sum_vec, e);
+    }
+    sum = vec_f32x8_sum(sum_vec);
+#endif
+    for (; i < vec_size; i++) {
+        x[i] = expf(x[i] - shift);
+        sum += x[i];
+    }
+    return sum;
+}
+
+static void vec_silu_f32(const float* x, float* out, int vec_size)
+{
+    int i = 0;
+#if defined(__AVX__)
+    for (; i + GTEN_SIMD_VEC_SIZE <= vec_size; i += GTEN_SIMD_VEC_SIZE) {
+        vec_f32x8_store(vec_f32x8_silu(vec_f32x8_load(x + i)), out + i);
+    }
+#endif
+    for (; i < vec_size; i++) {
+        out[i] = x[i] / (1.0f + expf(-x[i]));
+    }
+}
+
+static void vec_silu_mul_f32(const float* gate, const float* up, float* out, int vec_size)
+{
+    int i = 0;
+#if defined(__AVX__)
+    for (; i + GTEN_SIMD_VEC_SIZE <= vec_size; i += GTEN_SIMD_VEC_SIZE) {
+        const Vec_f32x8 silu = vec_f32x8_silu(vec_f32x8_load(gate + i));
+        vec_f32x8_store(vec_f32x8_mul(silu, vec_f32x8_load(up + i)), out + i);
+    }
+#endif
+    for (; i < vec_size; i++) {
+        out[i] = gate[i] / (1.0f + expf(-gate[i])) * up[i];
+    }
+}
+
+static void vec_norm_f32(const float* x, const Float16* weight, const Float16* bias, const float shift, const float scale, float* out, int vec_size)
+{
+    int i = 0;
+#if defined(__AVX__)
+    const Vec_f32x8 shift_vec = vec_f32x8_set1(shift);
+    const Vec_f32x8 scale_vec = vec_f32x8_set1(scale);
+    for (; i + GTEN_SIMD_VEC_SIZE <= vec_size; i += GTEN_SIMD_VEC_SIZE) {
+        const Vec_f32x8 norm = vec_f32x8_mul(vec_f32x8_sub(vec_f32x8_load(x + i), shift_vec), scale_vec);
+        Vec_f32x8 res = vec_f32x8_mul(norm, vec_f32x8_load(weight + i));
+        if (bias) {
+            res = vec_f32x8_add(res, vec_f32x8_load(bias + i));
+        }
+        vec_f32x8_store(res, out + i);
+    }
+#endif
+    for (; i < vec_size; i++) {
+        const float norm = (x[i] - shift) * scale * fp16_to_fp32_single(weight[i]);
+        out[i] = bias ? norm + fp16_to_fp32_single(bias[i]) : norm;
+    }
+}
+
+
+/* ----------------------------------------------------------------------------------- */
+/*                                 DTYPE CONVERSIONS                                   */
+/* ----------------------------------------------------------------------------------- */
+
+static void fp16_to_fp32_row(const Float16* inp, float* out, int rowsize)
+{
+#if defined(__AVX512F__)
+    const int simd_n_blocks = rowsize / 16;
+
+    for (int i = 0; i < simd_n_blocks; ++i) {
+        const __m512 fp32 = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(inp + i*16)));
+        _mm512_storeu_ps(out + i*16, fp32);
+    }
+
+    for (int i = simd_n_blocks*16; i < rowsize; ++i) {
+        out[i] = fp16_to_fp32_single(inp[i]);
+    }
+#elif defined(__AVX__) && defined(__F16C__)
+    const int simd_n_blocks = rowsize / 8;
+
+    for (int i = 0; i < simd_n_blocks; ++i) {
+        const __m256 fp32 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i_u *)(inp + i*8)));
+        _mm256_storeu_ps(out + i*8, fp32);
+    }
+
+    for (int i = simd_n_blocks*8; i < rowsize; ++i) {
+        out[i] = fp16_to_fp32_single(inp[i]);
+    }
+#else
+    for (int i = 0; i < rowsize; i++) {
+        out[i] = fp16_to_fp32_single(inp[i]);
+    }
+#endif
+}
+
+static void fp32_to_fp16_row(const float* inp, Float16* out, int rowsize)
+{
+#if defined(__AVX512F__)
+    const int simd_n_blocks = rowsize / 16;
+
+    for (int i = 0; i < simd_n_blocks; ++i) {
+        const __m512 fp32 = _mm512_loadu_ps(inp + i*16);
+        _mm256_storeu_si256((__m256i*)(out + i*16), _mm512_cvtps_ph(fp32, 0));
+    }
+
+    for (int i = simd_n_blocks*16; i < rowsize; ++i) {
+        out[i] = fp32_to_fp16_single(inp[i]);
+    }
+#elif defined(__AVX__) && defined(__F16C__)
+    const int simd_n_blocks = rowsize / 8;
+
+    for (int i = 0; i < simd_n_blocks; ++i) {
+        const __m256 fp32 = _mm256_loadu_ps(inp + i*8);
+        _mm_storeu_si128((__m128i_u *)(out + i*8), _mm256_cvtps_ph(fp32, 0));
+    }
+
+    for (int i = simd_n_blocks*8; i < rowsize; ++i) {
+        out[i] = fp32_to_fp16_single(inp[i]);
+    }
+#else
+    for (int i = 0; i < rowsize; i++) {
+        out[i] = fp32_to_fp16_single(inp[i]);
+    }
+#endif
+}
+
+
+/* ----------------------------------------------------------------------------------- */
+/*                                   QUANTIZATION                                      */
+/* ----------------------------------------------------------------------------------- */
+
+#if defined(__AVX__)
+// Rounds to the nearest integer with the ties away from zero, like roundf, so that the
+// quants are the same as the scalar ones.
+static inline __m256 vec_f32x8_round(const __m256 x) {
+    const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+    const __m256 trunc = _mm256_round_ps(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    const __m256 frac = _mm256_andnot_ps(sign_mask, _mm256_sub_ps(x, trunc));
+    const __m256 signed_one = _mm256_or_ps(_mm256_and_ps(x, sign_mask), _mm256_set1_ps(1.0f));
+    const __m256 round_up = _mm256_cmp_ps(frac, _mm256_set1_ps(0.5f), _CMP_GE_OQ);
+    return _mm256_add_ps(trunc, _mm256_and_ps(round_up, signed_one));
+}
+
+// Loads the 32 floats of a block into `x` and returns the max of their absolute values.
+static inline float vec_load_block_absmax(const float* inp, __m256 x[4]) {
+    const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+    __m256 absmax = _mm256_setzero_ps();
+    for (int i = 0; i < 4; i++) {
+        x[i] = _mm256_loadu_ps(inp + i * 8);
+        absmax = _mm256_max_ps(absmax, _mm256_andnot_ps(sign_mask, x[i]));
+    }
+    return vec_f32x8_max_reduce(absmax);
+}
+
+// Returns the 16 quants round(x * scale) of two vectors, in order, saturated to int8.
+static inline __m128i vec_quantize_2x8(const __m256 x0, const __m256 x1, const __m256 scale) {
+    const __m256i i0 = _mm256_cvttps_epi32(vec_f32x8_round(_mm256_mul_ps(x0, scale)));
+    const __m256i i1 = _mm256_cvttps_epi32(vec_f32x8_round(_mm256_mul_ps(x1, scale)));
+    // The 128-bit packs keep the order of the elements, unlike the 256-bit ones.
+    const __m128i p0 = _mm_packs_epi32(_mm256_castsi256_si128(i0), _mm256_extractf128_si256(i0, 1));
+    const __m128i p1 = _mm_packs_epi32(_mm256_castsi256_si128(i1), _mm256_extractf128_si256(i1, 1));
+    return _mm_packs_epi16(p0, p1);
+}
+#endif
+
+static void q8_quantize_block(const float* inp, Q8Block* out, const int block_size) {
+#if defined(__AVX__)
+    if (block_size == globs::q8_block_size) {
+        static_assert(globs::q8_block_size == 32, "The simd code quantizes blocks of 32.");
+        __m256 x[4];
+        const float delta = vec_load_block_absmax(inp, x) / 127.0f;
+        out->delta = fp32_to_fp16_single(delta);
+
+        const __m256 scale = _mm256_set1_ps(delta ? 1.0f/delta : 0.0f);
+        _mm_storeu_si128((__m128i*)out->data, vec_quantize_2x8(x[0], x[1], scale));
+        _mm_storeu_si128((__m128i*)(out->data + 16), vec_quantize_2x8(x[2], x[3], scale));
+        return;
+    }
+#endif
+
+    float absmax = 0;
+    for (int j = 0; j < block_size; j++) {
+        const float x = fabsf(inp[j]);
+        absmax = x > absmax ? x : absmax;
+    }
+
+    const float delta = absmax / 127.0f;
+    out->delta = fp32_to_fp16_single(delta);
+
+    const float scale = delta ? 1.0f/delta : 0.0f;
+    for (int i = 0; i < block_size; i++) {
+        out->data[i] = static_cast<Qint8>(roundf(inp[i] * scale));
+    }
+}
+
+
+static void q8_dequantize_block(const Q8Block* inp, float* out, const int block_size) {
+#if defined(__AVX2__)
+    if (block_size == globs::q8_block_size) {
+        const __m256 delta_vec = _mm256_set1_ps(fp16_to_fp32_single(inp->delta));
+        for (int i = 0; i < 4; i++) {
+            const __m256i quants = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(inp->data + i*8)));
+            _mm256_storeu_ps(out + i*8, _mm256_mul_ps(_mm256_cvtepi32_ps(quants), delta_vec));
+        }
+        return;
+    }
+#endif
+#if defined(__SSE4_1__)
+    const int simd_n_blocks = (block_size / 8);
+
+    const float delta = fp16_to_fp32_single(inp->delta);
+    for (int i = 0; i < simd_n_blocks; ++i) {
+        // Load 64-bit(8 1-byte quants) in the lower half. [8-quants, -------].
+        const __m128i a00 = _mm_loadu_si64(inp->data + i*8);
+
+        // how many 32-bit flts in avx register: 8, sse: 4
+        const __m128 a01 = _mm_cvtepi32_ps(_mm_cvtepi8_epi32(a00));
+        const __m128 a02 = _mm_cvtepi32_ps(_mm_cvtepi8_epi32(_mm_bsrli_si128(a00, 4)));
+
+        const __m128 delta_vec = _mm_set1_ps(delta);
+        const __m128 a03 = _mm_mul_ps(a01, delta_vec);
+        const __m128 a04 = _mm_mul_ps(a02, delta_vec);
+
+        _mm_storeu_ps(out + i*8, a03);
+        _mm_storeu_ps(out + i*8 + 4, a04);
+    }
+
+    for (int i = simd_n_blocks*8; i < block_size; ++i) {
+       out[i] = inp->data[i] * delta;
+    }
+#else
+    const float delta = fp16_to_fp32_single(inp->delta);
+    for (int i = 0; i < block_size; i++) {
+        out[i] = inp->data[i] * delta;
+    }
+#endif
+}
+
+
+static void q4_dequantize_block(const Q4Block* inp, float* out) {
+    const int block_size = globs::q4_block_size;
+
+#if defined(__AVX2__)
+    GTEN_ASSERT(block_size == 32);
+    // Unpack the 32 4-bit quants into 32 8-bit ints: [16 high quants, 16 low quants].
+    const __m128i packed = _mm_loadu_si128((const __m128i*)inp->data);
+    const __m128i and_vec = _mm_set1_epi8(0b00001111);
+    const __m128i add_vec = _mm_set1_epi8(-7);
+    const __m128i high = _mm_add_epi8(_mm_and_si128(_mm_srli_epi16(packed, 4), and_vec), add_vec);
+    const __m128i low = _mm_add_epi8(_mm_and_si128(packed, and_vec), add_vec);
+
+    const __m256 delta_vec = _mm256_set1_ps(fp16_to_fp32_single(inp->delta));
+    // cvt each group of 8 quants to floats and scale them.
+    const __m256 b00 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(high));
+    const __m256 b01 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_bsrli_si128(high, 8)));
+    const __m256 b02 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(low));
+    const __m256 b03 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_bsrli_si128(low, 8)));
+
+    _mm256_storeu_ps(out, _mm256_mul_ps(b00, delta_vec));
+    _mm256_storeu_ps(out + 8, _mm256_mul_ps(b01, delta_vec));
+    _mm256_storeu_ps(out + 16, _mm256_mul_ps(b02, delta_vec));
+    _mm256_storeu_ps(out + 24, _mm256_mul_ps(b03, delta_vec));
+#elif defined(__SSE4_1__)
+    for (int i = 0; i < block_size/16; i++)
+    {
+        // Q4 layout: the first 16 quants are in the higher 4-bits of the 16 bytes
+        // and the next 16 values are in the lower.
+
+        // Here, we want to map the 16 quants into 32 floats (4 __m128)
+
+        // 16 vals -> 4 128, 2 [256]
+        // load a block of 16 4-bit ints (8 bytes) into lower 64 bits.
+        const __m128i b00 = _mm_loadu_si64(inp->data + i*8);
+        // cvt each of the 8 bytes to 16-bit integer.
+        const __m128i b01 = _mm_cvtepu8_epi16(b00); // 8 16-bit quants => 128bits
+        const __m128i add_vec = _mm_set1_epi16(-7);
+        // extract the first 8 4-bit quants stored in high 4 bits in each of the 8 bytes.
+        const __m128i b03 = _mm_add_epi16(_mm_srli_epi16(b01, 4), add_vec); // first 8 values
+        // // extract the 8 4-bit quants stored in low 4 bits in each of the 8 bytes.
+        const __m128i and_vec = _mm_set1_epi16(0b0000000000001111);
+        const __m128i b04 = _mm_add_epi16(_mm_and_si128(b01, and_vec), add_vec);
+        // cvt 4 low b03 to floats.
+        const __m128 b05 = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(b03));
+        // cvt 4 high b03 to floats.
+        // note: we shift right by 8 bytes instead of left because the elements
+        // in the SSE/AVX registers are stored in reverse format.
+        const __m128 b06 = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_bsrli_si128(b03, 8))); // v << 64
+
+        // cvt 4 low b03 to floats.
+        const __m128 b07 = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(b04));
+        // cvt 4 high b03 to floats.
+        const __m128 b08 = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_bsrli_si128(b04, 8)));
+
+        const __m128 delta_vec = _mm_set1_ps(fp16_to_fp32_single(inp->delta));
+        const __m128 b09 = _mm_mul_ps(b05, delta_vec);
+        const __m128 b10 = _mm_mul_ps(b06, delta_vec);
+        const __m128 b11 = _mm_mul_ps(b07, delta_vec);
+        const __m128 b12 = _mm_mul_ps(b08, delta_vec);
+
+        _mm_storeu_ps(out + i*8, b09);
+        _mm_storeu_ps(out + i*8 + 4, b10);
+
+        _mm_storeu_ps(out + i*8 + 16, b11);
+        _mm_storeu_ps(out + i*8 + 16 + 4, b12);
+    }
+#else
+    const float delta = fp16_to_fp32_single(inp->delta);
+    const int half_block_size = block_size / 2;
+    for (int i = 0; i < half_block_size; i += 1) {
+        const Qint4 packed = inp->data[i];
+        const Qint8 high = (packed >> 4) - 7;
+        const Qint8 low = (packed & 0b00001111) - 7;
+        out[i] = high * delta;
+        out[i+half_block_size] = low * delta;
+    }
+#endif
+}
+
+static void q8_quantize_row(const float* inp, Q8Block* out, const int rowsize) {
+    const int block_size = globs::q8_block_size;
+    const int n_blocks = rowsize / block_size;
+
+    for (int i = 0; i < n_blocks; i++) {
+        const float* inp_block_data = inp + i * block_size;
+        Q8Block* out_block_data = out + i;
+
+        q8_quantize_block(inp_block_data, out_block_data, globs::q8_block_size);
+    }
+
+    // Quantize the partial last block (i.e it contains < block_size numbers) if it exists.
+    const int remsize = rowsize % block_size;
+    if (remsize != 0) {
+        const float* last_inp_block_data = inp + n_blocks * block_size;
+        Q8Block* last_block = out + n_blocks;
+        q8_quantize_block(last_inp_block_data, last_block, remsize);
+    }
+}
+
+static void q8_dequantize_row(const Q8Block* inp, float* out, int rowsize) {
+    const int block_size = globs::q8_block_size;
+    const int n_blocks = rowsize / block_size;
+
+    for (int i = 0; i < n_blocks; i++) {
+        q8_dequantize_block(inp + i, out + i * block_size, globs::q8_block_size);
+    }
+
+    // De-quantize the partial last block (i.e it contains < block_size numbers) if it exists.
+    const int remsize = rowsize % block_size;
+    if (remsize != 0) {
+        float* last_out_block_data = out + n_blocks * block_size;
+        const Q8Block* last_block = inp + n_blocks;
+        q8_dequantize_block(last_block, last_out_block_data, remsize);
+    }
+}
+
+// Quantizes a block with the symmetric range [-7, 7] of the q4 quants (stored as [0, 15]).
+static void q4_quantize_block(const float* inp, Q4Block* out) {
+#if defined(__AVX__)
+    static_assert(globs::q4_block_size == 32, "The simd code quantizes blocks of 32.");
+    __m256 x[4];
+    const float delta = vec_load_block_absmax(inp, x) / 7.0f;
+    out->delta = fp32_to_fp16_single(delta);
+
+    const __m256 scale = _mm256_set1_ps(delta ? 1.0f/delta : 0.0f);
+    const __m128i seven = _mm_set1_epi8(7);
+    // The quants are in [0, 14] so shifting the 16-bit lanes does not carry bits across bytes.
+    const __m128i high = _mm_add_epi8(vec_quantize_2x8(x[0], x[1], scale), seven);
+    const __m128i low = _mm_add_epi8(vec_quantize_2x8(x[2], x[3], scale), seven);
+    _mm_storeu_si128((__m128i*)out->data, _mm_or_si128(_mm_slli_epi16(high, 4), low));
+#else
+    const int block_size = globs::q4_block_size;
+    const int half_block_size = block_size / 2;
+
+    float absmax = 0;
+    for (int j = 0; j < block_size; j++) {
+        const float x = fabsf(inp[j]);
+        absmax = x > absmax ? x : absmax;
+    }
+
+    const float delta = absmax / 7.0f;
+    out->delta = fp32_to_fp16_single(delta);
+
+    const float scale = delta ? 1.0f/delta : 0.0f;
+    for (int i = 0; i < half_block_size; i++) {
+        const int high = static_cast<int>(roundf(inp[i] * scale)) + 7;
+        const int low = static_cast<int>(roundf(inp[i + half_block_size] * scale)) + 7;
+        out->data[i] = static_cast<Qint8>((high << 4) | low);
+    }
+#endif
+}
+
+static void q4_quantize_row(const float* inp, Q4Block* out, int rowsize) {
+    const int block_size = globs::q4_block_size;
+    GTEN_ASSERT(rowsize % block_size == 0);
+    const int n_blocks = rowsize / block_size;
+
+    for (int i = 0; i < n_blocks; i++) {
+        q4_quantize_block(inp + i * block_size, out + i);
+    }
+}
+
+static void q4_dequantize_row(const Q4Block* inp, float* out, int rowsize) {
+    const int block_size = globs::q4_block_size;
+    GTEN_ASSERT(rowsize % block_size == 0);
+    const int n_blocks = rowsize / block_size;
+
+    for (int i = 0; i < n_blocks; i++) {
+        q4_dequantize_block(inp + i, out + i * block_size);
+    }
+}
+
+
+static void bf16_to_fp32_row(const BFloat16* inp, float* out, int rowsize)
+{
+    int i = 0;
+#if defined(__AVX512F__)
+    for (; i + 16 <= rowsize; i += 16) {
+        const __m512i bf16 = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(inp + i)));
+        _mm512_storeu_ps(out + i, _mm512_castsi512_ps(_mm512_slli_epi32(bf16, 16)));
+    }
+#elif defined(__AVX__)
+    for (; i + 8 <= rowsize; i += 8) {
+        vec_f32x8_store(vec_f32x8_load(inp + i), out + i);
+    }
+#endif
+    for (; i < rowsize; i++) {
+        out[i] = bf16_to_fp32(inp[i]);
+    }
+}
+
+// Rounds like `fp32_to_bf16`, i.e to the nearest with the ties to even by adding 0x7FFF plus
+// the lowest kept bit before truncating, and keeps the NaNs NaNs by setting their quiet bit.
+static void fp32_to_bf16_row(const float* inp, BFloat16* out, int rowsize)
+{
+    int i = 0;
+#if defined(__AVX512F__)
+    for (; i + 16 <= rowsize; i += 16) {
+        const __m512 x = _mm512_loadu_ps(inp + i);
+        const __m512i w_hi = _mm512_srli_epi32(_mm512_castps_si512(x), 16);
+        const __m512i rounding_bias = _mm512_add_epi32(_mm512_and_si512(w_hi, _mm512_set1_epi32(1)), _mm512_set1_epi32(0x7FFF));
+        const __m512i rounded = _mm512_srli_epi32(_mm512_add_epi32(_mm512_castps_si512(x), rounding_bias), 16);
+        const __m512i quiet_nan = _mm512_or_si512(w_hi, _mm512_set1_epi32(0x40));
+        const __m512i bf16 = _mm512_mask_blend_epi32(_mm512_cmp_ps_mask(x, x, _CMP_UNORD_Q), rounded, quiet_nan);
+        _mm256_storeu_si256((__m256i*)(out + i), _mm512_cvtepi32_epi16(bf16));
+    }
+#elif defined(__AVX2__)
+    for (; i + 8 <= rowsize; i += 8) {
+        const __m256 x = _mm256_loadu_ps(inp + i);
+        const __m256i w_hi = _mm256_srli_epi32(_mm256_castps_si256(x), 16);
+        const __m256i rounding_bias = _mm256_add_epi32(_mm256_and_si256(w_hi, _mm256_set1_epi32(1)), _mm256_set1_epi32(0x7FFF));
+        const __m256i rounded = _mm256_srli_epi32(_mm256_add_epi32(_mm256_castps_si256(x), rounding_bias), 16);
+        const __m256i quiet_nan = _mm256_or_si256(w_hi, _mm256_set1_epi32(0x40));
+        const __m256i nan_mask = _mm256_castps_si256(_mm256_cmp_ps(x, x, _CMP_UNORD_Q));
+        const __m256i bf16 = _mm256_blendv_epi8(rounded, quiet_nan, nan_mask);
+        // The values fit in 16 bits so the unsigned saturation of the pack keeps them as is.
+        const __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(bf16), _mm256_extracti128_si256(bf16, 1));
+        _mm_storeu_si128((__m128i*)(out + i), packed);
+    }
+#endif
+    for (; i < rowsize; i++) {
+        out[i] = fp32_to_bf16(inp[i]);
+    }
+}
+
+/* ----------------------------------------------------------------------------------- */
+/*                                   DOT PRODUCTS                                      */
+/* ----------------------------------------------------------------------------------- */
+
+// Loads of a single float from fp32, fp16 or bf16 storage.
+static inline float load_f32(const float* x) { return *x; }
+static inline float load_f32(const Float16* x) { return fp16_to_fp32_single(*x); }
+static inline float load_f32(const BFloat16* x) { return bf16_to_fp32(*x); }
+
+#if defined(__AVX512F__)
+static inline __m512 vec_f32x16_load(const float* x) {
+    return _mm512_loadu_ps(x);
+}
+
+static inline __m512 vec_f32x16_load(const Float16* x) {
+    return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)x));
+}
+
+static inline __m512 vec_f32x16_load(const BFloat16* x) {
+    const __m512i bf16 = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)x));
+    return _mm512_castsi512_ps(_mm512_slli_epi32(bf16, 16));
+}
+#endif
+
+// Dot product of two float vectors that are each stored as fp32, fp16 or bf16. We use four
+// independent accumulators so that each fma does not have to wait for the result of the
+// previous one, which lets the dot product run at the speed at which we can load `vec_b`.
+template <typename TA, typename TB>
+static inline float vec_dot_product_fp(const TA* vec_a, const TB* vec_b, int vec_size)
+{
+#if defined(__AVX512F__)
+    const int unrolled_vec_size = (vec_size / 64) * 64;
+
+    __m512 dot_accum0 = _mm512_setzero_ps();
+    __m512 dot_accum1 = _mm512_setzero_ps();
+    __m512 dot_accum2 = _mm512_setzero_ps();
+    __m512 dot_accum3 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i < unrolled_vec_size; i += 64) {
+        dot_accum0 = _mm512_fmadd_ps(vec_f32x16_load(vec_a + i), vec_f32x16_load(vec_b + i), dot_accum0);
+        dot_accum1 = _mm512_fmadd_ps(vec_f32x16_load(vec_a + i + 16), vec_f32x16_load(vec_b + i + 16), dot_accum1);
+        dot_accum2 = _mm512_fmadd_ps(vec_f32x16_load(vec_a + i + 32), vec_f32x16_load(vec_b + i + 32), dot_accum2);
+        dot_accum3 = _mm512_fmadd_ps(vec_f32x16_load(vec_a + i + 48), vec_f32x16_load(vec_b + i + 48), dot_accum3);
+    }
+
+    __m512 dot_accum = _mm512_add_ps(_mm512_add_ps(dot_accum0, dot_accum1), _mm512_add_ps(dot_accum2, dot_accum3));
+    for (; i + 16 <= vec_size; i += 16) {
+        dot_accum = _mm512_fmadd_ps(vec_f32x16_load(vec_a + i), vec_f32x16_load(vec_b + i), dot_accum);
+    }
+
+    float dot_prod = vec_f32x16_sum(dot_accum);
+
+#elif defined(__AVX__)
+    const int unrolled_vec_size = (vec_size / (4 * GTEN_SIMD_VEC_SIZE)) * (4 * GTEN_SIMD_VEC_SIZE);
+
+    Vec_f32x8 dot_accum0 = vec_f32x8_setzero();
+    Vec_f32x8 dot_accum1 = vec_f32x8_setzero();
+    Vec_f32x8 dot_accum2 = vec_f32x8_setzero();
+    Vec_f32x8 dot_accum3 = vec_f32x8_setzero();
+    int i = 0;
+    for (; i < unrolled_vec_size; i += 4 * GTEN_SIMD_VEC_SIZE) {
+        dot_accum0 = vec_f32x8_fma(vec_f32x8_load(vec_a + i), vec_f32x8_load(vec_b + i), dot_accum0);
+        dot_accum1 = vec_f32x8_fma(vec_f32x8_load(vec_a + i + 8), vec_f32x8_load(vec_b + i + 8), dot_accum1);
+        dot_accum2 = vec_f32x8_fma(vec_f32x8_load(vec_a + i + 16), vec_f32x8_load(vec_b + i + 16), dot_accum2);
+        dot_accum3 = vec_f32x8_fma(vec_f32x8_load(vec_a + i + 24), vec_f32x8_load(vec_b + i + 24), dot_accum3);
+    }
+
+    Vec_f32x8 dot_accum = vec_f32x8_add(vec_f32x8_add(dot_accum0, dot_accum1), vec_f32x8_add(dot_accum2, dot_accum3));
+    for (; i + GTEN_SIMD_VEC_SIZE <= vec_size; i += GTEN_SIMD_VEC_SIZE) {
+        dot_accum = vec_f32x8_fma(vec_f32x8_load(vec_a + i), vec_f32x8_load(vec_b + i), dot_accum);
+    }
+
+    float dot_prod = vec_f32x8_sum(dot_accum);
+
+#else
+    const int unrolled_vec_size = (vec_size / 4) * 4;
+
+    float dot_accum0 = 0.0f;
+    float dot_accum1 = 0.0f;
+    float dot_accum2 = 0.0f;
+    float dot_accum3 = 0.0f;
+    int i = 0;
+    for (; i < unrolled_vec_size; i += 4) {
+        dot_accum0 += load_f32(vec_a + i) * load_f32(vec_b + i);
+        dot_accum1 += load_f32(vec_a + i + 1) * load_f32(vec_b + i + 1);
+        dot_accum2 += load_f32(vec_a + i + 2) * load_f32(vec_b + i + 2);
+        dot_accum3 += load_f32(vec_a + i + 3) * load_f32(vec_b + i + 3);
+    }
+
+    float dot_prod = (dot_accum0 + dot_accum1) + (dot_accum2 + dot_accum3);
+#endif
+
+    // leftovers
+    for (; i < vec_size; i++) {
+        dot_prod += load_f32(vec_a + i) * load_f32(vec_b + i);
+    }
+
+    return dot_prod;
+}
+
+static float vec_dot_product_f16(const Float16* vec_a, const Float16* vec_b, int vec_size)
+{
+    return vec_dot_product_fp(vec_a, vec_b, vec_size);
+}
+
+static float vec_dot_product_f32(const float* vec_a, const float* vec_b, int vec_size)
+{
+    return vec_dot_product_fp(vec_a, vec_b, vec_size);
+}
+
+// Used by the fp16 matmuls which convert the input row to fp32 once and then dot it with
+// each of the fp16 weight rows.
+static float vec_dot_product_f32_f16(const float* vec_a, const Float16* vec_b, int vec_size)
+{
+    return vec_dot_product_fp(vec_a, vec_b, vec_size);
+}
+
+#if defined(__AVX512BF16__)
+static inline __m512bh vec_bf16x32_load(const BFloat16* x) {
+    return (__m512bh)_mm512_loadu_si512((const void*)x);
+}
+#endif
+
+// With AVX512_BF16, `_mm512_dpbf16_ps` multiplies 32 pairs of bf16 and adds the products of
+// each adjacent pair to 16 fp32 sums, i.e twice the products of an fp32 fma and without the
+// conversions to fp32. Note: It treats the denormal inputs as zeros. The other tiers convert
+// the bf16 values to fp32 with a shift.
+static float vec_dot_product_bf16(const BFloat16* vec_a, const BFloat16* vec_b, int vec_size)
+{
+#if defined(__AVX512BF16__)
+    const int unrolled_vec_size = (vec_size / 64) * 64;
+
+    __m512 dot_accum0 = _mm512_setzero_ps();
+    __m512 dot_accum1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i < unrolled_vec_size; i += 64) {
+        dot_accum0 = _mm512_dpbf16_ps(dot_accum0, vec_bf16x32_load(vec_a + i), vec_bf16x32_load(vec_b + i));
+        dot_accum1 = _mm512_dpbf16_ps(dot_accum1, vec_bf16x32_load(vec_a + i + 32), vec_bf16x32_load(vec_b + i + 32));
+    }
+
+    __m512 dot_accum = _mm512_add_ps(dot_accum0, dot_accum1);
+    for (; i + 32 <= vec_size; i += 32) {
+        dot_accum = _mm512_dpbf16_ps(dot_accum, vec_bf16x32_load(vec_a + i), vec_bf16x32_load(vec_b + i));
+    }
+
+    float dot_prod = vec_f32x16_sum(dot_accum);
+    for (; i < vec_size; i++) {
+        dot_prod += load_f32(vec_a + i) * load_f32(vec_b + i);
+    }
+
+    return dot_prod;
+#else
+    return vec_dot_product_fp(vec_a, vec_b, vec_size);
+#endif
+}
+
+// Used by the bf16 matmuls with fp32 activations. The weights are converted exactly so the
+// activations are not rounded to bf16.
+static float vec_dot_product_f32_bf16(const float* vec_a, const BFloat16* vec_b, int vec_size)
+{
+    return vec_dot_product_fp(vec_a, vec_b, vec_size);
+}
+
+
+#if defined(__AVX2__)
+
+// Computes the dot products of 32 pairs of unsigned and signed 8-bit ints as 8 32-bit
+// partial sums and adds them to `accum`. Note: Without VNNI, the sums of adjacent pairs
+// must fit in 16-bit ints.
+static inline __m256i vec_u8i8x32_dot_accum(const __m256i accum, const __m256i u, const __m256i s)
+{
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+    // Multiply the 32 pairs and add each group of 4 adjacent products to obtain 8 32-bit ints.
+    return _mm256_dpbusd_epi32(accum, u, s);
+#elif defined(__AVXVNNI__)
+    return _mm256_dpbusd_avx_epi32(accum, u, s);
+#else
+    // Multiply the 32 pairs and add adjacent products to obtain 16 16-bit ints.
+    const __m256i dot16 = _mm256_maddubs_epi16(u, s);
+    // Add adjacent 16-bit ints to obtain 8 32-bit ints.
+    return _mm256_add_epi32(accum, _mm256_madd_epi16(dot16, _mm256_set1_epi16(1)));
+#endif
+}
+
+// Computes the dot products of 32 pairs of signed 8-bit ints and returns them as 8 32-bit
+// partial sums. `_mm256_maddubs_epi16` only multiplies unsigned by signed ints so we take
+// the absolute value of `a` and move its sign to `b`, which leaves the products unchanged.
+// Note: Both inputs must be in the range [-127, 127] which our quantizers guarantee.
+static inline __m256i vec_i8x32_dot(const __m256i a, const __m256i b)
+{
+    const __m256i a_abs = _mm256_sign_epi8(a, a);
+    const __m256i b_signed = _mm256_sign_epi8(b, a);
+    return vec_u8i8x32_dot_accum(_mm256_setzero_si256(), a_abs, b_signed);
+}
+
+// Unpacks the 32 4-bit quants of a Q4 block to 32 signed 8-bit ints.
+static inline __m256i q4_unpack_block(const Q4Block* blk)
+{
+    // Q4 layout: the first 16 quants are in the higher 4-bits of the 16 bytes
+    // and the next 16 values are in the lower.
+    const __m128i packed = _mm_loadu_si128((const __m128i*)blk->data);
+    const __m128i and_vec = _mm_set1_epi8(0b00001111);
+    const __m128i high = _mm_and_si128(_mm_srli_epi16(packed, 4), and_vec);
+    const __m128i low = _mm_and_si128(packed, and_vec);
+    const __m256i quants = _mm256_set_m128i(low, high);
+    return _mm256_sub_epi8(quants, _mm256_set1_epi8(7));
+}
+
+// Returns [sum(v[0]), sum(v[1]), ..., sum(v[7])].
+static inline __m256i vec_i32x8_sum8(const __m256i v[8])
+{
+    // [v0 (0..3), v1 (0..3), v2 (0..3), v3 (0..3) | v0 (4..7), v1 (4..7), v2 (4..7), v3 (4..7)].
+    const __m256i s0123 = _mm256_hadd_epi32(_mm256_hadd_epi32(v[0], v[1]), _mm256_hadd_epi32(v[2], v[3]));
+    const __m256i s4567 = _mm256_hadd_epi32(_mm256_hadd_epi32(v[4], v[5]), _mm256_hadd_epi32(v[6], v[7]));
+    const __m256i lo = _mm256_permute2x128_si256(s0123, s4567, 0x20);
+    const __m256i hi = _mm256_permute2x128_si256(s0123, s4567, 0x31);
+    return _mm256_add_epi32(lo, hi);
+}
+
+// Distance in bytes, ahead of the quants that we are processing, at which the packed kernels
+// prefetch the weight quants. The quants are read sequentially across the row groups so
+// this also prefetches the start of the next row group.
+static const int kPackedPrefetchDist = 1024;
+
+static inline void prefetch_packed_quants(const Qint8* quants, const int nbytes)
+{
+    for (int i = 0; i < nbytes; i += 64) {
+        _mm_prefetch(reinterpret_cast<const char*>(quants + kPackedPrefetchDist + i), _MM_HINT_T0);
+    }
+}
+
+static void vec_dot_product_q8_packed(const Q8Block* inp, const Float16* w_deltas, const Qint8* w_quants, float* out, const int vec_size)
+{
+    const int block_size = globs::q8_block_size;
+    const int n_rows = globs::q_pack_rows;
+    GTEN_ASSERT(block_size == 32 && n_rows == 8 && vec_size % block_size == 0);
+    const int n_blocks = vec_size / block_size;
+
+    // Accumulates the dot products of the 8 rows, one per slot.
+    __m256 dot_accum = _mm256_setzero_ps();
+    for (int i = 0; i < n_blocks; i++)
+    {
+        const Qint8* blk_quants = w_quants + i * n_rows * block_size;
+        prefetch_packed_quants(blk_quants, n_rows * block_size);
+
+        // The input block is loaded once and dotted with the block of each of the rows.
+        const __m256i a00 = _mm256_loadu_si256((const __m256i*)inp[i].data);
+        const __m256i a_abs = _mm256_sign_epi8(a00, a00);
+
+        __m256i blk_dots[8];
+        for (int r = 0; r < 8; r++) {
+            const __m256i b00 = _mm256_load_si256((const __m256i*)(blk_quants + r * block_size));
+            blk_dots[r] = vec_u8i8x32_dot_accum(_mm256_setzero_si256(), a_abs, _mm256_sign_epi8(b00, a00));
+        }
+
+        const __m256 blk_dot_prod = _mm256_cvtepi32_ps(vec_i32x8_sum8(blk_dots));
+        const __m256 w_delta = _mm256_cvtph_ps(_mm_load_si128((const __m128i*)(w_deltas + i * n_rows)));
+        const __m256 block_delta_multiplier = _mm256_mul_ps(w_delta, _mm256_set1_ps(fp16_to_fp32_single(inp[i].delta)));
+        dot_accum = _mm256_fmadd_ps(blk_dot_prod, block_delta_multiplier, dot_accum);
+    }
+
+    _mm256_storeu_ps(out, dot_accum);
+}
+
+static void vec_dot_product_q8_q4_packed(const Q8Block* inp, const Float16* w_deltas, const Qint8* w_quants, float* out, const int vec_size)
+{
+    const int block_size = globs::q8_block_size;
+    const int n_rows = globs::q_pack_rows;
+    GTEN_ASSERT(block_size == 32 && globs::q4_block_size == 32 && n_rows == 8 && vec_size % block_size == 0);
+    const int n_blocks = vec_size / block_size;
+    const int blk_quants_nbytes = block_size / 2;
+    const __m256i and_vec = _mm256_set1_epi8(0b00001111);
+
+    // Accumulates the dot products of the 8 rows, one per slot.
+    __m256 dot_accum = _mm256_setzero_ps();
+    for (int i = 0; i < n_blocks; i++)
+    {
+        const Qint8* blk_quants = w_quants + i * n_rows * blk_quants_nbytes;
+        prefetch_packed_quants(blk_quants, n_rows * blk_quants_nbytes);
+
+        // dot(a, b - 7) = dot(b, a) - dot(7, a) with the unpacked quants b in [0, 15] as the
+        // unsigned operand. The second term only depends on the input block so we compute it
+        // once and use it as the initial value of the dot product of each row.
+        const __m256i a00 = _mm256_loadu_si256((const __m256i*)inp[i].data);
+        const __m256i a_neg = _mm256_sub_epi8(_mm256_setzero_si256(), a00);
+        const __m256i a_offset = vec_u8i8x32_dot_accum(_mm256_setzero_si256(), _mm256_set1_epi8(7), a_neg);
+
+        __m256i blk_dots[8];
+        for (int r = 0; r < 8; r++) {
+            // [16 bytes, 16 bytes] -> [16 high quants, 16 low quants].
+            const __m256i packed = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)(blk_quants + r * blk_quants_nbytes)));
+            const __m256i quants = _mm256_and_si256(_mm256_blend_epi32(packed, _mm256_srli_epi16(packed, 4), 0x0F), and_vec);
+            blk_dots[r] = vec_u8i8x32_dot_accum(a_offset, quants, a00);
+        }
+
+        const __m256 blk_dot_prod = _mm256_cvtepi32_ps(vec_i32x8_sum8(blk_dots));
+        const __m256 w_delta = _mm256_cvtph_ps(_mm_load_si128((const __m128i*)(w_deltas + i * n_rows)));
+        const __m256 block_delta_multiplier = _mm256_mul_ps(w_delta, _mm256_set1_ps(fp16_to_fp32_single(inp[i].delta)));
+        dot_accum = _mm256_fmadd_ps(blk_dot_prod, block_delta_multiplier, dot_accum);
+    }
+
+    _mm256_storeu_ps(out, dot_accum);
+}
+
+#endif
+
+
+#if defined(__AVX512VNNI__)
+
+// Computes the dot products of 64 pairs of signed 8-bit ints and returns them as 16 32-bit
+// partial sums. AVX-512 has no `sign_epi8` so we move the sign of `a` to `b` with a mask.
+// Note: Both inputs must be in the range [-127, 127].
+static inline __m512i vec_i8x64_dot(const __m512i a, const __m512i b)
+{
+    const __m512i a_abs = _mm512_abs_epi8(a);
+    const __mmask64 a_neg = _mm512_movepi8_mask(a);
+    const __m512i b_signed = _mm512_mask_sub_epi8(b, a_neg, _mm512_setzero_si512(), b);
+    return _mm512_dpbusd_epi32(_mm512_setzero_si512(), a_abs, b_signed);
+}
+
+// Loads the quants of two consecutive Q8 blocks: [blk[0] quants, blk[1] quants].
+static inline __m512i q8_load_2blocks(const Q8Block* blk)
+{
+    const __m256i b0 = _mm256_loadu_si256((const __m256i*)blk[0].data);
+    const __m256i b1 = _mm256_loadu_si256((const __m256i*)blk[1].data);
+    return _mm512_inserti64x4(_mm512_castsi256_si512(b0), b1, 1);
+}
+
+// Unpacks the quants of two consecutive Q4 blocks to 64 8-bit ints in the same order as
+// `q8_load_2blocks`. Note: The quants are returned without the -7 offset, i.e in [0, 15], so
+// that they can be used as the unsigned operand of `dpbusd`.
+static inline __m512i q4_unpack_2blocks(const Q4Block* blk)
+{
+    const __m128i p0 = _mm_loadu_si128((const __m128i*)blk[0].data);
+    const __m128i p1 = _mm_loadu_si128((const __m128i*)blk[1].data);
+    const __m256i packed = _mm256_set_m128i(p1, p0);
+    const __m256i and_vec = _mm256_set1_epi8(0b00001111);
+    // [blk0 high, blk1 high] and [blk0 low, blk1 low].
+    const __m256i high = _mm256_and_si256(_mm256_srli_epi16(packed, 4), and_vec);
+    const __m256i low = _mm256_and_si256(packed, and_vec);
+    // [blk0 high, blk1 high, blk0 low, blk1 low] -> [blk0 high, blk0 low, blk1 high, blk1 low].
+    const __m512i quants = _mm512_inserti64x4(_mm512_castsi256_si512(high), low, 1);
+    return _mm512_shuffle_i64x2(quants, quants, _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+// Returns [d0 x 8, d1 x 8], the delta multipliers of the partial sums of two blocks.
+static inline __m512 vec_2blocks_delta(const float d0, const float d1)
+{
+    return _mm512_mask_blend_ps(0xFF00, _mm512_set1_ps(d0), _mm512_set1_ps(d1));
+}
+
+#endif
+
+
+static float vec_dot_product_q8(const Q8Block* inp0, const Q8Block* inp1, const int vec_size)
+{
+    // GTEN_ASSERTM(vec_size % blk_size == 0, "row size: %d is incompatible with block size: %d", vec_size, blk_size);
+
+    const int block_size = globs::q8_block_size;
+    GTEN_ASSERT(vec_size % block_size == 0);
+    const int n_blocks = vec_size / block_size;
+
+#if defined(__AVX2__)
+    GTEN_ASSERT(block_size == 32);
+    // Dot product accumulator with 8 slots. The sum of the eight accumulators gives the
+    // dot product.
+    __m256 dot_accum = _mm256_setzero_ps();
+    int i = 0;
+
+#if defined(__AVX512VNNI__)
+    // Process two blocks per iteration with the 512-bit registers.
+    __m512 dot_accum2 = _mm512_setzero_ps();
+    for (; i + 1 < n_blocks; i += 2)
+    {
+        const Q8Block* b0 = inp0 + i;
+        const Q8Block* b1 = inp1 + i;
+
+        const __m512i a00 = q8_load_2blocks(b0);
+        const __m512i b00 = q8_load_2blocks(b1);
+
+        const __m512 blk_dot_prod = _mm512_cvtepi32_ps(vec_i8x64_dot(a00, b00));
+        const __m512 block_delta_multiplier = vec_2blocks_delta(
+            fp16_to_fp32_single(b0[0].delta) * fp16_to_fp32_single(b1[0].delta),
+            fp16_to_fp32_single(b0[1].delta) * fp16_to_fp32_single(b1[1].delta));
+        dot_accum2 = _mm512_fmadd_ps(blk_dot_prod, block_delta_multiplier, dot_accum2);
+    }
+#endif
+
+    for (; i < n_blocks; i++)
+    {
+        const Q8Block* b0 = inp0 + i;
+        const Q8Block* b1 = inp1 + i;
+
+        const __m256i a00 = _mm256_loadu_si256((const __m256i*)b0->data);
+        const __m256i b00 = _mm256_loadu_si256((const __m256i*)b1->data);
+
+        const __m256 blk_dot_prod = _mm256_cvtepi32_ps(vec_i8x32_dot(a00, b00));
+        const __m256 block_delta_multiplier = _mm256_set1_ps(fp16_to_fp32_single(b0->delta) * fp16_to_fp32_single(b1->delta));
+        dot_accum = _mm256_fmadd_ps(blk_dot_prod, block_delta_multiplier, dot_accum);
+    }
+
+#if defined(__AVX512VNNI__)
+    const float dot_prod = vec_f32x8_sum(dot_accum) + vec_f32x16_sum(dot_accum2);
+#else
+    const float dot_prod = vec_f32x8_sum(dot_accum);
+#endif
+
+#elif defined(__SSE4_1__)
+    GTEN_ASSERT(block_size % 16 == 0);
+    // Dot product accumulator with 4 slots. The sum of the four accumulators gives the
+    // dot product.
+    __m128 dot_accum = _mm_set1_ps(0.0f);
+
+    for (int i = 0; i < n_blocks; i++)
+    {
+        const Q8Block* b0 = inp0 + i;
+        const Q8Block* b1 = inp1 + i;
+
+        // dotprod = aq0*ad * bq0*bd + aq1*ad * bq1*bd + ... + aqN*ad + bqN*bd
+        //         = adbd(aq0 * bq0) + adbd(aq1 * bq1) + ... + adbd(aqN * bqN)
+        //         = adbd(aq0 * bq0 + aq1 * bq1 + ... + aqN * bqN)
+        // We compute integer arithmetic inside the brackets and scale by the block
+        // quantisation deltas.
+
+        // Integer dot product accumulator for current block.
+        __m128i blk_dot_accum = _mm_set1_epi32(0);
+
+        for (int j = 0; j < block_size; j += 16)
+        {
+            // Load 64-bit(8 1-byte quants) in the lower half. [8-quants, -------].
+            const Qint8* b0_data = b0->data + j;
+            const Qint8* b1_data = b1->data + j;
+
+            const __m128i a00 = _mm_loadu_si64(b0_data);
+            const __m128i a01 = _mm_loadu_si64(b0_data + 8);
+
+            const __m128i b00 = _mm_loadu_si64(b1_data);
+            const __m128i b01 = _mm_loadu_si64(b1_data + 8);
+
+            // Convert 8 quants in the lower half to 16-bit ints.
+            const __m128i a02 = _mm_cvtepi8_epi16(a00);
+            const __m128i a03 = _mm_cvtepi8_epi16(a01);
+
+            const __m128i b02 = _mm_cvtepi8_epi16(b00);
+            const __m128i b03 = _mm_cvtepi8_epi16(b01);
+
+            // Multiply the 8 16-bit ints to obtain 8 32-bit ints and add adjacent
+            // values to obtain 4 32-bit ints.
+            // TODO: Can we instead do 16-bit to 16-bit e.g _mullo_epi16
+            const __m128i c00 = _mm_madd_epi16(a02, b02);
+            const __m128i c01 = _mm_madd_epi16(a03, b03);
+
+            // Add the results and add the output to the accumulator.
+            const __m128i c02 = _mm_add_epi32(c00, c01);
+            blk_dot_accum = _mm_add_epi32(blk_dot_accum, c02);
+        }
+
+        const __m128 blk_dot_accum_f = _mm_cvtepi32_ps(blk_dot_accum);
+        // const __m128 a_blk_delta = _mm_broadcast_ss(a_ds + i);
+        // const __m128 b_blk_delta = _mm_broadcast_ss(b_ds + i);
+        // const __m128 ab_blk_delta = _mm_mul_ps(a_blk_delta, b_blk_delta);
+        const __m128 block_delta_multiplier = _mm_set1_ps(fp16_to_fp32_single(b0->delta) * fp16_to_fp32_single(b1->delta));
+        dot_accum = _mm_add_ps(dot_accum, _mm_mul_ps(blk_dot_accum_f, block_delta_multiplier));
+    }
+
+    const __m128 dotsum0 = _mm_hadd_ps(dot_accum, dot_accum);
+    const __m128 dotsum1 = _mm_hadd_ps(dotsum0, dotsum0);
+    const float dot_prod = _mm_cvtss_f32(dotsum1);
+
+#else
+
+    float dot_prod = 0.0f;
+
+    for (int i = 0; i < n_blocks; i++)
+    {
+        const Q8Block* b0 = inp0 + i;
+        const Q8Block* b1 = inp1 + i;
+
+        int block_dot_prod = 0;
+        for (int j = 0; j < block_size; j++)
+        {
+            block_dot_prod += b0->data[j] * b1->data[j];
+        }
+
+        const float b0_delta = fp16_to_fp32_single(b0->delta);
+        const float b1_delta = fp16_to_fp32_single(b1->delta);
+        dot_prod += block_dot_prod * b0_delta * b1_delta;
+    }
+#endif
+
+    return dot_prod;
+}
+
+
+static float vec_dot_product_q8_q4(const Q8Block* inp0, const Q4Block* inp1, const int vec_size)
+{
+    const int block_size = globs::q8_block_size;
+    GTEN_ASSERT(block_size == globs::q4_block_size && vec_size % block_size == 0);
+    const int n_blocks = vec_size / block_size;
+
+#if defined(__AVX2__)
+    GTEN_ASSERT(block_size == 32);
+    // Dot product accumulator with 8 slots. The sum of the eight accumulators gives the
+    // dot product.
+    __m256 dot_accum = _mm256_setzero_ps();
+    int i = 0;
+
+#if defined(__AVX512VNNI__)
+    // Process two blocks per iteration with the 512-bit registers.
+    __m512 dot_accum2 = _mm512_setzero_ps();
+    for (; i + 1 < n_blocks; i += 2)
+    {
+        const Q8Block* a0 = inp0 + i;
+        const Q4Block* b0 = inp1 + i;
+
+        const __m512i a00 = q8_load_2blocks(a0);
+        const __m512i b00 = q4_unpack_2blocks(b0);
+
+        // dot(a, b - 7) = dot(b, a) + dot(7, -a) with b in [0, 15] as the unsigned operand.
+        const __m512i a_neg = _mm512_sub_epi8(_mm512_setzero_si512(), a00);
+        const __m512i blk_dot = _mm512_dpbusd_epi32(_mm512_setzero_si512(), b00, a00);
+        const __m512 blk_dot_prod = _mm512_cvtepi32_ps(_mm512_dpbusd_epi32(blk_dot, _mm512_set1_epi8(7), a_neg));
+        const __m512 block_delta_multiplier = vec_2blocks_delta(
+            fp16_to_fp32_single(a0[0].delta) * fp16_to_fp32_single(b0[0].delta),
+            fp16_to_fp32_single(a0[1].delta) * fp16_to_fp32_single(b0[1].delta));
+        dot_accum2 = _mm512_fmadd_ps(blk_dot_prod, block_delta_multiplier, dot_accum2);
+    }
+#endif
+
+    for (; i < n_blocks; i++)
+    {
+        const Q8Block* a0 = inp0 + i;
+        const Q4Block* b0 = inp1 + i;
+
+        const __m256i a00 = _mm256_loadu_si256((const __m256i*)a0->data);
+        const __m256i b00 = q4_unpack_block(b0);
+
+        const __m256 blk_dot_prod = _mm256_cvtepi32_ps(vec_i8x32_dot(a00, b00));
+        const __m256 block_delta_multiplier = _mm256_set1_ps(fp16_to_fp32_single(a0->delta) * fp16_to_fp32_single(b0->delta));
+        dot_accum = _mm256_fmadd_ps(blk_dot_prod, block_delta_multiplier, dot_accum);
+    }
+
+#if defined(__AVX512VNNI__)
+    const float dot_prod = vec_f32x8_sum(dot_accum) + vec_f32x16_sum(dot_accum2);
+#else
+    const float dot_prod = vec_f32x8_sum(dot_accum);
+#endif
+
+#elif defined(__SSE4_1__)
+    GTEN_ASSERT(block_size % 16 == 0);
+    // Dot product accumulator with 4 slots. The sum of the four accumulators gives the
+    // dot product.
+    __m128 dot_accum = _mm_set1_ps(0.0f);
+
+    for (int i = 0; i < n_blocks; i++)
+    {
+        const Q8Block* a0 = inp0 + i;
+        const Q4Block* b0 = inp1 + i;
+
+        // Integer dot product accumulator for current block.
+        __m128i blk_dot_accum = _mm_set1_epi32(0);
+
+        const Qint8* a0_data = a0->data;
+        const __m128i a00 = _mm_loadu_si64(a0_data);
+        const __m128i a01 = _mm_loadu_si64(a0_data + 8);
+        const __m128i a02 = _mm_loadu_si64(a0_data + 16);
+        const __m128i a03 = _mm_loadu_si64(a0_data + 24);
+
+        // Convert 8 quants in the lower half to 16-bit ints.
+        const __m128i a04 = _mm_cvtepi8_epi16(a00);
+        const __m128i a05 = _mm_cvtepi8_epi16(a01);
+        const __m128i a06 = _mm_cvtepi8_epi16(a02);
+        const __m128i a07 = _mm_cvtepi8_epi16(a03);
+
+        // load 16 bytes =>
+        // load into lower 64 bits.
+        const __m128i b00 = _mm_loadu_si64(b0->data);
+        const __m128i b01 = _mm_loadu_si64(b0->data + 8);
+
+        const __m128i b02 = _mm_cvtepu8_epi16(b00);
+        const __m128i b03 = _mm_cvtepu8_epi16(b01);
+
+        const __m128i add_vec = _mm_set1_epi16(-7);
+        const __m128i b04 = _mm_add_epi16(_mm_srli_epi16(b02, 4), add_vec); // b00_high
+        const __m128i b05 = _mm_add_epi16(_mm_srli_epi16(b03, 4), add_vec); // b01_high
+
+        const __m128i and_vec = _mm_set1_epi16(0b0000000000001111);
+        const __m128i b06 = _mm_add_epi16(_mm_and_si128(b02, and_vec), add_vec); // b00_low
+        const __m128i b07 = _mm_add_epi16(_mm_and_si128(b03, and_vec), add_vec); // b01_low
+
+        // Multiply the 8 16-bit ints to obtain 8 32-bit ints and add adjacent
+        // values to obtain 4 32-bit ints.
+        // TODO: Can we instead do 16-bit to 16-bit e.g _mullo_epi16
+        const __m128i c00 = _mm_madd_epi16(a04, b04);
+        const __m128i c01 = _mm_madd_epi16(a05, b05);
+        const __m128i c02 = _mm_madd_epi16(a06, b06);
+        const __m128i c03 = _mm_madd_epi16(a07, b07);
+
+        // Add the results and add the output to the accumulator.
+        const __m128i c05 = _mm_add_epi32(c00, c01);
+        const __m128i c06 = _mm_add_epi32(c05, _mm_add_epi32(c02, c03));
+        blk_dot_accum = _mm_add_epi32(blk_dot_accum, c06);
+
+
+        const __m128 blk_dot_accum_f = _mm_cvtepi32_ps(blk_dot_accum);
+        // const __m128 a_blk_delta = _mm_broadcast_ss(a_ds + i);
+        // const __m128 b_blk_delta = _mm_broadcast_ss(b_ds + i);
+        // const __m128 ab_blk_delta = _mm_mul_ps(a_blk_delta, b_blk_delta);
+        const __m128 block_delta_multiplier = _mm_set1_ps(fp16_to_fp32_single(a0->delta) * fp16_to_fp32_single(b0->delta));
+        dot_accum = _mm_add_ps(dot_accum, _mm_mul_ps(blk_dot_accum_f, block_delta_multiplier));
+    }
+
+    const __m128 dotsum0 = _mm_hadd_ps(dot_accum, dot_accum);
+    const __m128 dotsum1 = _mm_hadd_ps(dotsum0, dotsum0);
+    const float dot_prod = _mm_cvtss_f32(dotsum1);
+
+#else
+
+    float dot_prod = 0.0f;
+
+    for (int i = 0; i < n_blocks; i++)
+    {
+        const Q8Block* b0 = inp0 + i;
+        const Q4Block* b1 = inp1 + i;
+
+        int block_dot_prod = 0;
+        const int half_block_size = block_size / 2;
+        for (int j = 0; j < half_block_size; j += 1)
+        {
+            const Qint4 b00 = b1->data[j];
+
+            const Qint8 b01 = (b00 >> 4) - 7;
+            const Qint8 b02 = (b00 & 0b00001111) - 7;
+
+            block_dot_prod += b0->data[j] * b01;
+            block_dot_prod += b0->data[j+half_block_size] * b02;
+        }
+
+        const float b0_delta = fp16_to_fp32_single(b0->delta);
+        const float b1_delta = fp16_to_fp32_single(b1->delta);
+        dot_prod += block_dot_prod * b0_delta * b1_delta;
+    }
+#endif
+
+    return dot_prod;
+}
+
+/* ----------------------------------------------------------------------------------- */
+/*                                  WEIGHTED SUMS                                      */
+/* ----------------------------------------------------------------------------------- */
+
+#if defined(__SSE4_1__)
+// Adds w * q to out[0..16) where q holds 16 signed 8-bit ints.
+static inline void vec_axpy_i8x16(__m128i q, const float w, float* out)
+{
+#if defined(__AVX__)
+    const Vec_f32x8 w_vec = vec_f32x8_set1(w);
+    for (int i = 0; i < 16; i += 8) {
+#if defined(__AVX2__)
+        const Vec_f32x8 x = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(q));
+#else
+        const __m128i lo = _mm_cvtepi8_epi32(q);
+        const __m128i hi = _mm_cvtepi8_epi32(_mm_bsrli_si128(q, 4));
+        const Vec_f32x8 x = _mm256_cvtepi32_ps(_mm256_insertf128_si256(_mm256_castsi128_si256(lo), hi, 1));
+#endif
+        vec_f32x8_store(vec_f32x8_fma(x, w_vec, vec_f32x8_load(out + i)), out + i);
+        q = _mm_bsrli_si128(q, 8);
+    }
+#else
+    const __m128 w_vec = _mm_set1_ps(w);
+    for (int i = 0; i < 16; i += 4) {
+        const __m128 x = _mm_cvtepi32_ps(_mm_cvtepi8_epi32(q));
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_mul_ps(x, w_vec), _mm_loadu_ps(out + i)));
+        q = _mm_bsrli_si128(q, 4);
+    }
+#endif
+}
+#endif
+
+// out += w * x, e.g the values of the attention weighted by the attention probabilities. The
+// fp16 values are converted with F16C when it is available and the quants are dequantized a
+// block at a time in registers.
+static void vec_axpy_f16(const float w, const Float16* x, float* out, int vec_size)
+{
+    int i = 0;
+#if defined(__AVX512F__)
+    const __m512 w_vec = _mm512_set1_ps(w);
+    for (; i + 16 <= vec_size; i += 16) {
+        _mm512_storeu_ps(out + i, _mm512_fmadd_ps(vec_f32x16_load(x + i), w_vec, _mm512_loadu_ps(out + i)));
+    }
+#elif defined(__AVX__)
+    const Vec_f32x8 w_vec = vec_f32x8_set1(w);
+    for (; i + GTEN_SIMD_VEC_SIZE <= vec_size; i += GTEN_SIMD_VEC_SIZE) {
+        vec_f32x8_store(vec_f32x8_fma(vec_f32x8_load(x + i), w_vec, vec_f32x8_load(out + i)), out + i);
+    }
+#endif
+    for (; i < vec_size; i++) {
+        out[i] += w * fp16_to_fp32_single(x[i]);
+    }
+}
+
+static void vec_axpy_q8(const float w, const Q8Block* x, float* out, int vec_size)
+{
+    const int block_size = globs::q8_block_size;
+    GTEN_ASSERT(vec_size % block_size == 0);
+    const int n_blocks = vec_size / block_size;
+
+    for (int b = 0; b < n_blocks; b++) {
+        const float block_w = w * fp16_to_fp32_single(x[b].delta);
+        float* block_out = out + b * block_size;
+#if defined(__SSE4_1__)
+        for (int i = 0; i < block_size; i += 16) {
+            vec_axpy_i8x16(_mm_loadu_si128((const __m128i*)(x[b].data + i)), block_w, block_out + i);
+        }
+#else
+        for (int i = 0; i < block_size; i++) {
+            block_out[i] += block_w * x[b].data[i];
+        }
+#endif
+    }
+}
+
+static void vec_axpy_q4(const float w, const Q4Block* x, float* out, int vec_size)
+{
+    const int block_size = globs::q4_block_size;
+    GTEN_ASSERT(vec_size % block_size == 0);
+    const int n_blocks = vec_size / block_size;
+    const int half_block_size = block_size / 2;
+
+    for (int b = 0; b < n_blocks; b++) {
+        const float block_w = w * fp16_to_fp32_single(x[b].delta);
+        float* block_out = out + b * block_size;
+        // The high nibbles hold the first half of the quants of a block, see Q4Block.
+#if defined(__SSE4_1__)
+        GTEN_ASSERT(block_size == 32);
+        const __m128i packed = _mm_loadu_si128((const __m128i*)x[b].data);
+        const __m128i and_vec = _mm_set1_epi8(0b00001111);
+        const __m128i add_vec = _mm_set1_epi8(-7);
+        const __m128i high = _mm_add_epi8(_mm_and_si128(_mm_srli_epi16(packed, 4), and_vec), add_vec);
+        const __m128i low = _mm_add_epi8(_mm_and_si128(packed, and_vec), add_vec);
+        vec_axpy_i8x16(high, block_w, block_out);
+        vec_axpy_i8x16(low, block_w, block_out + half_block_size);
+#else
+        for (int i = 0; i < half_block_size; i++) {
+            const Qint4 packed = x[b].data[i];
+            block_out[i] += block_w * ((packed >> 4) - 7);
+            block_out[i + half_block_size] += block_w * ((packed & 0b00001111) - 7);
+        }
+#endif
+    }
+}
+
+} // namespace impl
+
+
+// Returns the kernels table of the tier that this file is compiled for. The table is
+// constant-initialized so no code compiled for this tier runs before it is selected.
+const Kernels* GTEN_KERNELS_GETTER()
+{
+    static const Kernels kernels = {
+        /*tier=*/GTEN_KERNELS_TIER,
+        /*vec_dot_product_f16=*/impl::vec_dot_product_f16,
+        /*vec_dot_product_f32=*/impl::vec_dot_product_f32,
+        /*vec_dot_product_f32_f16=*/impl::vec_dot_product_f32_f16,
+        /*vec_dot_product_bf16=*/impl::vec_dot_product_bf16,
+        /*vec_dot_product_f32_bf16=*/impl::vec_dot_product_f32_bf16,
+        /*vec_dot_product_q8=*/impl::vec_dot_product_q8,
+        /*vec_dot_product_q8_q4=*/impl::vec_dot_product_q8_q4,
+#if defined(__AVX2__)
+        /*vec_dot_product_q8_packed=*/impl::vec_dot_product_q8_packed,
+        /*vec_dot_product_q8_q4_packed=*/impl::vec_dot_product_q8_q4_packed,
+#else
+        /*vec_dot_product_q8_packed=*/nullptr,
+        /*vec_dot_product_q8_q4_packed=*/nullptr,
+#endif
+        /*q8_quantize_row=*/impl::q8_quantize_row,
+        /*q8_dequantize_row=*/impl::q8_dequantize_row,
+        /*q4_quantize_row=*/impl::q4_quantize_row,
+        /*q4_dequantize_row=*/impl::q4_dequantize_row,
+        /*fp16_to_fp32_row=*/impl::fp16_to_fp32_row,
+        /*fp32_to_fp16_row=*/impl::fp32_to_fp16_row,
+        /*bf16_to_fp32_row=*/impl::bf16_to_fp32_row,
+        /*fp32_to_bf16_row=*/impl::fp32_to_bf16_row,
+        /*vec_add_f32=*/impl::vec_add_f32,
+        /*vec_scale_f32=*/impl::vec_scale_f32,
+        /*vec_rope_f32=*/impl::vec_rope_f32,
+        /*vec_max_f32=*/impl::vec_max_f32,
+        /*vec_sum_f32=*/impl::vec_sum_f32,
+        /*vec_sum_squares_f32=*/impl::vec_sum_squares_f32,
+        /*vec_exp_sum_f32=*/impl::vec_exp_sum_f32,
+        /*vec_silu_f32=*/impl::vec_silu_f32,
+        /*vec_silu_mul_f32=*/impl::vec_silu_mul_f32,
+        /*vec_norm_f32=*/impl::vec_norm_f32,
+        /*vec_axpy_f16=*/impl::vec_axpy_f16,
+        /*vec_axpy_q8=*/impl::vec_axpy_q8,
+        /*vec_axpy_q4=*/impl::vec_axpy_q4,
+    };
+    return &kernels;
+}
+
+} // namespace gten
@@ -0,0 +1,4 @@
+// Kernels that only use standard C++. Always built, this is the fallback tier.
+#define GTEN_KERNELS_GETTER get_kernels_scalar
+#define GTEN_KERNELS_TIER KernelTier::Scalar
+#include "kernels_impl.h"
@@ -0,0 +1,8 @@
+// Kernels compiled with the SSE4 instruction set flags (see CMakeLists.txt).
+#if defined(GTEN_HAVE_KERNELS_SSE4)
+
+#define GTEN_KERNELS_GETTER get_kernels_sse4
+#define GTEN_KERNELS_TIER KernelTier::SSE4
+#include "kernels_impl.h"
+
+#endif
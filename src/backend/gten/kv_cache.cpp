@@ -0,0 +1,30 @@
+#include "kv_cache.h"
+
+
+namespace gten {
+
+KVCache::KVCache(int n_heads, int d_head, Dtype dtype)
+    : m_n_heads{n_heads}, m_d_head{d_head}, m_dtype{dtype}
+{
+    GTEN_ASSERTM(dtype == kFloat16 || dtype == kQint8 || dtype == kQint4, "Unsupported kv cache dtype.");
+}
+
+void KVCache::reserve(int n_positions)
+{
+    const int n_pages_needed = (n_positions + kPagePositions - 1) / kPagePositions;
+    while (n_pages() < n_pages_needed) {
+        m_k_pages.push_back(Tensor({m_n_heads, kPagePositions, m_d_head}, m_dtype));
+        m_v_pages.push_back(Tensor({m_n_heads, kPagePositions, m_d_head}, m_dtype));
+    }
+}
+
+void KVCache::reset()
+{
+    for (int i = 0; i < n_pages(); i++) {
+        Tensor::s_tensor_alloc_bytes -= m_k_pages[i].nbytes() + m_v_pages[i].nbytes();
+    }
+    m_k_pages.clear();
+    m_v_pages.clear();
+}
+
+} // namespace gten
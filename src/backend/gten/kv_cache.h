@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vector>
+
+#include "gten_types.h"
+#include "tensor.h"
+
+
+namespace gten {
+
+/// The keys and values of the positions seen so far by an attention layer. They are stored
+/// in fixed-size pages of `kPagePositions` positions which are allocated as positions are
+/// appended, so the memory used grows with the context instead of being allocated for the
+/// maximum context upfront, and the context can grow past the size the model was created
+/// with. The page `i` holds the positions [i * kPagePositions, (i + 1) * kPagePositions).
+/// Within a page, the keys and values are head-major so that the attention reads the keys
+/// and values of a head contiguously within each page.
+class KVCache {
+public:
+    /// Number of positions held by each page. It is a multiple of the number of keys that the
+    /// attention processes at once so that its key tiles never straddle two pages.
+    static const int kPagePositions = 64;
+
+public:
+    KVCache() = default;
+    KVCache(int n_heads, int d_head, Dtype dtype);
+
+    /// Allocates the pages needed to hold the positions [0, n_positions), if they are not
+    /// allocated yet.
+    void reserve(int n_positions);
+    /// Frees all the pages, e.g before starting a new sequence.
+    void reset();
+
+    int n_heads() const { return m_n_heads; }
+    int d_head() const { return m_d_head; }
+    Dtype dtype() const { return m_dtype; }
+    int n_pages() const { return m_k_pages.size(); }
+    /// Number of positions that the allocated pages can hold.
+    int capacity() const { return n_pages() * kPagePositions; }
+
+    /// The keys and values of page `i`, of shape (n_heads, kPagePositions, d_head).
+    const Tensor& k_page(int i) const { return m_k_pages[i]; }
+    const Tensor& v_page(int i) const { return m_v_pages[i]; }
+    Tensor& k_page(int i) { return m_k_pages[i]; }
+    Tensor& v_page(int i) { return m_v_pages[i]; }
+
+private:
+    int m_n_heads = 0;
+    int m_d_head = 0;
+    Dtype m_dtype = kFloat16;
+    // The page tables of the keys and values.
+    std::vector<Tensor> m_k_pages;
+    std::vector<Tensor> m_v_pages;
+};
+
+} // namespace gten
@@ -9,9 +9,9 @@
 
 namespace gten {
 
-Embedding::Embedding(int n_vocab, int n_embd, int max_ctx, ModuleDtype dtype)
+Embedding::Embedding(int n_vocab, int n_embd, ModuleDtype dtype)
     : m_weight{Tensor({n_vocab, n_embd}, dtype.wdtype)},
-      m_emb_acv{Tensor({max_ctx, n_embd}, dtype.adtype)}
+      m_emb_acv{Tensor({1, n_embd}, dtype.adtype)}
 {
 }
 
@@ -26,9 +26,9 @@ Tensor Embedding::forward(const Tensor& tokens, const int start_pos) {
     return m_emb_acv;
 }
 
-TiedEmbedding::TiedEmbedding(int n_vocab, int n_embd, int max_ctx, ModuleDtype dtype)
+TiedEmbedding::TiedEmbedding(int n_vocab, int n_embd, ModuleDtype dtype)
     : m_weight{Tensor({n_vocab, n_embd}, dtype.wdtype)},
-      m_emb_acv{Tensor({max_ctx, n_embd}, dtype.adtype)},
+      m_emb_acv{Tensor({1, n_embd}, dtype.adtype)},
       m_proj_acv{Tensor({n_vocab}, kFloat32)}
 {
 
@@ -58,27 +58,9 @@ Tensor TiedEmbedding::forward_proj(const Tensor& inp)
     return m_proj_acv;
 }
 
-Residual::Residual(int max_ctx, int n_out, Dtype dtype)
-    : m_acv{Tensor({max_ctx, n_out}, dtype)}
-{
-}
-
-Tensor Residual::forward(const Tensor& inp0, const Tensor& inp1, const int start_pos) {
-    Timer timer{&ms_exec_time_ms};
-
-    const int n_ctx = inp0.dimsize(0);
-    const int n_embd = inp0.dimsize(1);
-
-    m_acv.resize({n_ctx, n_embd});
-    ops::add(inp0, inp1, m_acv, start_pos);
-
-    return m_acv;
-}
-
-Linear::Linear(int n_in, int n_out, int max_ctx, ModuleDtype dtype, bool has_bias)
+Linear::Linear(int n_in, int n_out, ModuleDtype dtype, bool has_bias)
     : m_weight{Tensor({n_out, n_in}, dtype.wdtype)},
-      m_acv{Tensor({max_ctx, n_out}, dtype.adtype)},
-      m_max_ctx{max_ctx},
+      m_acv{Tensor({1, n_out}, dtype.adtype)},
       m_has_bias{has_bias}
 {
     if (has_bias) {
@@ -94,16 +76,46 @@ Tensor Linear::forward(const Tensor &inp, const int start_pos) {
     
     m_acv.resize({n_ctx, n_out});
 
-    ops::matmul_2d(inp, m_weight, m_acv, start_pos);
+    ops::MatmulEpilogue epilogue;
+    epilogue.bias = m_has_bias ? &m_bias : nullptr;
+    ops::matmul_2d(inp, m_weight, m_acv, start_pos, epilogue);
 
-    if (m_has_bias) {
-        ops::bias_add_inplace(m_acv, m_bias, start_pos);
-    }
+    return m_acv;
+}
+
+Tensor Linear::forward(const Tensor& inp, const ops::MatmulEpilogue& epilogue, const int start_pos)
+{
+    Timer timer{&m_exec_time_ms};
+
+    const int n_ctx = inp.dimsize(0);
+    const int n_out = m_weight.dimsize(0);
+
+    m_acv.resize({n_ctx, n_out});
+
+    ops::MatmulEpilogue linear_epilogue = epilogue;
+    linear_epilogue.bias = m_has_bias ? &m_bias : nullptr;
+    ops::matmul_2d(inp, m_weight, m_acv, start_pos, linear_epilogue);
 
     return m_acv;
 }
 
-EmbeddingLinear::EmbeddingLinear(int n_embd, int n_vocab, int max_ctx, ModuleDtype dtype)
+// Replaces the weight with its packed copy. The original weight is freed once it is replaced
+// so we do not count it in the allocated memory.
+static void replace_with_packed_weight(Tensor& weight)
+{
+    Tensor packed = ops::pack_weight(weight);
+    if (packed.is_packed()) {
+        Tensor::s_tensor_alloc_bytes -= weight.nbytes();
+        weight = packed;
+    }
+}
+
+void Linear::pack_weight()
+{
+    replace_with_packed_weight(m_weight);
+}
+
+EmbeddingLinear::EmbeddingLinear(int n_embd, int n_vocab, ModuleDtype dtype)
     : m_weight{Tensor({n_vocab, n_embd}, dtype.wdtype)}, m_acv{Tensor({n_vocab}, kFloat32)}
 {
 }
@@ -121,8 +133,13 @@ Tensor EmbeddingLinear::forward(const Tensor& inp)
     return m_acv;
 }
 
-RMSNorm::RMSNorm(int d_in, int max_ctx, ModuleDtype dtype)
-    : m_weight{Tensor({d_in}, kFloat16)}, m_acv{Tensor({max_ctx, d_in}, dtype.adtype)}
+void EmbeddingLinear::pack_weight()
+{
+    replace_with_packed_weight(m_weight);
+}
+
+RMSNorm::RMSNorm(int d_in, ModuleDtype dtype)
+    : m_weight{Tensor({d_in}, kFloat16)}, m_acv{Tensor({1, d_in}, dtype.adtype)}
 {
 }
 
@@ -140,11 +157,18 @@ Tensor RMSNorm::forward(const Tensor& inp, const int start_pos)
     return m_acv;
 }
 
-LayerNorm::LayerNorm(int d_in, int max_ctx, ModuleDtype dtype)
+void RMSNorm::fuse_into(ops::MatmulEpilogue& epilogue, const int n_ctx)
+{
+    m_acv.resize({n_ctx, m_acv.dimsize(1)});
+    epilogue.norm_weight = &m_weight;
+    epilogue.norm_bias = nullptr;
+    epilogue.norm_out = &m_acv;
+}
+
+LayerNorm::LayerNorm(int d_in, ModuleDtype dtype)
     : m_weight{Tensor({d_in}, kFloat16)},
       m_bias{Tensor({d_in}, kFloat16)},
-      m_acv{Tensor({max_ctx, d_in}, dtype.adtype)},
-      m_max_ctx{max_ctx}
+      m_acv{Tensor({1, d_in}, dtype.adtype)}
 {
 }
 
@@ -161,127 +185,154 @@ Tensor LayerNorm::forward(const Tensor &inp, const int start_pos) {
     return m_acv;
 }
 
-Multiply::Multiply(int max_ctx, int d_out, Dtype dtype, const bool inplace)
-    : m_inplace{inplace}
+void LayerNorm::fuse_into(ops::MatmulEpilogue& epilogue, const int n_ctx)
 {
-    if (!inplace) {
-        m_acv = Tensor({max_ctx, d_out}, dtype);
-    }
+    m_acv.resize({n_ctx, m_acv.dimsize(1)});
+    epilogue.norm_weight = &m_weight;
+    epilogue.norm_bias = &m_bias;
+    epilogue.norm_out = &m_acv;
 }
 
-Tensor Multiply::forward(Tensor &inp0, const Tensor &inp1, const int start_pos)
+GatedMLP::GatedMLP(int d_in, int d_mlp, ModuleDtype dtype)
+    : m_gate_weight{Tensor({d_mlp, d_in}, dtype.wdtype)},
+      m_up_weight{Tensor({d_mlp, d_in}, dtype.wdtype)},
+      m_acv{Tensor({1, d_mlp}, dtype.adtype)},
+      m_down_proj{Linear(d_mlp, d_in, dtype)}
 {
-    Timer timer{&m_exec_time_ms};
+}
 
-    if (m_inplace)
-    {
-        ops::multiply_inplace(inp0, inp1, start_pos);
+Tensor GatedMLP::forward(const Tensor& inp, const ops::MatmulEpilogue& out_epilogue, const int start_pos)
+{
+    GTEN_ASSERTM(m_gate_up_weight.numel() > 0, "GatedMLP::pack_weights must be called after loading the weights.");
 
-        return inp0;
-    } else 
     {
-        const int n_ctx = inp0.dimsize(0);
-        const int n_embd = inp0.dimsize(1);
-        m_acv.resize({n_ctx, n_embd});
+        Timer timer{&m_exec_time_ms};
 
-        ops::multiply(inp0, inp1, m_acv, start_pos);
-
-        return m_acv;
+        const int n_ctx = inp.dimsize(0);
+        m_acv.resize({n_ctx, m_acv.dimsize(1)});
+        ops::matmul_2d_gated(inp, m_gate_up_weight, m_acv, start_pos);
     }
-}
 
-SiLU::SiLU(int max_ctx, int d_out, Dtype dtype, const bool inplace)
-    : m_inplace{inplace}
-{
-    if (!inplace) {
-        m_acv = Tensor({max_ctx, d_out}, dtype);
-    }
+    return m_down_proj.forward(m_acv, out_epilogue, start_pos);
 }
 
-Tensor SiLU::forward(Tensor &inp, const int start_pos)
+void GatedMLP::pack_weights()
 {
-    Timer timer{&m_exec_time_ms};
-
-    if (m_inplace) {
-        ops::silu_inplace(inp, start_pos);
+    m_gate_up_weight = ops::interleave_gate_up(m_gate_weight, m_up_weight);
+    Tensor::s_tensor_alloc_bytes -= m_gate_weight.nbytes() + m_up_weight.nbytes();
+    m_gate_weight = Tensor();
+    m_up_weight = Tensor();
 
-        return inp;
-    } else {
-        const int n_ctx = inp.dimsize(0);
-        const int n_embd = inp.dimsize(1);
-
-        m_acv.resize({n_ctx, n_embd});
-        ops::silu(inp, m_acv, start_pos);
-
-        return m_acv;
-    }
+    replace_with_packed_weight(m_gate_up_weight);
+    m_down_proj.pack_weight();
 }
 
-RotaryEmbedding::RotaryEmbedding(const int d_head, const bool inplace, const float rope_pct)
-    : m_d_head{d_head}, m_rope_pct{rope_pct}
+SelfAttention::SelfAttention(int n_heads, int n_embd, int n_query_groups, ModuleDtype dtype, std::shared_ptr<RopeTable> rope, bool qkv_bias)
+    : m_query{Linear(n_embd, n_embd, dtype, /*has_bias=*/qkv_bias)},
+      m_qkv_proj{Linear(n_embd, n_embd, dtype)},
+      m_kv_cache{KVCache(n_query_groups, n_embd/n_heads, dtype.kvdtype)},
+      m_qkv_acv{Tensor({1, n_embd}, dtype.adtype)},
+      m_rope{std::move(rope)},
+      m_n_heads{n_heads}
 {
-    GTEN_ASSERT(rope_pct <= 1.0f && rope_pct >= 0.0f);
+    const int d_head = n_embd / n_heads;
+    GTEN_ASSERT(m_rope->d_head() == d_head);
+    const int kv_dim = d_head * n_query_groups;
+    m_key = Linear{n_embd, kv_dim, dtype, /*has_bias=*/qkv_bias};
+    m_value = Linear{n_embd, kv_dim, dtype, /*has_bias=*/qkv_bias};
 
-    if (!inplace) {
-        GTEN_ASSERTM(false, "RotaryEmbedding inplace not implemented.");
+    const int qkv_dim = n_embd + 2 * kv_dim;
+    m_qkv_weight = Tensor({qkv_dim, n_embd}, dtype.wdtype);
+    if (qkv_bias) {
+        m_qkv_bias = Tensor({qkv_dim}, kFloat16);
     }
+    // The slices replace the separately allocated q, k and v weights and biases.
+    Tensor::s_tensor_alloc_bytes -= m_query.m_weight.nbytes() + m_key.m_weight.nbytes() + m_value.m_weight.nbytes();
+    Tensor::s_tensor_alloc_bytes -= m_query.m_bias.nbytes() + m_key.m_bias.nbytes() + m_value.m_bias.nbytes();
+    set_qkv_slices();
 }
 
-Tensor RotaryEmbedding::forward(Tensor& inp, const int start_pos)
+// Points the q, k and v weights and biases to their rows in the fused ones.
+void SelfAttention::set_qkv_slices()
 {
-    Timer timer{&m_exec_time_ms};
-
-    ops::rotary_emb(inp, m_d_head, m_rope_pct, start_pos);
-
-    return inp;
+    const int q_dim = m_query.m_acv.dimsize(1);
+    const int kv_dim = m_kv_cache.n_heads() * m_kv_cache.d_head();
+    m_query.m_weight = m_qkv_weight.slice(0, q_dim);
+    m_key.m_weight = m_qkv_weight.slice(q_dim, q_dim + kv_dim);
+    m_value.m_weight = m_qkv_weight.slice(q_dim + kv_dim, q_dim + 2 * kv_dim);
+    if (m_qkv_bias.numel() > 0) {
+        m_query.m_bias = m_qkv_bias.slice(0, q_dim);
+        m_key.m_bias = m_qkv_bias.slice(q_dim, q_dim + kv_dim);
+        m_value.m_bias = m_qkv_bias.slice(q_dim + kv_dim, q_dim + 2 * kv_dim);
+    }
 }
 
-
-SelfAttention::SelfAttention(int n_heads, int n_embd, int n_query_groups, int max_ctx, ModuleDtype dtype, float rope_pct, bool qkv_bias)
-    : m_query{Linear(n_embd, n_embd, max_ctx, dtype, /*has_bias=*/qkv_bias)},
-      m_qkv_proj{Linear(n_embd, n_embd, max_ctx, dtype)},
-      m_qk_acv{Tensor({n_heads, max_ctx, max_ctx}, dtype.adtype)},
-      m_qkv_acv{Tensor({max_ctx, n_embd}, dtype.adtype)},
-      m_q_rope{RotaryEmbedding{n_embd/n_heads, /*inplace=*/true, rope_pct}},
-      m_k_rope{RotaryEmbedding{n_embd/n_heads, /*inplace=*/true, rope_pct}},
-      m_n_heads{n_heads}, m_max_ctx{max_ctx}
+void SelfAttention::pack_weights()
 {
-    const int d_head = n_embd / n_heads;
-    const int kv_dim = d_head * n_query_groups;
-    m_key = Linear{n_embd, kv_dim, max_ctx, dtype, /*has_bias=*/qkv_bias};
-    m_value = Linear{n_embd, kv_dim, max_ctx, dtype, /*has_bias=*/qkv_bias};
+    replace_with_packed_weight(m_qkv_weight);
+    set_qkv_slices();
+    m_qkv_proj.pack_weight();
 }
 
 
-Tensor SelfAttention::forward(const Tensor &inp, const int start_pos)
+Tensor SelfAttention::forward(const Tensor &inp, const ops::MatmulEpilogue& out_epilogue, const int start_pos)
 {
-    Tensor q = m_query.forward(inp, start_pos);
-    Tensor k = m_key.forward(inp, start_pos);
+    Tensor q;
+    {
+        // The time of the fused projection, which also applies the rotary embedding to the
+        // queries and keys and appends the keys and values to the cache, is recorded as the
+        // query projection time.
+        Timer timer{&m_query.m_exec_time_ms};
 
-    q = m_q_rope.forward(q, start_pos);
-    k = m_k_rope.forward(k, start_pos);
+        const int n_ctx = inp.dimsize(0);
+        m_query.m_acv.resize({n_ctx, m_query.m_acv.dimsize(1)});
 
-    Tensor v = m_value.forward(inp, start_pos);
+        m_rope->reserve(n_ctx);
+        const Tensor* bias = m_qkv_bias.numel() > 0 ? &m_qkv_bias : nullptr;
+        ops::matmul_2d_qkv(inp, m_qkv_weight, bias, m_query.m_acv, m_kv_cache, *m_rope, start_pos);
+        q = m_query.m_acv;
+    }
 
-    const Tensor qkv = masked_qkv_attn(q, k, v, start_pos);
-    const Tensor out = m_qkv_proj.forward(qkv, start_pos);
+    const Tensor qkv = masked_qkv_attn(q, start_pos);
+    const Tensor out = m_qkv_proj.forward(qkv, out_epilogue, start_pos);
 
     return out;
 }
 
-Tensor SelfAttention::masked_qkv_attn(const Tensor& q, const Tensor& k, const Tensor& v, const int start_pos)
+Tensor SelfAttention::masked_qkv_attn(const Tensor& q, const int start_pos)
 {
     Timer timer{&m_exec_time_attn_ms};
 
     const int n_ctx = q.dimsize(0);
     const int n_embd = q.dimsize(1);
 
-    m_qk_acv.resize({m_n_heads, n_ctx, n_ctx});
     m_qkv_acv.resize({n_ctx, n_embd});
 
-    ops::qkv_attn(q, k, v, m_qk_acv, m_qkv_acv, m_max_ctx, start_pos);
+    ops::qkv_attn(q, m_kv_cache, m_qkv_acv, m_n_heads, start_pos);
 
     return m_qkv_acv;
 }
 
+// Replaces the storage of the activation `acv`, which grows with the context but is never
+// shrunk by resize, with the storage of a single row.
+static void shrink_acv(Tensor& acv)
+{
+    Tensor::s_tensor_alloc_bytes -= acv.nbytes();
+    acv = Tensor({1, acv.dimsize(1)}, acv.dtype());
+}
+
+void SelfAttention::reset_cache()
+{
+    m_kv_cache.reset();
+    shrink_acv(m_query.m_acv);
+    shrink_acv(m_qkv_acv);
+}
+
+void SelfAttention::shift_cache(const int n_keep, const int n_discard, const int n_past)
+{
+    Timer timer{&m_exec_time_attn_ms};
+
+    ops::kv_cache_shift(m_kv_cache, n_keep, n_discard, n_past, *m_rope);
+}
+
 } // namespace gten
@@ -1,8 +1,11 @@
 #pragma once
 
 #include <iostream>
+#include <memory>
 
 #include "gten_types.h"
+#include "ops.h"
+#include "rope_table.h"
 #include "tensor.h"
 
 
@@ -18,7 +21,7 @@ public:
 
 public:
     Embedding() = default;
-    Embedding(int n_vocab, int d_embed, int max_ctx, ModuleDtype dtype);
+    Embedding(int n_vocab, int d_embed, ModuleDtype dtype);
 
     /// Returns the embeddings of the given tokens. The input tensor must be of shape
     /// (n_ctx,) and the output tensor is of shape (n_ctx, d_embed).
@@ -37,7 +40,7 @@ public:
 
 public:
     TiedEmbedding() = default;
-    TiedEmbedding(int n_vocab, int d_embed, int max_ctx, ModuleDtype dtype);
+    TiedEmbedding(int n_vocab, int d_embed, ModuleDtype dtype);
  
     /// Returns the embeddings of the given tokens. The input tensor must be of shape
     /// (n_ctx,) and the output tensor is of shape (n_ctx, d_embed).
@@ -53,8 +56,11 @@ public:
     int m_exec_time_ms{0};
 
 public:
-    RMSNorm(int d_in, int max_ctx, ModuleDtype dtype);
+    RMSNorm(int d_in, ModuleDtype dtype);
     Tensor forward(const Tensor& inp, const int start_pos = 0);
+    /// Sets the epilogue of a matmul with `n_ctx` output rows to compute the norm of its
+    /// output into `m_acv`, instead of calling forward on the output afterwards.
+    void fuse_into(ops::MatmulEpilogue& epilogue, const int n_ctx);
 };
 
 
@@ -67,25 +73,13 @@ public:
 
 public:
     LayerNorm() = default;
-    LayerNorm(int d_in, int max_ctx, ModuleDtype dtype);
+    LayerNorm(int d_in, ModuleDtype dtype);
     Tensor forward(const Tensor& inp, const int start_pos = 0);
-
-private:
-    int m_max_ctx;
-};
-
-class Residual {
-public:
-    Tensor m_acv;
-    int ms_exec_time_ms{0};
-
-public:
-    Residual() = default;
-    Residual(int max_ctx, int d_out, Dtype dtype);
-    Tensor forward(const Tensor& inp0, const Tensor& inp1, const int start_pos = 0);
+    /// Sets the epilogue of a matmul with `n_ctx` output rows to compute the norm of its
+    /// output into `m_acv`, instead of calling forward on the output afterwards.
+    void fuse_into(ops::MatmulEpilogue& epilogue, const int n_ctx);
 };
 
-
 /// Applies an affine linear transformation on the input.
 class Linear {
 public:
@@ -96,11 +90,15 @@ public:
 
 public:
     Linear() = default;
-    Linear(int d_in, int d_out, int max_ctx, ModuleDtype dtype, bool has_bias=false);
+    Linear(int d_in, int d_out, ModuleDtype dtype, bool has_bias=false);
     Tensor forward(const Tensor& inp, const int start_pos = 0);
+    /// Same as above but also applies the given epilogue (e.g a residual add) to the output
+    /// rows of the matmul. The bias of the layer is added by the epilogue.
+    Tensor forward(const Tensor& inp, const ops::MatmulEpilogue& epilogue, const int start_pos = 0);
+    // Repacks the loaded weight into the packed layout of the matmul kernels if possible.
+    void pack_weight();
 
 private:
-    int m_max_ctx;
     bool m_has_bias;
 };
 
@@ -112,76 +110,78 @@ public:
 
 public:
     EmbeddingLinear() = default;
-    EmbeddingLinear(int n_embd, int n_vocab, int max_ctx, ModuleDtype dtype);
+    EmbeddingLinear(int n_embd, int n_vocab, ModuleDtype dtype);
     Tensor forward(const Tensor& inp);
+    // Repacks the loaded weight into the packed layout of the matmul kernels if possible.
+    void pack_weight();
 };
 
-class Multiply {
-public:
-    Tensor m_acv;
-    int m_exec_time_ms{0};
-
-public:
-    Multiply() = default;
-    Multiply(int max_ctx, int d_out, Dtype dtype, const bool inplace = false);
-    Tensor forward(Tensor& inp0, const Tensor& inp1, const int start_pos=0);
-
-private:
-    bool m_inplace{false};
-};
-
-class SiLU {
+/// Gated MLP: down_proj(silu(gate_proj(x)) * up_proj(x)). The gate and up weights are
+/// interleaved into one weight after loading so that both projections and the product are
+/// computed with a single matmul that writes the intermediate activation once.
+class GatedMLP {
 public:
+    // The separate gate and up weights that are loaded from the checkpoint. They are
+    // released once they are interleaved into `m_gate_up_weight` by `pack_weights`.
+    Tensor m_gate_weight;
+    Tensor m_up_weight;
+    Tensor m_gate_up_weight;
     Tensor m_acv;
+    Linear m_down_proj;
     int m_exec_time_ms{0};
 
 public:
-    SiLU() = default;
-    SiLU(int max_ctx, int d_out, Dtype dtype, const bool inplace=false);
-    Tensor forward(Tensor& inp, const int start_pos=0);
-
-private:
-    bool m_inplace{false};
-};
-
-
-class RotaryEmbedding {
-public:
-    int m_exec_time_ms{0};
-
-public:
-    // `rope_pct` is the percentage (in range [0.0, 1.0]) of the head_dim we should apply rope. 
-    RotaryEmbedding(const int d_head, const bool inplace=true, const float rope_pct=1.0f);
-    Tensor forward(Tensor& inp, const int start_pos=0);
-
-private:
-    int m_d_head;
-    float m_rope_pct;
+    GatedMLP() = default;
+    GatedMLP(int d_in, int d_mlp, ModuleDtype dtype);
+    /// Returns the mlp output with `out_epilogue` applied by the down projection.
+    Tensor forward(const Tensor& inp, const ops::MatmulEpilogue& out_epilogue, const int start_pos = 0);
+    // Interleaves the loaded gate and up weights and repacks the weights into the packed
+    // layout of the matmul kernels if possible. Must be called once after loading.
+    void pack_weights();
 };
 
-
 class SelfAttention {
 public:
-    SelfAttention(int n_heads, int n_embed, int n_query_groups, int max_ctx, ModuleDtype dtype, float rope_pct=1.0f, bool qkv_bias=false);
-    Tensor forward(const Tensor& inp, const int start_pos);
-
-public:
+    // `rope` holds the angles of the rotary embedding applied to the queries and keys. It is
+    // usually shared by all the layers of the model.
+    SelfAttention(int n_heads, int n_embed, int n_query_groups, ModuleDtype dtype, std::shared_ptr<RopeTable> rope, bool qkv_bias=false);
+    /// Returns the attention output with `out_epilogue` applied by the output projection.
+    Tensor forward(const Tensor& inp, const ops::MatmulEpilogue& out_epilogue, const int start_pos);
+    /// Frees the pages of the kv cache and the context-sized activations, e.g before starting
+    /// a new sequence.
+    void reset_cache();
+    /// Evicts the cached positions [n_keep, n_keep + n_discard) of the `n_past` cached
+    /// positions and moves the following ones back, see `ops::kv_cache_shift`.
+    void shift_cache(const int n_keep, const int n_discard, const int n_past);
+    // Repacks the loaded weights into the packed layout of the matmul kernels if possible.
+    void pack_weights();
+
+public:
+    // The query, key and value projections are computed with a single matmul of the fused
+    // weight `m_qkv_weight` (and bias) which holds the concatenated rows of their weights.
+    // The weights (and biases) of `m_query`, `m_key` and `m_value` are slices of the fused
+    // ones, used to load them. The matmul writes the queries to the activation of `m_query`
+    // and the keys and values straight to the kv cache.
     Linear m_query;
     Linear m_key;
     Linear m_value;
+    Tensor m_qkv_weight;
+    Tensor m_qkv_bias;
     Linear m_qkv_proj;
-    Tensor m_qk_acv;
+    // The keys (after rotary embedding) and values of all the positions so far. The new
+    // positions are appended at each step.
+    KVCache m_kv_cache;
     Tensor m_qkv_acv;
-    RotaryEmbedding m_q_rope;
-    RotaryEmbedding m_k_rope;
+    // The rotary embedding is applied to the queries and keys by the qkv projection.
+    std::shared_ptr<RopeTable> m_rope;
     int m_exec_time_attn_ms{0};
 
 private:
     int32_t m_n_heads;
-    int m_max_ctx;
 
 private:
-    Tensor masked_qkv_attn(const Tensor& q, const Tensor& k, const Tensor& v, const int start_pos);
+    void set_qkv_slices();
+    Tensor masked_qkv_attn(const Tensor& q, const int start_pos);
 };
 
 } // namespace gten
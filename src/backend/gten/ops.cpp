@@ -1,14 +1,17 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
 #include <cstring>
+#include <limits>
+#include <type_traits>
+#include <vector>
 
 #include "log.h"
 #include "quants.h"
 #include "tensor.h"
-#include "simd_ops.h"
+#include "kernels.h"
 #include "ops.h"
-
-#if defined(__AVX__)
-#include <immintrin.h>
-#endif
+#include "thread_pool.h"
 
 
 namespace gten {
@@ -37,6 +40,18 @@ private:
 
 static const OpsState g_ops_state = OpsState();
 
+// Returns a buffer of size `numel` * sizeof(float) owned by the calling thread, for the
+// tasks of parallel loops that need their own scratch space.
+static float* thread_scratch_buf(int numel)
+{
+    static thread_local std::vector<float> buf;
+    GTEN_ASSERT(numel >= 1);
+    if (buf.size() < size_t(numel)) {
+        buf.resize(numel);
+    }
+    return buf.data();
+}
+
 
 static void read_row_to_float(const char* inp, Dtype inp_dtype, float* out_buf, const int rowsize)
 {
@@ -45,32 +60,22 @@ static void read_row_to_float(const char* inp, Dtype inp_dtype, float* out_buf,
         case kQint4: 
         {
             const Q4Block* inp_data = reinterpret_cast<const Q4Block*>(inp);
-            q4_dequantize_row(inp_data, out_buf, rowsize);
+            kernels().q4_dequantize_row(inp_data, out_buf, rowsize);
         } break;
         case kQint8: 
         {
             const Q8Block* inp_data = reinterpret_cast<const Q8Block*>(inp);
-            q8_dequantize_row(inp_data, out_buf, rowsize);
+            kernels().q8_dequantize_row(inp_data, out_buf, rowsize);
         } break;
         case kFloat16:
         {
             const Float16* inp_data = reinterpret_cast<const Float16*>(inp);
-#if defined(__AVX__) && defined(__F16C__)
-            const int simd_n_blocks = rowsize / 8;
-
-            for (int i = 0; i < simd_n_blocks; ++i) {
-                const __m256 fp32 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i_u *)(inp_data + i*8)));
-                _mm256_storeu_ps(out_buf + i*8, fp32);
-            }
-
-            for (int i = simd_n_blocks*8; i < rowsize; ++i) {
-                out_buf[i] = fp16_to_fp32(inp_data[i]);
-            }
-#else
-            for (int i = 0; i < rowsize; i++) {
-                out_buf[i] = fp16_to_fp32(inp_data[i]);
-            }
-#endif
+            kernels().fp16_to_fp32_row(inp_data, out_buf, rowsize);
+        } break;
+        case kBFloat16:
+        {
+            const BFloat16* inp_data = reinterpret_cast<const BFloat16*>(inp);
+            kernels().bf16_to_fp32_row(inp_data, out_buf, rowsize);
         } break;
         case kFloat32:
         {
@@ -84,32 +89,27 @@ static void read_row_to_float(const char* inp, Dtype inp_dtype, float* out_buf,
 }
 
 
-static void write_row_from_float(float* inp, char* out, Dtype out_dtype, int rowsize) {
+static void write_row_from_float(const float* inp, char* out, Dtype out_dtype, int rowsize) {
     switch (out_dtype) {
         case kQint8:
         {
             Q8Block* out_data = reinterpret_cast<Q8Block*>(out);
-            q8_quantize_row(inp, out_data, rowsize);
+            kernels().q8_quantize_row(inp, out_data, rowsize);
+        } break;
+        case kQint4:
+        {
+            Q4Block* out_data = reinterpret_cast<Q4Block*>(out);
+            kernels().q4_quantize_row(inp, out_data, rowsize);
         } break;
         case kFloat16:
         {
             Float16* out_data = reinterpret_cast<Float16*>(out);
-#if defined(__AVX__) && defined(__F16C__)
-            const int simd_n_blocks = rowsize / 8;
-
-            for (int i = 0; i < simd_n_blocks; ++i) {
-                const __m256 fp32 = _mm256_loadu_ps(inp + i*8);
-                _mm_storeu_si128((__m128i_u *)(out_data + i*8), _mm256_cvtps_ph(fp32, 0));
-            }
-
-            for (int i = simd_n_blocks*8; i < rowsize; ++i) {
-                out_data[i] = fp32_to_fp16(inp[i]);
-            }
-#else
-            for (int i = 0; i < rowsize; i++) {
-                out_data[i] = fp32_to_fp16(inp[i]);
-            }
-#endif
+            kernels().fp32_to_fp16_row(inp, out_data, rowsize);
+        } break;
+        case kBFloat16:
+        {
+            BFloat16* out_data = reinterpret_cast<BFloat16*>(out);
+            kernels().fp32_to_bf16_row(inp, out_data, rowsize);
         } break;
         case kFloat32:
         {
@@ -122,27 +122,6 @@ static void write_row_from_float(float* inp, char* out, Dtype out_dtype, int row
     }
 }
 
-static void vec_scale_f32(float* a, const float scalar, int vec_size)
-{
-    const int unrolled_vec_size = (vec_size / 8) * 8;
-
-    for (int i = 0; i < unrolled_vec_size; i += 8) {
-        a[i + 0] = a[i + 0] * scalar;
-        a[i + 1] = a[i + 1] * scalar;
-        a[i + 2] = a[i + 2] * scalar;
-        a[i + 3] = a[i + 3] * scalar;
-        a[i + 4] = a[i + 4] * scalar;
-        a[i + 5] = a[i + 5] * scalar;
-        a[i + 6] = a[i + 6] * scalar;
-        a[i + 7] = a[i + 7] * scalar;
-    } 
-
-    // leftovers
-    for (int i = unrolled_vec_size; i < vec_size; i++) {
-        a[i] = a[i] * scalar;
-    }
-}
-
 void scale(Tensor& inp, float scaler, const int start_pos)
 {
     char* inp_data = inp.data_ptr<char>();
@@ -157,464 +136,737 @@ void scale(Tensor& inp, float scaler, const int start_pos)
     {
         ops::read_row_to_float(inp_data + i * inp_st0, inp.dtype(), inp_buf, n_embd);
 
-        vec_scale_f32(inp_buf, scaler, n_embd);
+        kernels().vec_scale_f32(inp_buf, scaler, n_embd);
 
         ops::write_row_from_float(inp_buf, inp_data + i * inp_st0, inp.dtype(), n_embd);   
     }
 }
 
-static void vec_add_f32(const float* a, const float* b, float* out, int vec_size)
-{
-#if defined(__AVX__)
 
-    const int simd_vec_size = (vec_size / GTEN_SIMD_VEC_SIZE) * GTEN_SIMD_VEC_SIZE;
+template <Dtype dtype>
+using DtypeConst = std::integral_constant<Dtype, dtype>;
 
-    for (int i = 0; i < simd_vec_size; i += GTEN_SIMD_VEC_SIZE) {
-        Vec_f32x8 x0 = vec_f32x8_load(a + i);
-        Vec_f32x8 x1 = vec_f32x8_load(b + i);
-        Vec_f32x8 x_sum = vec_f32x8_add(x0, x1);
-        vec_f32x8_store(x_sum, out + i);
+// Calls `fn` with the given input dtypes of a dot product as compile-time constants, i.e
+// `fn(DtypeConst<inp0_dtype>{}, DtypeConst<inp1_dtype>{})`. The ops dispatch on the dtypes
+// once with this and their loops then call the dot product kernel of the dtypes directly.
+template <typename Fn>
+static void dispatch_dot_dtypes(Dtype inp0_dtype, Dtype inp1_dtype, Fn&& fn)
+{
+    if (inp0_dtype == kQint8 && inp1_dtype == kQint8) {
+        fn(DtypeConst<kQint8>{}, DtypeConst<kQint8>{});
+    } else if (inp0_dtype == kQint8 && inp1_dtype == kQint4) {
+        fn(DtypeConst<kQint8>{}, DtypeConst<kQint4>{});
+    } else if (inp0_dtype == kFloat16 && inp1_dtype == kFloat16) {
+        fn(DtypeConst<kFloat16>{}, DtypeConst<kFloat16>{});
+    } else if (inp0_dtype == kFloat32 && inp1_dtype == kFloat16) {
+        fn(DtypeConst<kFloat32>{}, DtypeConst<kFloat16>{});
+    } else if (inp0_dtype == kFloat32 && inp1_dtype == kFloat32) {
+        fn(DtypeConst<kFloat32>{}, DtypeConst<kFloat32>{});
+    } else if (inp0_dtype == kBFloat16 && inp1_dtype == kBFloat16) {
+        fn(DtypeConst<kBFloat16>{}, DtypeConst<kBFloat16>{});
+    } else if (inp0_dtype == kFloat32 && inp1_dtype == kBFloat16) {
+        fn(DtypeConst<kFloat32>{}, DtypeConst<kBFloat16>{});
+    } else {
+        GTEN_ASSERTM(false, "Unsupported dot product dtypes.");
     }
+}
 
-    for (int i = simd_vec_size; i < vec_size; i++) {
-        const float x0 = a[i];
-        const float x1 = b[i];
-        out[i] = x0 + x1;
+// Note: `kern` is passed in by the callers so that the kernels are looked up once per op rather
+// than once per dot product.
+template <Dtype inp0_dtype, Dtype inp1_dtype>
+static inline float vec_dot_product(const Kernels& kern, const char* inp0, const char* inp1, int vecsize)
+{
+    if constexpr (inp0_dtype == kQint8 && inp1_dtype == kQint4) {
+        const Q8Block* inp0_data = reinterpret_cast<const Q8Block*>(inp0);
+        const Q4Block* inp1_data = reinterpret_cast<const Q4Block*>(inp1);
+        return kern.vec_dot_product_q8_q4(inp0_data, inp1_data, vecsize);
+    } else if constexpr (inp0_dtype == kQint8 && inp1_dtype == kQint8) {
+        const Q8Block* inp0_data = reinterpret_cast<const Q8Block*>(inp0);
+        const Q8Block* inp1_data = reinterpret_cast<const Q8Block*>(inp1);
+        return kern.vec_dot_product_q8(inp0_data, inp1_data, vecsize);
+    } else if constexpr (inp0_dtype == kFloat16 && inp1_dtype == kFloat16) {
+        const Float16* inp0_data = reinterpret_cast<const Float16*>(inp0);
+        const Float16* inp1_data = reinterpret_cast<const Float16*>(inp1);
+        return kern.vec_dot_product_f16(inp0_data, inp1_data, vecsize);
+    } else if constexpr (inp0_dtype == kFloat32 && inp1_dtype == kFloat16) {
+        const float* inp0_data = reinterpret_cast<const float*>(inp0);
+        const Float16* inp1_data = reinterpret_cast<const Float16*>(inp1);
+        return kern.vec_dot_product_f32_f16(inp0_data, inp1_data, vecsize);
+    } else if constexpr (inp0_dtype == kBFloat16 && inp1_dtype == kBFloat16) {
+        const BFloat16* inp0_data = reinterpret_cast<const BFloat16*>(inp0);
+        const BFloat16* inp1_data = reinterpret_cast<const BFloat16*>(inp1);
+        return kern.vec_dot_product_bf16(inp0_data, inp1_data, vecsize);
+    } else if constexpr (inp0_dtype == kFloat32 && inp1_dtype == kBFloat16) {
+        const float* inp0_data = reinterpret_cast<const float*>(inp0);
+        const BFloat16* inp1_data = reinterpret_cast<const BFloat16*>(inp1);
+        return kern.vec_dot_product_f32_bf16(inp0_data, inp1_data, vecsize);
+    } else {
+        static_assert(inp0_dtype == kFloat32 && inp1_dtype == kFloat32, "Unsupported dot product dtypes.");
+        const float* inp0_data = reinterpret_cast<const float*>(inp0);
+        const float* inp1_data = reinterpret_cast<const float*>(inp1);
+        return kern.vec_dot_product_f32(inp0_data, inp1_data, vecsize);
     }
+}
 
-#else
-    const int unrolled_vec_size = (vec_size / 8) * 8;
-
-    for (int i = 0; i < unrolled_vec_size; i += 8) {
-        out[i] = a[i] + b[i];
-        out[i + 1] = a[i + 1] + b[i + 1];
-        out[i + 2] = a[i + 2] + b[i + 2];
-        out[i + 3] = a[i + 3] + b[i + 3];
-        out[i + 4] = a[i + 4] + b[i + 4];
-        out[i + 5] = a[i + 5] + b[i + 5];
-        out[i + 6] = a[i + 6] + b[i + 6];
-        out[i + 7] = a[i + 7] + b[i + 7];
-    } 
-
-    // leftovers
-    for (int i = unrolled_vec_size; i < vec_size; i++) {
-        out[i] = a[i] + b[i];
-    }
 
-#endif
+static void copy_row(const Tensor& src, Tensor& dest, const int src_row_idx, const int dest_row_idx)
+{
+    const char* src_data = src.data_ptr<char>() + src_row_idx * src.bstride(0);
+    char* dest_data = dest.data_ptr<char>() + dest_row_idx * dest.bstride(0);
+    const int rowsize = src.dimsize(1);
+
+    if (src.dtype() == dest.dtype()) {
+        size_t copy_nbytes;
+        if (src.dtype() == kQint8) {
+            copy_nbytes = rowsize / globs::q8_block_size * sizeof(Q8Block);
+        } else if (src.dtype() == kQint4) {
+            copy_nbytes = rowsize / globs::q4_block_size * sizeof(Q4Block);
+        } else {
+            copy_nbytes = rowsize * src.itemsize();
+        }
+        std::memcpy(dest_data, src_data, copy_nbytes);
+    } else if (dest.dtype() == kFloat32) {
+        read_row_to_float(src_data, src.dtype(), reinterpret_cast<float*>(dest_data), rowsize);
+    } else {
+        float* inbuf = g_ops_state.buf(rowsize);
+        read_row_to_float(src_data, src.dtype(), inbuf, rowsize);
+        write_row_from_float(inbuf, dest_data, dest.dtype(), rowsize);
+    }
 }
 
 
-static float vec_dot_product_f16(const Float16* vec_a, const Float16* vec_b, int vec_size)
+static void tensor_row_index_impl(const Tensor& src, const Tensor& indices, Tensor& out, const int start_pos)
 {
-#if defined(__AVX__)
-
-    const int simd_vec_size = (vec_size / GTEN_SIMD_VEC_SIZE) * GTEN_SIMD_VEC_SIZE;
-    
-    Vec_f32x8 dot_prod_accum = vec_f32x8_setzero();
-    for (int i = 0; i < simd_vec_size; i += GTEN_SIMD_VEC_SIZE) {
-        Vec_f32x8 x0 = vec_f32x8_load(vec_a + i);
-        Vec_f32x8 x1 = vec_f32x8_load(vec_b + i);
-        // dot_prod += vec_f32x8_sum(vec_f32x8_mul(x0, x1));
-        dot_prod_accum = vec_f32x8_fma(x0, x1, dot_prod_accum);
-    }
-    
-    float dot_prod = vec_f32x8_sum(dot_prod_accum);
+    const int32_t* indices_data = indices.data_ptr<int32_t>();
 
-    for (int i = simd_vec_size; i < vec_size; i++) {
-        const float x0 = fp16_to_fp32(vec_a[i]);
-        const float x1 = fp16_to_fp32(vec_b[i]);
-        dot_prod += x0 * x1;
+    const int n_ctx = indices.numel();
+    for (int i = start_pos; i < n_ctx; i++) {
+        const int src_row_idx = indices_data[i];
+        const int dest_row_idx = i;
+        copy_row(src, out, src_row_idx, dest_row_idx);
     }
+}
 
-#else
+/// @brief Copies the indexed rows of the source tensor to output tensor.
+/// @param src A 2-d tensor to be indexed.
+/// @param indices A 1-d tensor of indices with dtype = int.
+/// @param out A 2d tensor with enough capacity to fit the indexed rows. Its dtype
+///  must be the same as source tensor.
+/// @param last_token_only Whether to index the last token only, if others are cached.
+void token_embed(const Tensor& weight, const Tensor& tokens, Tensor& out, const int start_pos)
+{
+    GTEN_ASSERT(weight.is_2d());
+    GTEN_ASSERT(tokens.is_1d() && tokens.dtype() == kInt32);
+    const int n_ctx = tokens.dimsize(0);
+    const int n_embd = weight.dimsize(1);
+    GTEN_ASSERT(out.shape_eq({n_ctx, n_embd}));
+    // GTEN_ASSERT(weight.dtype() == out.dtype());
 
-    float dot_prod = 0.0f;
+    tensor_row_index_impl(weight, tokens, out, start_pos);
+}
+
+
+static void vec_layer_norm_f32(const float* vec, const Float16* weight, const Float16* bias, float* out, int vec_size)
+{
+    const Kernels& kern = kernels();
+
+    const float mean = kern.vec_sum_f32(vec, vec_size) / vec_size;
+    const float variance = kern.vec_sum_squares_f32(vec, mean, vec_size) / (float)vec_size;
+    const float stddev = std::sqrt(variance);
+
+    // Epsilon added to standard deviation prevents div by zero.
+    const float eps = 1e-05f;
+    kern.vec_norm_f32(vec, weight, bias, mean, 1.0f / (stddev + eps), out, vec_size);
+}
 
-    for (int i = 0; i < vec_size; i += 1)
-    {
-        dot_prod += fp16_to_fp32(vec_a[i]) * fp16_to_fp32(vec_b[i]);
-    }
 
-#endif
+static void rms_norm_vec_f32(const float* inp, const Float16* weight, float* out, const int vec_size) {
+    const Kernels& kern = kernels();
+
+    const float sq_mean = kern.vec_sum_squares_f32(inp, 0.0f, vec_size) / static_cast<float>(vec_size);
+    const float root_mean_sq = std::sqrt(sq_mean);
 
-    return dot_prod;
+    kern.vec_norm_f32(inp, weight, /*bias=*/nullptr, 0.0f, 1.0f / (root_mean_sq + 1e-6f), out, vec_size);
 }
 
 
-static float vec_dot_product_f32(const float* vec_a, const float* vec_b, int vec_size)
+// Destination of the output rows of a matmul. The columns of each output row are split,
+// in order, across the `outs` tensors (a single tensor for a plain matmul) after the
+// epilogue is applied to the row.
+// If `gated` is true, the weight rows are the interleaved rows of the gate and up weights of
+// a gated MLP (see interleave_gate_up) and the row written is silu(gate) * up.
+// If `kv_cache` is set, the columns of the `outs` are followed by the keys and then the values
+// of the position of the row, which are written to their pages in the cache.
+// If `rope` is set, the rotary embedding is applied to the heads of the `outs` and of the keys
+// after the epilogue.
+struct MatmulDest {
+    const std::vector<Tensor*>& outs;
+    const MatmulEpilogue& epilogue;
+    bool gated;
+    const RopeTable* rope = nullptr;
+    KVCache* kv_cache = nullptr;
+};
+
+// Computes silu(gate) * up from a row of the interleaved gate and up outputs and writes it
+// to the first half of the row.
+static void gated_silu_mul_inplace(float* row_buf, const int d_out)
 {
-#if defined(__AVX__)
-
-    const int simd_vec_size = (vec_size / GTEN_SIMD_VEC_SIZE) * GTEN_SIMD_VEC_SIZE;
-    
-    Vec_f32x8 dot_prod_accum = vec_f32x8_setzero();
-    for (int i = 0; i < simd_vec_size; i += GTEN_SIMD_VEC_SIZE) {
-        Vec_f32x8 x0 = vec_f32x8_load(vec_a + i);
-        Vec_f32x8 x1 = vec_f32x8_load(vec_b + i);
-        // dot_prod += vec_f32x8_sum(vec_f32x8_mul(x0, x1));
-        dot_prod_accum = vec_f32x8_fma(x0, x1, dot_prod_accum);
+    const int n_rows = globs::q_pack_rows;
+    const int n_groups = d_out / (2 * n_rows);
+    // Group `g` is written to [g*n_rows, (g+1)*n_rows) which was read by this or a previous
+    // group, since the gate and up outputs of group `g` start at 2*g*n_rows.
+    const Kernels& kern = kernels();
+    for (int g = 0; g < n_groups; g++) {
+        const float* gate = row_buf + 2*g*n_rows;
+        const float* up = gate + n_rows;
+        float* out = row_buf + g*n_rows;
+        kern.vec_silu_mul_f32(gate, up, out, n_rows);
     }
-    
-    float dot_prod = vec_f32x8_sum(dot_prod_accum);
+}
 
-    for (int i = simd_vec_size; i < vec_size; i++) {
-        const float x0 = vec_a[i];
-        const float x1 = vec_b[i];
-        dot_prod += x0 * x1;
+// Rotates each head of the fp32 row `vec` of `width` elements by the rotary embedding angles
+// of position `pos`.
+static inline void rope_rotate_heads(float* vec, const int width, const RopeTable& rope, const int pos)
+{
+    const int d_head = rope.d_head();
+    const int d_half = rope.rope_d_head() / 2;
+    const float* cos = rope.cos(pos);
+    const float* sin = rope.sin(pos);
+    for (int h = 0; h < width / d_head; h++) {
+        kernels().vec_rope_f32(vec + h*d_head, cos, sin, d_half);
     }
+}
 
-#else
-    const int unrolled_vec_size = (vec_size / 8) * 8;
-
-    float dot_prod = 0.0f;
-    for (int i = 0; i < unrolled_vec_size; i += 8) {
-        dot_prod += vec_a[i] * vec_b[i];
-        dot_prod += vec_a[i + 1] * vec_b[i + 1];
-        dot_prod += vec_a[i + 2] * vec_b[i + 2];
-        dot_prod += vec_a[i + 3] * vec_b[i + 3];
-        dot_prod += vec_a[i + 4] * vec_b[i + 4];
-        dot_prod += vec_a[i + 5] * vec_b[i + 5];
-        dot_prod += vec_a[i + 6] * vec_b[i + 6];
-        dot_prod += vec_a[i + 7] * vec_b[i + 7];
+// Writes the keys and then the values of position `pos`, in the fp32 row `kv`, to their pages
+// in `cache`. The keys are rotated by `rope` first if it is set.
+static void write_kv_cache_row(float* kv, KVCache& cache, const RopeTable* rope, const int pos)
+{
+    const int n_heads = cache.n_heads();
+    const int d_head = cache.d_head();
+    const int kv_dim = n_heads * d_head;
+    if (rope) {
+        rope_rotate_heads(kv, kv_dim, *rope, pos);
     }
 
-    // leftovers
-    for (int i = unrolled_vec_size; i < vec_size; i++) {
-        dot_prod += vec_a[i] * vec_b[i];
+    const int page = pos / KVCache::kPagePositions;
+    const int page_pos = pos % KVCache::kPagePositions;
+    Tensor* pages[2] = {&cache.k_page(page), &cache.v_page(page)};
+    for (int i = 0; i < 2; i++) {
+        Tensor& page_t = *pages[i];
+        char* pos_data = page_t.data_ptr<char>() + page_pos * page_t.bstride(1);
+        for (int h = 0; h < n_heads; h++) {
+            write_row_from_float(kv + i * kv_dim + h * d_head, pos_data + h * page_t.bstride(0), cache.dtype(), d_head);
+        }
     }
-
-#endif
-    return dot_prod;
 }
 
-
-static float vec_dot_product_q8(const Q8Block* inp0, const Q8Block* inp1, const int vec_size)
+// Writes output row `r0` of the matmul, computed in `row_buf`, to its destination. `epi_buf`
+// is the epilogue buffer (see `epilogue_bufsize`) prepared by `load_matmul_epilogue`.
+static void write_matmul_row(float* row_buf, float* epi_buf, const MatmulDest& dest, const int r0)
 {
-    // GTEN_ASSERTM(vec_size % blk_size == 0, "row size: %d is incompatible with block size: %d", vec_size, blk_size);
-
-    const int block_size = globs::q8_block_size;
-    GTEN_ASSERT(vec_size % block_size == 0);
-    const int n_blocks = vec_size / block_size;
+    int d_out = 0;
+    for (const Tensor* out : dest.outs) {
+        d_out += out->dimsize(out->ndims() - 1);
+    }
+    if (dest.kv_cache) {
+        d_out += 2 * dest.kv_cache->n_heads() * dest.kv_cache->d_head();
+    }
 
-#if defined(__AVX__)
-    GTEN_ASSERT(block_size % 16 == 0);
-    // Dot product accumulator with 4 slots. The sum of the four accumulators gives the
-    // dot product.
-    __m128 dot_accum = _mm_set1_ps(0.0f);
+    const MatmulEpilogue& epilogue = dest.epilogue;
+    // The fp32 bias, if any, is followed by room for a row of the output.
+    float* res_buf = epi_buf;
+    if (epilogue.bias) {
+        const int bias_size = epilogue.bias->numel();
+        kernels().vec_add_f32(row_buf, epi_buf, row_buf, bias_size);
+        res_buf = epi_buf + bias_size;
+    }
 
-    for (int i = 0; i < n_blocks; i++)
-    {
-        const Q8Block* b0 = inp0 + i;
-        const Q8Block* b1 = inp1 + i;
+    if (dest.gated) {
+        gated_silu_mul_inplace(row_buf, 2 * d_out);
+    }
 
-        // dotprod = aq0*ad * bq0*bd + aq1*ad * bq1*bd + ... + aqN*ad + bqN*bd
-        //         = adbd(aq0 * bq0) + adbd(aq1 * bq1) + ... + adbd(aqN * bqN)
-        //         = adbd(aq0 * bq0 + aq1 * bq1 + ... + aqN * bqN)
-        // We compute integer arithmetic inside the brackets and scale by the block
-        // quantisation deltas.
+    if (epilogue.scale != 1.0f) {
+        kernels().vec_scale_f32(row_buf, epilogue.scale, d_out);
+    }
 
-        // Integer dot product accumulator for current block.
-        __m128i blk_dot_accum = _mm_set1_epi32(0);
+    if (epilogue.residual) {
+        const Tensor& res = *epilogue.residual;
+        read_row_to_float(res.data_ptr<char>() + r0*res.bstride(0), res.dtype(), res_buf, d_out);
+        kernels().vec_add_f32(row_buf, res_buf, row_buf, d_out);
+    }
 
-        for (int j = 0; j < block_size; j += 16)
-        {
-            // Load 64-bit(8 1-byte quants) in the lower half. [8-quants, -------].
-            const Qint8* b0_data = b0->data + j;
-            const Qint8* b1_data = b1->data + j;
+    int col = 0;
+    for (int i = 0; i < static_cast<int>(dest.outs.size()); i++) {
+        Tensor* out = dest.outs[i];
+        const int width = out->dimsize(out->ndims() - 1);
+        if (dest.rope) {
+            rope_rotate_heads(row_buf + col, width, *dest.rope, r0);
+        }
+        char* out_row_data = out->data_ptr<char>() + r0*out->bstride(0);
+        write_row_from_float(row_buf + col, out_row_data, out->dtype(), width);
+        col += width;
+    }
+    if (dest.kv_cache) {
+        write_kv_cache_row(row_buf + col, *dest.kv_cache, dest.rope, r0);
+    }
 
-            const __m128i a00 = _mm_loadu_si64(b0_data);
-            const __m128i a01 = _mm_loadu_si64(b0_data + 8);
+    if (epilogue.norm_out) {
+        // The residual row in `res_buf` is no longer needed so we write the norm there.
+        const Float16* weight_data = epilogue.norm_weight->data_ptr<Float16>();
+        if (epilogue.norm_bias) {
+            vec_layer_norm_f32(row_buf, weight_data, epilogue.norm_bias->data_ptr<Float16>(), res_buf, d_out);
+        } else {
+            rms_norm_vec_f32(row_buf, weight_data, res_buf, d_out);
+        }
+        Tensor& norm_out = *epilogue.norm_out;
+        write_row_from_float(res_buf, norm_out.data_ptr<char>() + r0*norm_out.bstride(0), norm_out.dtype(), d_out);
+    }
+}
 
-            const __m128i b00 = _mm_loadu_si64(b1_data);
-            const __m128i b01 = _mm_loadu_si64(b1_data + 8);
+// Returns the number of floats of the matmul scratch buffer, after the output rows, used by
+// the epilogue of a matmul with `d_out` output columns: the bias in fp32 and a row of the
+// output for the residual or the norm.
+static int epilogue_bufsize(const MatmulDest& dest, const int d_out)
+{
+    const int bias_bufsize = dest.epilogue.bias ? dest.epilogue.bias->numel() : 0;
+    const int res_bufsize = (dest.epilogue.residual || dest.epilogue.norm_out) ? d_out : 0;
+    return bias_bufsize + res_bufsize;
+}
 
-            // Convert 8 quants in the lower half to 16-bit ints.
-            const __m128i a02 = _mm_cvtepi8_epi16(a00);
-            const __m128i a03 = _mm_cvtepi8_epi16(a01);
+// Prepares the epilogue buffer of a matmul before its rows are written. The bias is converted
+// to fp32 once per matmul rather than for each output row.
+static void load_matmul_epilogue(const MatmulDest& dest, float* epi_buf)
+{
+    if (dest.epilogue.bias) {
+        const Tensor& bias = *dest.epilogue.bias;
+        kernels().fp16_to_fp32_row(bias.data_ptr<Float16>(), epi_buf, bias.numel());
+    }
+}
 
-            const __m128i b02 = _mm_cvtepi8_epi16(b00);
-            const __m128i b03 = _mm_cvtepi8_epi16(b01);
+// Number of input rows and weight rows that make up a GEMM tile. A tile of weight rows
+// is loaded from memory once and then dotted against all the input rows in the tile
+// while it is still in cache.
+static const int kGemmInpTile = 8;
+static const int kGemmWeightTile = 16;
+// Maximum number of input rows computed in a single parallel loop.
+static const int kGemmMaxRowChunk = 64;
+
+// Number of input row elements that make up the unit of the split-K slices, the block size
+// of the quantized dtypes, and the minimum number of units per slice so that adding up the
+// partial dot products is little work compared to computing them.
+static const int kSplitKUnit = 32;
+static const int kSplitKMinUnits = 8;
+// Number of tasks per thread the matmul partitioner aims for, so that the threads that
+// finish their tasks early (e.g on faster cores) can pick up the remaining ones.
+static const int kMatmulTasksPerThread = 4;
+
+
+// Returns the dtype of the input rows in the dot products of a matmul. For fp16 weights, the
+// fp16 input rows are converted to fp32 once instead of once per weight row. bf16 input rows
+// are used as they are since the bf16 dot products either multiply bf16 natively or convert
+// them with a shift. For quantized weights, fp32 input rows are quantized to q8 so the
+// activations that are kept in fp32 are quantized once, here, at the input of the matmul.
+static constexpr Dtype matmul_dot_inp_dtype(Dtype inp_dtype, Dtype w_dtype)
+{
+    if (inp_dtype == kFloat16 && w_dtype == kFloat16) {
+        return kFloat32;
+    }
+    if (inp_dtype == kFloat32 && (w_dtype == kQint8 || w_dtype == kQint4)) {
+        return kQint8;
+    }
+    return inp_dtype;
+}
 
-            // Multiply the 8 16-bit ints to obtain 8 32-bit ints and add adjacent
-            // values to obtain 4 32-bit ints.
-            // TODO: Can we instead do 16-bit to 16-bit e.g _mullo_epi16
-            const __m128i c00 = _mm_madd_epi16(a02, b02);
-            const __m128i c01 = _mm_madd_epi16(a03, b03);
 
-            // Add the results and add the output to the accumulator.
-            const __m128i c02 = _mm_add_epi32(c00, c01);
-            blk_dot_accum = _mm_add_epi32(blk_dot_accum, c02);
-        }
+// Returns the number of bytes of the first `n` elements of a row of the given dtype. For the
+// quantized dtypes, `n` must be a multiple of the block size.
+template <Dtype dtype>
+static constexpr int row_offset_nbytes(int n)
+{
+    if constexpr (dtype == kQint8) {
+        return n / globs::q8_block_size * sizeof(Q8Block);
+    } else if constexpr (dtype == kQint4) {
+        return n / globs::q4_block_size * sizeof(Q4Block);
+    } else if constexpr (dtype == kFloat16) {
+        return n * sizeof(Float16);
+    } else if constexpr (dtype == kBFloat16) {
+        return n * sizeof(BFloat16);
+    } else {
+        return n * sizeof(float);
+    }
+}
 
-        const __m128 blk_dot_accum_f = _mm_cvtepi32_ps(blk_dot_accum);
-        // const __m128 a_blk_delta = _mm_broadcast_ss(a_ds + i);
-        // const __m128 b_blk_delta = _mm_broadcast_ss(b_ds + i); 
-        // const __m128 ab_blk_delta = _mm_mul_ps(a_blk_delta, b_blk_delta);
-        const __m128 block_delta_multiplier = _mm_set1_ps(fp16_to_fp32(b0->delta) * fp16_to_fp32(b1->delta));
-        dot_accum = _mm_add_ps(dot_accum, _mm_mul_ps(blk_dot_accum_f, block_delta_multiplier));
+// Returns the size, in floats, of the buffer that holds an input row of a matmul after its
+// conversion to `dot_inp_dtype`, or 0 if the input rows are used as they are.
+template <Dtype inp_dtype, Dtype dot_inp_dtype>
+static constexpr int matmul_inp_bufsize(int n_embd)
+{
+    if constexpr (inp_dtype == dot_inp_dtype) {
+        return 0;
+    } else {
+        return (row_offset_nbytes<dot_inp_dtype>(n_embd) + sizeof(float) - 1) / sizeof(float);
     }
+}
 
-    const __m128 dotsum0 = _mm_hadd_ps(dot_accum, dot_accum);
-    const __m128 dotsum1 = _mm_hadd_ps(dotsum0, dotsum0);
-    const float dot_prod = _mm_cvtss_f32(dotsum1);
+// Converts an input row of a matmul to the dtype of the dot products.
+static void convert_matmul_inp_row(const char* inp, Dtype inp_dtype, char* out, Dtype dot_inp_dtype, int rowsize)
+{
+    if (dot_inp_dtype == kFloat32) {
+        read_row_to_float(inp, inp_dtype, reinterpret_cast<float*>(out), rowsize);
+    } else {
+        GTEN_ASSERT(inp_dtype == kFloat32);
+        write_row_from_float(reinterpret_cast<const float*>(inp), out, dot_inp_dtype, rowsize);
+    }
+}
 
-#else
 
-    float dot_prod = 0.0f;
+// How the work of a matmul over a chunk of input rows is split into tasks that are run in
+// parallel. The output columns are split into units (weight rows, tiles of weight rows or
+// packed row groups depending on the matmul), the input rows into `n_row_tiles` tiles and
+// the reduction over the input row elements into `n_k_splits` slices of `k_split_size`
+// elements whose partial dot products are added up at the end (split-K).
+struct MatmulPartition {
+    int n_row_tiles;
+    int n_k_splits;
+    int k_split_size;
+};
 
-    for (int i = 0; i < n_blocks; i++)
-    {
-        const Q8Block* b0 = inp0 + i;
-        const Q8Block* b1 = inp1 + i;
+// Returns the partition of a matmul of `n_rows` input rows of `n_embd` elements with
+// `n_col_units` units of output columns. Splitting the output columns needs no extra work
+// so it is all we do when there are enough units to keep the threads busy. Otherwise, for
+// multiple input rows (prefill) we also split the rows (2D tiles) and for a single input row
+// (decode), e.g the kv projections on a host with many cores, we split the reduction.
+static MatmulPartition partition_matmul(const int n_rows, const int n_embd, const int n_col_units)
+{
+    MatmulPartition part{1, 1, n_embd};
 
-        int block_dot_prod = 0;
-        for (int j = 0; j < block_size; j++)
-        {
-            block_dot_prod += b0->data[j] * b1->data[j];
-        }
+    const int min_tasks = kMatmulTasksPerThread * thread_pool().n_threads();
+    if (n_col_units >= min_tasks) {
+        return part;
+    }
 
-        const float b0_delta = fp16_to_fp32(b0->delta);
-        const float b1_delta = fp16_to_fp32(b1->delta);
-        dot_prod += block_dot_prod * b0_delta * b1_delta;
+    const int n_splits = (min_tasks + n_col_units - 1) / n_col_units;
+    if (n_rows > 1) {
+        const int max_row_tiles = (n_rows + kGemmInpTile - 1) / kGemmInpTile;
+        part.n_row_tiles = std::min(n_splits, max_row_tiles);
+    } else if (n_embd % kSplitKUnit == 0) {
+        const int n_k_units = n_embd / kSplitKUnit;
+        const int max_k_splits = std::max(1, n_k_units / kSplitKMinUnits);
+        // Rounded so that none of the slices is empty.
+        const int split_units = (n_k_units + std::min(n_splits, max_k_splits) - 1) / std::min(n_splits, max_k_splits);
+        part.n_k_splits = (n_k_units + split_units - 1) / split_units;
+        part.k_split_size = split_units * kSplitKUnit;
     }
-#endif
 
-    return dot_prod;
+    return part;
 }
 
+// Returns the number of floats of the buffer that holds the partial dot products of the
+// split-K slices of a matmul chunk, other than the first slice which is written to the
+// output buffer.
+static int partial_bufsize(const MatmulPartition& part, const int chunk_rows, const int d_out)
+{
+    return (part.n_k_splits - 1) * chunk_rows * d_out;
+}
 
-static float vec_dot_product_q8_q4(const Q8Block* inp0, const Q4Block* inp1, const int vec_size)
+// Computes the output rows [chunk_start, chunk_end) of a matmul, with `d_out` columns, into
+// `out_buf` by running the tasks of the partition in parallel.
+// `compute_tile(r_start, r_end, unit, k_start, k_end, tile_out)` must compute the dot products
+// of the input rows [r_start, r_end) with the weight rows of the given output unit over the
+// input elements [k_start, k_end) and write them to `tile_out`, which has the layout of
+// `out_buf`. The split-K slices after the first are written to `partial_buf` (of size
+// `partial_bufsize`) and then added to `out_buf`.
+template <typename ComputeTile>
+static void run_matmul_tasks(const MatmulPartition& part, const int chunk_start, const int chunk_end, const int n_embd,
+                             const int n_units, const int d_out, float* out_buf, float* partial_buf, const ComputeTile& compute_tile)
 {
-    const int block_size = globs::q8_block_size;
-    GTEN_ASSERT(block_size == globs::q4_block_size && vec_size % block_size == 0);
-    const int n_blocks = vec_size / block_size;
+    const int chunk_n = chunk_end - chunk_start;
+    const int tile_rows = (chunk_n + part.n_row_tiles - 1) / part.n_row_tiles;
+    const int n_tasks = n_units * part.n_row_tiles * part.n_k_splits;
+
+    // The units are the fastest varying so that the tasks are claimed in the order of the
+    // consecutive units of a single row tile and slice.
+    thread_pool().parallel_for(n_tasks, [&](const int task) {
+        const int unit = task % n_units;
+        const int row_tile = (task / n_units) % part.n_row_tiles;
+        const int k_split = task / (n_units * part.n_row_tiles);
+
+        const int r_start = chunk_start + row_tile * tile_rows;
+        const int r_end = std::min(r_start + tile_rows, chunk_end);
+        if (r_start >= r_end) {
+            return;
+        }
+        const int k_start = k_split * part.k_split_size;
+        const int k_end = std::min(k_start + part.k_split_size, n_embd);
 
-#if defined(__AVX__)
-    GTEN_ASSERT(block_size % 16 == 0);
-    // Dot product accumulator with 4 slots. The sum of the four accumulators gives the
-    // dot product.
-    __m128 dot_accum = _mm_set1_ps(0.0f);
+        float* tile_out = k_split == 0 ? out_buf : partial_buf + (k_split - 1) * chunk_n * d_out;
+        compute_tile(r_start, r_end, unit, k_start, k_end, tile_out);
+    });
 
-    for (int i = 0; i < n_blocks; i++)
-    {
-        const Q8Block* a0 = inp0 + i;
-        const Q4Block* b0 = inp1 + i;
-
-        // Integer dot product accumulator for current block.
-        __m128i blk_dot_accum = _mm_set1_epi32(0);
-
-        const Qint8* a0_data = a0->data;
-        const __m128i a00 = _mm_loadu_si64(a0_data);
-        const __m128i a01 = _mm_loadu_si64(a0_data + 8);
-        const __m128i a02 = _mm_loadu_si64(a0_data + 16);
-        const __m128i a03 = _mm_loadu_si64(a0_data + 24);
-
-        // Convert 8 quants in the lower half to 16-bit ints.
-        const __m128i a04 = _mm_cvtepi8_epi16(a00);
-        const __m128i a05 = _mm_cvtepi8_epi16(a01);
-        const __m128i a06 = _mm_cvtepi8_epi16(a02);
-        const __m128i a07 = _mm_cvtepi8_epi16(a03);
-
-        // load 16 bytes => 
-        // load into lower 64 bits.
-        const __m128i b00 = _mm_loadu_si64(b0->data);
-        const __m128i b01 = _mm_loadu_si64(b0->data + 8);
-
-        const __m128i b02 = _mm_cvtepu8_epi16(b00);
-        const __m128i b03 = _mm_cvtepu8_epi16(b01);
-
-        const __m128i add_vec = _mm_set1_epi16(-7);
-        const __m128i b04 = _mm_add_epi16(_mm_srli_epi16(b02, 4), add_vec); // b00_high
-        const __m128i b05 = _mm_add_epi16(_mm_srli_epi16(b03, 4), add_vec); // b01_high
-
-        const __m128i and_vec = _mm_set1_epi16(0b0000000000001111);
-        const __m128i b06 = _mm_add_epi16(_mm_and_si128(b02, and_vec), add_vec); // b00_low
-        const __m128i b07 = _mm_add_epi16(_mm_and_si128(b03, and_vec), add_vec); // b01_low
-
-        // Multiply the 8 16-bit ints to obtain 8 32-bit ints and add adjacent
-        // values to obtain 4 32-bit ints.
-        // TODO: Can we instead do 16-bit to 16-bit e.g _mullo_epi16
-        const __m128i c00 = _mm_madd_epi16(a04, b04);
-        const __m128i c01 = _mm_madd_epi16(a05, b05);
-        const __m128i c02 = _mm_madd_epi16(a06, b06);
-        const __m128i c03 = _mm_madd_epi16(a07, b07);
-
-        // Add the results and add the output to the accumulator.
-        const __m128i c05 = _mm_add_epi32(c00, c01);
-        const __m128i c06 = _mm_add_epi32(c05, _mm_add_epi32(c02, c03));
-        blk_dot_accum = _mm_add_epi32(blk_dot_accum, c06);
-
-
-        const __m128 blk_dot_accum_f = _mm_cvtepi32_ps(blk_dot_accum);
-        // const __m128 a_blk_delta = _mm_broadcast_ss(a_ds + i);
-        // const __m128 b_blk_delta = _mm_broadcast_ss(b_ds + i); 
-        // const __m128 ab_blk_delta = _mm_mul_ps(a_blk_delta, b_blk_delta);
-        const __m128 block_delta_multiplier = _mm_set1_ps(fp16_to_fp32(a0->delta) * fp16_to_fp32(b0->delta));
-        dot_accum = _mm_add_ps(dot_accum, _mm_mul_ps(blk_dot_accum_f, block_delta_multiplier));
+    const Kernels& kern = kernels();
+    for (int k_split = 1; k_split < part.n_k_splits; k_split++) {
+        kern.vec_add_f32(out_buf, partial_buf + (k_split - 1) * chunk_n * d_out, out_buf, chunk_n * d_out);
     }
+}
 
-    const __m128 dotsum0 = _mm_hadd_ps(dot_accum, dot_accum);
-    const __m128 dotsum1 = _mm_hadd_ps(dotsum0, dotsum0);
-    const float dot_prod = _mm_cvtss_f32(dotsum1);
-
-#else
-
-    float dot_prod = 0.0f;
-
-    for (int i = 0; i < n_blocks; i++)
-    {
-        const Q8Block* b0 = inp0 + i;
-        const Q4Block* b1 = inp1 + i;
 
-        int block_dot_prod = 0;
-        const int half_block_size = block_size / 2;
-        for (int j = 0; j < half_block_size; j += 1)
-        {
-            const Qint4 b00 = b1->data[j];
+// Computes the matmul for multiple input rows (i.e prompt prefill). Instead of streaming
+// the whole weight matrix once for every input row, we split the weight rows into tiles
+// and compute the dot products of each tile with a tile of input rows at once so that
+// each weight block is loaded once per tile instead of once per input row.
+template <Dtype inp_dtype, Dtype w_dtype>
+static void matmul_2d_gemm_impl(const Tensor& inp, const Tensor& w, const MatmulDest& dest, const int start_pos)
+{
+    const char* w_data = w.data_ptr<char>();
 
-            const Qint8 b01 = (b00 >> 4) - 7;
-            const Qint8 b02 = (b00 & 0b00001111) - 7;
+    const int n_ctx = inp.dimsize(0);
+    const int n_embd = inp.dimsize(1);
+    const int d_out = w.dimsize(0);
+    const int w_st0 = w.bstride(0);
 
-            block_dot_prod += b0->data[j] * b01;
-            block_dot_prod += b0->data[j+half_block_size] * b02;
+    constexpr Dtype dot_inp_dtype = matmul_dot_inp_dtype(inp_dtype, w_dtype);
+    constexpr bool convert_inp = dot_inp_dtype != inp_dtype;
+    const int inp_bufsize = matmul_inp_bufsize<inp_dtype, dot_inp_dtype>(n_embd);
+    const int row_bufsize = d_out + inp_bufsize;
+    const int epi_bufsize = epilogue_bufsize(dest, d_out);
+    const int max_chunk_rows = (g_ops_state.max_bufsize / sizeof(float) - epi_bufsize) / row_bufsize;
+    const int chunk_rows = std::min({kGemmMaxRowChunk, max_chunk_rows, n_ctx - start_pos});
+    GTEN_ASSERT(chunk_rows >= 1);
+
+    const int n_weight_tiles = (d_out + kGemmWeightTile - 1) / kGemmWeightTile;
+    const MatmulPartition part = partition_matmul(chunk_rows, n_embd, n_weight_tiles);
+
+    const int part_bufsize = partial_bufsize(part, chunk_rows, d_out);
+    float* out_buf = g_ops_state.buf(chunk_rows * row_bufsize + part_bufsize + epi_bufsize);
+    float* inp_buf = out_buf + chunk_rows * d_out;
+    float* partial_buf = out_buf + chunk_rows * row_bufsize;
+    float* epi_buf = partial_buf + part_bufsize;
+    load_matmul_epilogue(dest, epi_buf);
+    const Kernels& kern = kernels();
+
+    // The input rows are either read from the input tensor directly or from `inp_buf` after
+    // conversion to the dtype of the dot products.
+    const int inp_st0 = convert_inp ? inp_bufsize * sizeof(float) : inp.bstride(0);
+
+    for (int chunk_start = start_pos; chunk_start < n_ctx; chunk_start += chunk_rows) {
+        const int chunk_end = std::min(chunk_start + chunk_rows, n_ctx);
+
+        // Pointer to the first input row of the chunk.
+        const char* chunk_inp_data;
+        if constexpr (convert_inp) {
+            for (int r0 = chunk_start; r0 < chunk_end; r0++) {
+                const char* inp_row_data = inp.data_ptr<char>() + r0*inp.bstride(0);
+                char* inp_buf_row = reinterpret_cast<char*>(inp_buf + (r0 - chunk_start)*inp_bufsize);
+                convert_matmul_inp_row(inp_row_data, inp_dtype, inp_buf_row, dot_inp_dtype, n_embd);
+            }
+            chunk_inp_data = reinterpret_cast<const char*>(inp_buf);
+        } else {
+            chunk_inp_data = inp.data_ptr<char>() + chunk_start*inp_st0;
         }
 
-        const float b0_delta = fp16_to_fp32(b0->delta);
-        const float b1_delta = fp16_to_fp32(b1->delta);
-        dot_prod += block_dot_prod * b0_delta * b1_delta;
-    }
-#endif
+        auto compute_tile = [&](int r_start, int r_end, int wt, int k_start, int k_end, float* tile_out) {
+            const int c_start = wt * kGemmWeightTile;
+            const int c_end = std::min(c_start + kGemmWeightTile, d_out);
+            const int inp_k_offset = row_offset_nbytes<dot_inp_dtype>(k_start);
+            const int w_k_offset = row_offset_nbytes<w_dtype>(k_start);
 
-    return dot_prod;
-}
+            for (int rt_start = r_start; rt_start < r_end; rt_start += kGemmInpTile) {
+                const int rt_end = std::min(rt_start + kGemmInpTile, r_end);
 
+                for (int c0 = c_start; c0 < c_end; c0++) {
+                    const char* w_row_data = w_data + c0*w_st0 + w_k_offset;
 
-static float vec_dot_product(const char* inp0, Dtype inp0_dtype, const char* inp1, Dtype inp1_dtype, int vecsize)
-{
-    switch (inp0_dtype)
-    {
-        case kQint8: {
-            if (inp1_dtype == kQint4) {
-                const Q8Block* inp0_data = reinterpret_cast<const Q8Block*>(inp0);
-                const Q4Block* inp1_data = reinterpret_cast<const Q4Block*>(inp1);
-                return vec_dot_product_q8_q4(inp0_data, inp1_data, vecsize);
-            } else {
-                const Q8Block* inp0_data = reinterpret_cast<const Q8Block*>(inp0);
-                const Q8Block* inp1_data = reinterpret_cast<const Q8Block*>(inp1);
-                return vec_dot_product_q8(inp0_data, inp1_data, vecsize);
+                    for (int r0 = rt_start; r0 < rt_end; r0++) {
+                        const char* inp_row_data = chunk_inp_data + (r0 - chunk_start)*inp_st0 + inp_k_offset;
+                        const float dot_prod = vec_dot_product<dot_inp_dtype, w_dtype>(kern, inp_row_data, w_row_data, k_end - k_start);
+                        tile_out[(r0 - chunk_start)*d_out + c0] = dot_prod;
+                    }
+                }
             }
-        }
-        case kFloat16: {
-            const Float16* inp0_data = reinterpret_cast<const Float16*>(inp0);
-            const Float16* inp1_data = reinterpret_cast<const Float16*>(inp1);
-            return vec_dot_product_f16(inp0_data, inp1_data, vecsize);
-        }
-        case kFloat32: {
-            const float* inp0_data = reinterpret_cast<const float*>(inp0);
-            const float* inp1_data = reinterpret_cast<const float*>(inp1);
-            return vec_dot_product_f32(inp0_data, inp1_data, vecsize);
-        }
-        default: {
-            GTEN_ASSERT(false);
-            return 0.0f;
+        };
+        run_matmul_tasks(part, chunk_start, chunk_end, n_embd, n_weight_tiles, d_out, out_buf, partial_buf, compute_tile);
+
+        for (int r0 = chunk_start; r0 < chunk_end; r0++) {
+            write_matmul_row(out_buf + (r0 - chunk_start)*d_out, epi_buf, dest, r0);
         }
     }
 }
 
 
-static void copy_row(const Tensor& src, Tensor& dest, const int src_row_idx, const int dest_row_idx)
+// Computes the matmul with a weight in the packed layout (see quants.h). The kernels compute
+// the dot products of an input row with all the rows of a weight row group at once. For
+// multiple input rows, each row group is loaded once and then dotted against all the input
+// rows of the chunk while it is still in cache. fp32 input rows are quantized to q8 per chunk.
+static void matmul_2d_packed_impl(const Tensor& inp, const Tensor& w, const MatmulDest& dest, const int start_pos)
 {
-    const char* src_data = src.data_ptr<char>() + src_row_idx * src.bstride(0);
-    char* dest_data = dest.data_ptr<char>() + dest_row_idx * dest.bstride(0);
+    GTEN_ASSERTM(inp.dtype() == kQint8 || inp.dtype() == kFloat32, "Packed weights require q8 or fp32 inputs.");
 
-    if (src.dtype() == kQint8) {
-        const size_t copy_nbytes = src.dimsize(1) / globs::q8_block_size * sizeof(Q8Block);
-        std::memcpy(dest_data, src_data, copy_nbytes);
-    } else if (src.dtype() == kQint4) {
-        GTEN_ASSERT(dest.dtype() == kQint8);
-        const int rowsize = src.dimsize(1);
-        float* inbuf = g_ops_state.buf(rowsize);
-        read_row_to_float(src_data, kQint4, inbuf, rowsize);
-        write_row_from_float(inbuf, dest_data, kQint8, rowsize);
-    }
-    else {
-        const size_t copy_nbytes = src.dimsize(1) * src.itemsize();
-        std::memcpy(dest_data, src_data, copy_nbytes);
-    }
-}
+    const char* inp_data = inp.data_ptr<char>();
+    const uint8_t* w_data = w.data_ptr<uint8_t>();
 
+    const int n_ctx = inp.dimsize(0);
+    const int n_embd = inp.dimsize(1);
+    const int d_out = w.dimsize(0);
 
-static void tensor_row_index_impl(const Tensor& src, const Tensor& indices, Tensor& out, const int start_pos)
-{
-    const int32_t* indices_data = indices.data_ptr<int32_t>();
+    const int n_rows = globs::q_pack_rows;
+    const int block_size = globs::q8_block_size;
+    const int n_groups = d_out / n_rows;
+    const int n_blocks = n_embd / block_size;
+    const Kernels& kern = kernels();
+    const bool is_q8 = w.dtype() == kQint8;
+    const int group_nbytes = is_q8 ? q8_packed_group_nbytes(n_blocks) : q4_packed_group_nbytes(n_blocks);
+    const auto vec_dot_product_packed = is_q8 ? kern.vec_dot_product_q8_packed : kern.vec_dot_product_q8_q4_packed;
+
+    const bool convert_inp = inp.dtype() == kFloat32;
+    const int inp_bufsize = convert_inp ? matmul_inp_bufsize<kFloat32, kQint8>(n_embd) : 0;
+    const int row_bufsize = d_out + inp_bufsize;
+    const int epi_bufsize = epilogue_bufsize(dest, d_out);
+    const int max_chunk_rows = (g_ops_state.max_bufsize / sizeof(float) - epi_bufsize) / row_bufsize;
+    const int chunk_rows = std::min({kGemmMaxRowChunk, max_chunk_rows, n_ctx - start_pos});
+    GTEN_ASSERT(chunk_rows >= 1);
+    const MatmulPartition part = partition_matmul(chunk_rows, n_embd, n_groups);
+
+    const int part_bufsize = partial_bufsize(part, chunk_rows, d_out);
+    float* out_buf = g_ops_state.buf(chunk_rows * row_bufsize + part_bufsize + epi_bufsize);
+    float* inp_buf = out_buf + chunk_rows * d_out;
+    float* partial_buf = out_buf + chunk_rows * row_bufsize;
+    float* epi_buf = partial_buf + part_bufsize;
+    load_matmul_epilogue(dest, epi_buf);
+    const int inp_st0 = convert_inp ? inp_bufsize * sizeof(float) : inp.bstride(0);
+
+    for (int chunk_start = start_pos; chunk_start < n_ctx; chunk_start += chunk_rows) {
+        const int chunk_end = std::min(chunk_start + chunk_rows, n_ctx);
+
+        // Pointer to the first (q8) input row of the chunk.
+        const char* chunk_inp_data;
+        if (convert_inp) {
+            for (int r0 = chunk_start; r0 < chunk_end; r0++) {
+                const char* inp_row_data = inp_data + r0*inp.bstride(0);
+                char* inp_buf_row = reinterpret_cast<char*>(inp_buf + (r0 - chunk_start)*inp_bufsize);
+                convert_matmul_inp_row(inp_row_data, kFloat32, inp_buf_row, kQint8, n_embd);
+            }
+            chunk_inp_data = reinterpret_cast<const char*>(inp_buf);
+        } else {
+            chunk_inp_data = inp_data + chunk_start*inp_st0;
+        }
 
-    const int n_ctx = indices.numel();
-    for (int i = start_pos; i < n_ctx; i++) {
-        const int src_row_idx = indices_data[i];
-        const int dest_row_idx = i;
-        copy_row(src, out, src_row_idx, dest_row_idx);
-    }
-}
+        auto compute_tile = [&](int r_start, int r_end, int g, int k_start, int k_end, float* tile_out) {
+            const uint8_t* w_group = w_data + (size_t)g * group_nbytes;
+            const int blk_start = k_start / block_size;
+            const Float16* w_deltas = q_packed_group_deltas(w_group, blk_start);
+            const Qint8* w_quants = is_q8 ? q8_packed_group_quants(w_group, n_blocks, blk_start)
+                                          : q4_packed_group_quants(w_group, n_blocks, blk_start);
 
-/// @brief Copies the indexed rows of the source tensor to output tensor.
-/// @param src A 2-d tensor to be indexed.
-/// @param indices A 1-d tensor of indices with dtype = int.
-/// @param out A 2d tensor with enough capacity to fit the indexed rows. Its dtype
-///  must be the same as source tensor.
-/// @param last_token_only Whether to index the last token only, if others are cached.
-void token_embed(const Tensor& weight, const Tensor& tokens, Tensor& out, const int start_pos)
-{
-    GTEN_ASSERT(weight.is_2d());
-    GTEN_ASSERT(tokens.is_1d() && tokens.dtype() == kInt32);
-    const int n_ctx = tokens.dimsize(0);
-    const int n_embd = weight.dimsize(1);
-    GTEN_ASSERT(out.shape_eq({n_ctx, n_embd}));
-    // GTEN_ASSERT(weight.dtype() == out.dtype());
+            for (int r0 = r_start; r0 < r_end; r0++) {
+                const Q8Block* inp_row_data = reinterpret_cast<const Q8Block*>(chunk_inp_data + (r0 - chunk_start)*inp_st0) + blk_start;
+                vec_dot_product_packed(inp_row_data, w_deltas, w_quants, tile_out + (r0 - chunk_start)*d_out + g*n_rows, k_end - k_start);
+            }
+        };
+        run_matmul_tasks(part, chunk_start, chunk_end, n_embd, n_groups, d_out, out_buf, partial_buf, compute_tile);
 
-    tensor_row_index_impl(weight, tokens, out, start_pos);
+        for (int r0 = chunk_start; r0 < chunk_end; r0++) {
+            write_matmul_row(out_buf + (r0 - chunk_start)*d_out, epi_buf, dest, r0);
+        }
+    }
 }
 
 
-static void matmul_2d_impl(const Tensor& inp, const Tensor& w, Tensor& out, const int start_pos)
+// Computes the matmul for a single input row (i.e decoding) with each weight row as a unit
+// of work of the partition.
+template <Dtype inp_dtype, Dtype w_dtype>
+static void matmul_2d_gemv_impl(const Tensor& inp, const Tensor& w, const MatmulDest& dest, const int start_pos)
 {
     const char* inp_data = inp.data_ptr<char>();
-    const char* w_data = w.data_ptr<char>(); 
-    char* out_data = out.data_ptr<char>();
-
-    const Dtype inp_dtype = inp.dtype();
-    const Dtype w_dtype = w.dtype();
-    const Dtype out_dtype = out.dtype();
+    const char* w_data = w.data_ptr<char>();
 
     const int n_ctx = inp.dimsize(0);
     const int n_embd = inp.dimsize(1);
     const int d_out = w.dimsize(0);
     const int inp_st0 = inp.bstride(0);
     const int w_st0 = w.bstride(0);
-    const int out_st0 = out.bstride(0); 
 
-    float* out_buf = g_ops_state.buf(d_out);
+    const MatmulPartition part = partition_matmul(/*n_rows=*/1, n_embd, d_out);
+
+    constexpr Dtype dot_inp_dtype = matmul_dot_inp_dtype(inp_dtype, w_dtype);
+    constexpr bool convert_inp = dot_inp_dtype != inp_dtype;
+    const int inp_bufsize = matmul_inp_bufsize<inp_dtype, dot_inp_dtype>(n_embd);
+    const int part_bufsize = partial_bufsize(part, /*chunk_rows=*/1, d_out);
+    float* out_buf = g_ops_state.buf(d_out + inp_bufsize + part_bufsize + epilogue_bufsize(dest, d_out));
+    float* inp_buf = out_buf + d_out;
+    float* partial_buf = inp_buf + inp_bufsize;
+    float* epi_buf = partial_buf + part_bufsize;
+    load_matmul_epilogue(dest, epi_buf);
+    const Kernels& kern = kernels();
 
     for (int r0 = start_pos; r0 < n_ctx; r0++) {
         const char* inp_row_data = inp_data + r0*inp_st0;
-
-#if defined(_OPENMP)
-        #pragma omp parallel for
-#endif
-        for (int c0 = 0; c0 < d_out; c0++)
-        {
-            const char* w_row_data = w_data + c0*w_st0;
-            const float dot_prod = vec_dot_product(inp_row_data, inp_dtype, w_row_data, w_dtype, n_embd);
-            out_buf[c0] = dot_prod;
+        if constexpr (convert_inp) {
+            convert_matmul_inp_row(inp_row_data, inp_dtype, reinterpret_cast<char*>(inp_buf), dot_inp_dtype, n_embd);
+            inp_row_data = reinterpret_cast<const char*>(inp_buf);
         }
-        
-        char* out_row_data = out_data + r0*out_st0;
-        write_row_from_float(out_buf, out_row_data, out_dtype, d_out);
+
+        auto compute_tile = [&](int, int, int c0, int k_start, int k_end, float* tile_out) {
+            const char* w_row_data = w_data + c0*w_st0 + row_offset_nbytes<w_dtype>(k_start);
+            const char* inp_slice_data = inp_row_data + row_offset_nbytes<dot_inp_dtype>(k_start);
+            tile_out[c0] = vec_dot_product<dot_inp_dtype, w_dtype>(kern, inp_slice_data, w_row_data, k_end - k_start);
+        };
+        run_matmul_tasks(part, r0, r0 + 1, n_embd, d_out, d_out, out_buf, partial_buf, compute_tile);
+
+        write_matmul_row(out_buf, epi_buf, dest, r0);
+    }
+}
+
+
+// Calls `fn` with the input and weight dtypes of a matmul as compile-time constants, like
+// `dispatch_dot_dtypes`. Besides the dtypes of the dot products, it accepts fp32 inputs with
+// quantized weights (see `matmul_dot_inp_dtype`).
+template <typename Fn>
+static void dispatch_matmul_dtypes(Dtype inp_dtype, Dtype w_dtype, Fn&& fn)
+{
+    if (inp_dtype == kFloat32 && w_dtype == kQint8) {
+        fn(DtypeConst<kFloat32>{}, DtypeConst<kQint8>{});
+    } else if (inp_dtype == kFloat32 && w_dtype == kQint4) {
+        fn(DtypeConst<kFloat32>{}, DtypeConst<kQint4>{});
+    } else {
+        dispatch_dot_dtypes(inp_dtype, w_dtype, fn);
+    }
+}
+
+static void matmul_2d_impl(const Tensor& inp, const Tensor& w, const MatmulDest& dest, const int start_pos)
+{
+    if (w.is_packed()) {
+        matmul_2d_packed_impl(inp, w, dest, start_pos);
+        return;
     }
+
+    // Dispatch on the dtypes once so that the matmul loops are compiled for each dtype pair.
+    const bool multi_row = inp.dimsize(0) - start_pos > 1;
+    dispatch_matmul_dtypes(inp.dtype(), w.dtype(), [&](auto inp_dtype, auto w_dtype) {
+        constexpr Dtype inp_dt = decltype(inp_dtype)::value;
+        constexpr Dtype w_dt = decltype(w_dtype)::value;
+        if (multi_row) {
+            matmul_2d_gemm_impl<inp_dt, w_dt>(inp, w, dest, start_pos);
+        } else {
+            matmul_2d_gemv_impl<inp_dt, w_dt>(inp, w, dest, start_pos);
+        }
+    });
 }
 
 
-void matmul_2d(const Tensor& x, const Tensor& w, Tensor& out, const int start_pos)
+// Checks that `out` can hold the `d_out` output columns of a matmul of `n_ctx` input rows.
+static void check_matmul_out(const Tensor& out, const int n_ctx, const int d_out, const int start_pos)
+{
+    if (out.is_1d()) {
+        GTEN_ASSERT(n_ctx - start_pos == 1);
+        GTEN_ASSERT(out.shape_eq({d_out}));
+    } else if (out.is_2d()) {
+        GTEN_ASSERT(out.shape_eq({n_ctx, d_out}));
+    } else {
+        GTEN_ASSERT(false);
+    }
+}
+
+void matmul_2d(const Tensor& x, const Tensor& w, Tensor& out, const int start_pos, const MatmulEpilogue& epilogue)
 {
     const int n_ctx = x.dimsize(0);
     const int n_out = w.dimsize(0);
@@ -623,78 +875,135 @@ void matmul_2d(const Tensor& x, const Tensor& w, Tensor& out, const int start_po
     GTEN_ASSERT(x.is_2d());
     GTEN_ASSERT(w.is_2d() && w.dimsize(1) == n_embd);
     // GTEN_ASSERT(x.dtype() == w.dtype());
-    if (out.is_1d()) {
-        GTEN_ASSERT(n_ctx - start_pos == 1);
-        GTEN_ASSERT(out.shape_eq({n_out}));
-    } else if (out.is_2d()) {
-        GTEN_ASSERT(out.shape_eq({n_ctx, n_out}));
-    } else {
-        GTEN_ASSERT(false);
+    check_matmul_out(out, n_ctx, n_out, start_pos);
+    if (epilogue.bias) {
+        GTEN_ASSERT(epilogue.bias->dtype() == kFloat16 && epilogue.bias->is_1d() && epilogue.bias->numel() == n_out);
+    }
+    if (epilogue.residual) {
+        GTEN_ASSERT(out.is_2d() && epilogue.residual->is_2d() && epilogue.residual->shape_eq(out.shape()));
+    }
+    if (epilogue.norm_out) {
+        GTEN_ASSERT(out.is_2d() && epilogue.norm_out->shape_eq(out.shape()));
+        GTEN_ASSERT(epilogue.norm_weight && epilogue.norm_weight->dtype() == kFloat16 && epilogue.norm_weight->numel() == n_out);
+        if (epilogue.norm_bias) {
+            GTEN_ASSERT(epilogue.norm_bias->dtype() == kFloat16 && epilogue.norm_bias->numel() == n_out);
+        }
     }
 
-    matmul_2d_impl(x, w, out, start_pos);
+    const std::vector<Tensor*> outs = {&out};
+    matmul_2d_impl(x, w, MatmulDest{outs, epilogue, /*gated=*/false}, start_pos);
 }
 
-
-void bias_add_inplace(Tensor& inp, const Tensor& bias, const int start_pos)
+void matmul_2d_qkv(const Tensor& x, const Tensor& w, const Tensor* bias, Tensor& q, KVCache& cache, const RopeTable& rope, const int start_pos)
 {
-    GTEN_ASSERT(inp.dimsize(1) == bias.numel());
-    GTEN_ASSERT(bias.is_1d() && bias.dtype() == kFloat16);
-    GTEN_ASSERT(inp.is_2d());
+    const int n_ctx = x.dimsize(0);
+    const int n_out = w.dimsize(0);
+    const int n_embd = x.dimsize(1);
+    const int d_head = cache.d_head();
+    const int q_dim = q.dimsize(q.ndims() - 1);
+    const int kv_dim = cache.n_heads() * d_head;
 
-    char* inp_data = inp.data_ptr<char>();
-    const char* bias_data = bias.data_ptr<char>();
+    GTEN_ASSERT(x.is_2d());
+    GTEN_ASSERT(w.is_2d() && w.dimsize(1) == n_embd);
+    check_matmul_out(q, n_ctx, q_dim, start_pos);
+    GTEN_ASSERTM(q_dim + 2 * kv_dim == n_out, "The qkv width: %d does not match the weight rows: %d.", q_dim + 2 * kv_dim, n_out);
+    if (bias) {
+        GTEN_ASSERT(bias->dtype() == kFloat16 && bias->is_1d() && bias->numel() == n_out);
+    }
+    GTEN_ASSERT(rope.d_head() == d_head && q_dim % d_head == 0 && rope.n_positions() >= n_ctx);
+    // The heads must be made of whole blocks for the quantized dtypes.
+    GTEN_ASSERT(d_head % globs::q8_block_size == 0 || !(cache.dtype() == kQint8 || cache.dtype() == kQint4));
 
-    const int n_ctx = inp.dimsize(0);
-    const int n_embd = inp.dimsize(1);
-    const int inp_st0 = inp.bstride(0);
+    // The pages are allocated before the rows are written to them in parallel.
+    cache.reserve(n_ctx);
 
-    float* inp_buf = g_ops_state.buf(n_embd * 3);
-    float* bias_buf = inp_buf + n_embd;
-    float* out_buf = bias_buf + n_embd;
+    const std::vector<Tensor*> outs = {&q};
+    MatmulEpilogue epilogue;
+    epilogue.bias = bias;
+    matmul_2d_impl(x, w, MatmulDest{outs, epilogue, /*gated=*/false, &rope, &cache}, start_pos);
+}
 
-    read_row_to_float(bias_data, bias.dtype(), bias_buf, n_embd);
 
-    for (int i = start_pos; i < n_ctx; ++i)
-    {
-        read_row_to_float(inp_data + i * inp_st0, inp.dtype(), inp_buf, n_embd);
+void matmul_2d_gated(const Tensor& x, const Tensor& w, Tensor& out, const int start_pos)
+{
+    const int n_ctx = x.dimsize(0);
+    const int n_out = w.dimsize(0);
+    const int n_embd = x.dimsize(1);
+
+    GTEN_ASSERT(x.is_2d() && out.is_2d());
+    GTEN_ASSERT(w.is_2d() && w.dimsize(1) == n_embd);
+    GTEN_ASSERT(n_out % (2 * globs::q_pack_rows) == 0);
+    check_matmul_out(out, n_ctx, n_out / 2, start_pos);
 
-        vec_add_f32(inp_buf, bias_buf, out_buf, n_embd);
+    const std::vector<Tensor*> outs = {&out};
+    const MatmulEpilogue epilogue;
+    matmul_2d_impl(x, w, MatmulDest{outs, epilogue, /*gated=*/true}, start_pos);
+}
 
-        write_row_from_float(out_buf, inp_data + i * inp_st0, inp.dtype(), n_embd);   
+Tensor interleave_gate_up(const Tensor& gate_weight, const Tensor& up_weight)
+{
+    GTEN_ASSERT(gate_weight.is_2d() && !gate_weight.is_packed() && !up_weight.is_packed());
+    GTEN_ASSERT(gate_weight.shape_eq(up_weight.shape()) && gate_weight.dtype() == up_weight.dtype());
+    const int d_out = gate_weight.dimsize(0);
+    const int d_in = gate_weight.dimsize(1);
+    const int n_rows = globs::q_pack_rows;
+    GTEN_ASSERTM(d_out % n_rows == 0, "Gate weight rows: %d must be a multiple of %d.", d_out, n_rows);
+
+    Tensor out{{2 * d_out, d_in}, gate_weight.dtype()};
+    const size_t group_nbytes = size_t(n_rows) * gate_weight.bstride(0);
+    const int n_groups = d_out / n_rows;
+    for (int g = 0; g < n_groups; g++) {
+        char* out_data = out.data_ptr<char>() + 2 * g * group_nbytes;
+        std::memcpy(out_data, gate_weight.data_ptr<char>() + g * group_nbytes, group_nbytes);
+        std::memcpy(out_data + group_nbytes, up_weight.data_ptr<char>() + g * group_nbytes, group_nbytes);
     }
+
+    return out;
 }
 
 
-static void vec_layer_norm_f32(const float* vec, const Float16* weight, const Float16* bias, float* out, int vec_size)
+// Returns true if the weights should be packed, which can be disabled by setting the
+// `GTEN_PACK_WEIGHTS` environment variable to 0.
+static bool weight_packing_enabled()
 {
-    // Calculate the mean.
-    float sum = 0.0f;
-    for (int i = 0; i < vec_size; i++) {
-        sum += vec[i];
-    }
-    const float mean = sum / vec_size;
+    const char* pack_weights = std::getenv("GTEN_PACK_WEIGHTS");
+    const bool disabled = pack_weights && std::strcmp(pack_weights, "0") == 0;
+    const Kernels& kern = kernels();
+    return !disabled && kern.vec_dot_product_q8_packed && kern.vec_dot_product_q8_q4_packed;
+}
 
-    // Calculate the std-dev.
-    float sum_squares = 0.0f;
-    for (int i = 0; i < vec_size; i++) {
-        const float x = vec[i];
-        sum_squares += (x - mean) * (x - mean);
+Tensor pack_weight(const Tensor& w)
+{
+    GTEN_ASSERT(w.is_2d());
+    const Dtype w_dtype = w.dtype();
+    const int d_out = w.dimsize(0);
+    const int d_in = w.dimsize(1);
+    const int n_rows = globs::q_pack_rows;
+
+    const bool can_pack = (w_dtype == kQint8 || w_dtype == kQint4)
+                          && !w.is_packed()
+                          && d_out % n_rows == 0
+                          && d_in % globs::q8_block_size == 0;
+    if (!can_pack || !weight_packing_enabled()) {
+        return w;
     }
-    const float variance = sum_squares / (float)vec_size;
-    const float stddev = std::sqrt(variance);
 
-    // Normalize.
-    const float eps = 1e-05f;
-    for (int i = 0; i < vec_size; i++) {
-        const float x = vec[i];
-        const float w = fp16_to_fp32(weight[i]);
-        const float b = fp16_to_fp32(bias[i]);
-
-        // Epsilon added to standard deviation prevents div by zero.
-        const float normalized = ((x - mean) / (stddev + eps)) * w + b;
-        out[i] = normalized;
-    }
+    Tensor packed{{d_out, d_in}, w_dtype, TensorLayout::PackedRows};
+    uint8_t* packed_data = packed.data_ptr<uint8_t>();
+    const int n_groups = d_out / n_rows;
+    const int n_blocks = d_in / globs::q8_block_size;
+
+    thread_pool().parallel_for(n_groups, [&](const int g) {
+        if (w_dtype == kQint8) {
+            const Q8Block* rows = w.data_ptr<Q8Block>() + (size_t)g * n_rows * n_blocks;
+            q8_pack_row_group(rows, packed_data + (size_t)g * q8_packed_group_nbytes(n_blocks), d_in);
+        } else {
+            const Q4Block* rows = w.data_ptr<Q4Block>() + (size_t)g * n_rows * n_blocks;
+            q4_pack_row_group(rows, packed_data + (size_t)g * q4_packed_group_nbytes(n_blocks), d_in);
+        }
+    });
+
+    return packed;
 }
 
 
@@ -730,119 +1039,6 @@ void layer_norm(const Tensor& inp, const Tensor& weight, const Tensor& bias, Ten
 }
 
 
-static void silu_impl(const Tensor& inp, Tensor& out, const int start_pos)
-{
-    const char* inp_data = inp.data_ptr<char>();
-    const Dtype inp_dtype = inp.dtype();
-    char* out_data = out.data_ptr<char>();
-    const Dtype out_dtype = out.dtype();
-
-    const int n_ctx = inp.dimsize(0);
-    const int n_embd = inp.dimsize(1);
-    const int inp_st0 = inp.bstride(0);
-    const int out_st0 = out.bstride(0);
-
-    float* out_buf = g_ops_state.buf(n_embd);
-
-    for (int i = start_pos; i < n_ctx; i++) {
-        read_row_to_float(inp_data + i * inp_st0, inp_dtype, out_buf, n_embd);
-
-        for (int j = 0; j < n_embd; j++) {
-            const float x = out_buf[j];
-            out_buf[j] = x / (1.0f + std::exp(-x));
-        }
-
-        write_row_from_float(out_buf, out_data + i * out_st0, out_dtype, n_embd);
-    }
-}
-
-
-void silu(const Tensor& inp, Tensor& out, const int start_pos)
-{
-    GTEN_ASSERT(inp.shape_eq(out.shape()));
-    GTEN_ASSERT(inp.dtype() == out.dtype());
-
-    silu_impl(inp, out, start_pos);
-}
-
-
-void silu_inplace(Tensor& inp, const int start_pos)
-{
-    silu_impl(inp, inp, start_pos);
-}
-
-
-static void rotary_emb_impl(Tensor& inp, const int d_head, const float rope_pct, const int start_pos)
-{
-    char* inp_data = inp.data_ptr<char>();
-    const Dtype inp_dtype = inp.dtype();
-
-    const int n_ctx = inp.dimsize(0);
-    const int n_embd = inp.dimsize(1);
-    const int n_head = n_embd / d_head;
-    const int inp_st0 = inp.bstride(0);
-
-    Tensor inpx = inp.view({n_ctx, n_head, d_head});
-
-    float* inp_buf = g_ops_state.buf(n_embd);
-
-    const int rope_d_head = static_cast<int>((float)d_head * rope_pct);
-
-    const float d = static_cast<float>(rope_d_head);
-    for (int i = start_pos; i < n_ctx; ++i) {
-        char* inp_row_data = inp_data + i * inp_st0;
-        read_row_to_float(inp_row_data, inp_dtype, inp_buf, n_embd);
-
-       for (int h = 0; h < n_head; ++h) {
-            float* inp_vec = inp_buf + h*d_head;
-            const float m = static_cast<float>(i);
-
-            const int d_half = rope_d_head / 2;
-            for (int j = 0; j < d_half; ++j)
-            {
-                const float x0 = inp_vec[j];
-                const float x1 = inp_vec[j + d_half];
-
-                const float m_theta_i = m * std::pow(10000.0f, -(2.0f*j/d));
-
-                const float o0 = x0 * std::cos(m_theta_i) - x1 * std::sin(m_theta_i);
-                const float o1 = x0 * std::sin(m_theta_i) + x1 * std::cos(m_theta_i);
-
-                inp_vec[j] = o0;
-                inp_vec[j + d_half] = o1;
-            }
-        }
-
-        write_row_from_float(inp_buf, inp_row_data, inp_dtype, n_embd);
-    }
-}
-
-
-void rotary_emb(Tensor& inp, const int d_head, const float rope_pct, const int start_pos)
-{
-    rotary_emb_impl(inp, d_head, rope_pct, start_pos);
-}
-
-
-static void rms_norm_vec_f32(const float* inp, const Float16* weight, float* out, const int vec_size) {
-    float sq_sum = 0.0f;
-
-    for (int i = 0; i < vec_size; ++i) {
-        sq_sum += std::pow(inp[i], 2.0f);
-    }
-
-    const float sq_mean = sq_sum / static_cast<float>(vec_size);
-    const float root_mean_sq = std::sqrt(sq_mean);
-
-    for (int i = 0; i < vec_size; ++i)
-    {
-        const float xi = inp[i];
-        const float wi = fp16_to_fp32(weight[i]);
-        out[i] = xi / (root_mean_sq + 1e-6f) * wi;
-    }
-}
-
-
 static void rms_norm_impl(const Tensor& inp, const Tensor& weight, Tensor& out, const int start_pos)
 {
     const char* inp_data = inp.data_ptr<char>();
@@ -881,311 +1077,286 @@ void rms_norm(const Tensor& inp, const Tensor& weight, Tensor& out, const int st
 }
 
 
-static void vec_mul_f32(const float* a, const float* b, float* out, int vec_size) {
-    for (int i = 0; i < vec_size; i++) {
-        out[i] = a[i] * b[i];
-    }
-}
+// Number of query rows that make up an attention task in prefill. In decode, there is a
+// single row so the tasks are the heads.
+static const int kAttnRowBlock = 16;
+// Number of keys whose scores are computed at once and then folded into the softmax of
+// each query row of a task. The keys and values of a tile stay in cache for all the rows.
+static const int kAttnKeyTile = 64;
+static_assert(KVCache::kPagePositions % kAttnKeyTile == 0, "The attention key tiles must not straddle kv cache pages.");
 
-
-static void mul_impl(const Tensor& inp0, const Tensor& inp1, Tensor& out, const int start_pos)
+// Calls `fn` with the dtypes of the queries and the kv cache of an attention as compile-time
+// constants, like `dispatch_dot_dtypes`.
+template <typename Fn>
+static void dispatch_attn_dtypes(Dtype q_dtype, Dtype kv_dtype, Fn&& fn)
 {
-    const char* inp0_data = inp0.data_ptr<char>();
-    const Dtype inp0_dtype = inp0.dtype();
-    const char* inp1_data = inp1.data_ptr<char>();
-    const Dtype inp1_dtype = inp1.dtype();
-    char* out_data = out.data_ptr<char>();
-    const Dtype out_dtype = out.dtype();
-
-    const int n_ctx = inp0.dimsize(0);
-    const int n_embd = inp0.dimsize(1);
-    const int inp0_st0 = inp0.bstride(0);
-    const int inp1_st0 = inp1.bstride(0);
-    const int out_st0 = out.bstride(0);
-
-    float* x0_buf = g_ops_state.buf(n_embd * 3);
-    float* x1_buf = x0_buf + n_embd;
-    float* out_buf = x1_buf + n_embd;
-
-    for (int i = start_pos; i < n_ctx; i++)
-    {
-        read_row_to_float(inp0_data + i * inp0_st0, inp0_dtype, x0_buf, n_embd);
-        read_row_to_float(inp1_data + i * inp1_st0, inp1_dtype, x1_buf, n_embd);
-
-        vec_mul_f32(x0_buf, x1_buf, out_buf, n_embd);
-
-        write_row_from_float(out_buf, out_data + i * out_st0, out_dtype, n_embd);
+    auto dispatch_kv = [&](auto q_dtype_const) {
+        if (kv_dtype == kFloat16) {
+            fn(q_dtype_const, DtypeConst<kFloat16>{});
+        } else if (kv_dtype == kQint8) {
+            fn(q_dtype_const, DtypeConst<kQint8>{});
+        } else if (kv_dtype == kQint4) {
+            fn(q_dtype_const, DtypeConst<kQint4>{});
+        } else {
+            GTEN_ASSERTM(false, "Unsupported kv cache dtype.");
+        }
+    };
+    if (q_dtype == kFloat16) {
+        dispatch_kv(DtypeConst<kFloat16>{});
+    } else if (q_dtype == kQint8) {
+        dispatch_kv(DtypeConst<kQint8>{});
+    } else if (q_dtype == kFloat32) {
+        dispatch_kv(DtypeConst<kFloat32>{});
+    } else if (q_dtype == kBFloat16) {
+        dispatch_kv(DtypeConst<kBFloat16>{});
+    } else {
+        GTEN_ASSERTM(false, "Unsupported attention dtype.");
     }
 }
 
-
-void multiply(const Tensor& inp0, const Tensor& inp1, Tensor& out, const int start_pos)
-{
-    GTEN_ASSERT(inp0.dtype() == inp1.dtype() && inp1.dtype() == out.dtype());
-    GTEN_ASSERT(inp0.shape_eq(inp1.shape()) && inp1.shape_eq(out.shape()));
-
-    mul_impl(inp0, inp1, out, start_pos);
-}
-
-void multiply_inplace(Tensor& inp0, const Tensor& inp1, const int start_pos)
-{
-    GTEN_ASSERT(inp0.dtype() == inp1.dtype());
-    GTEN_ASSERT(inp0.shape_eq(inp1.shape()));
-
-    mul_impl(inp0, inp1, inp0, start_pos);
-}
-
-
-static void add_impl(const Tensor& inp0, const Tensor& inp1, Tensor& out, const int start_pos)
+// Adds `w` * `row` to `acc`, where `row` holds `n` elements of the given kv cache dtype.
+template <Dtype dtype>
+static inline void vec_axpy_row(const Kernels& kern, const float w, const char* row, float* acc, const int n)
 {
-    const char* inp0_data = inp0.data_ptr<char>();
-    const Dtype inp0_dtype = inp0.dtype();
-    const char* inp1_data = inp1.data_ptr<char>();
-    const Dtype inp1_dtype = inp1.dtype();
-    char* out_data = out.data_ptr<char>();
-    const Dtype out_dtype = out.dtype();
-
-    // tensor.row_to_float
-    const int n_ctx = inp0.dimsize(0);
-    const int n_embd = inp0.dimsize(1);
-    const int inp0_st0 = inp0.bstride(0);
-    const int inp1_st0 = inp1.bstride(0);
-    const int out_st0 = out.bstride(0);
-
-    float* x0_buf = g_ops_state.buf(n_embd * 3);
-    float* x1_buf = x0_buf + n_embd;
-    float* out_buf = x1_buf + n_embd;
-
-    for (int i = start_pos; i < n_ctx; i++) {
-        read_row_to_float(inp0_data + i * inp0_st0, inp0_dtype, x0_buf, n_embd);
-        read_row_to_float(inp1_data + i * inp1_st0, inp1_dtype, x1_buf, n_embd);
-
-        vec_add_f32(x0_buf, x1_buf, out_buf, n_embd);
-
-        write_row_from_float(out_buf, out_data + i * out_st0, out_dtype, n_embd);
+    if constexpr (dtype == kQint8) {
+        kern.vec_axpy_q8(w, reinterpret_cast<const Q8Block*>(row), acc, n);
+    } else if constexpr (dtype == kQint4) {
+        kern.vec_axpy_q4(w, reinterpret_cast<const Q4Block*>(row), acc, n);
+    } else {
+        static_assert(dtype == kFloat16, "Unsupported kv cache dtype.");
+        kern.vec_axpy_f16(w, reinterpret_cast<const Float16*>(row), acc, n);
     }
 }
 
-
-void add(const Tensor& x0, const Tensor& x1, Tensor& out, const int start_pos)
+// Computes the causal attention of the query rows [start_pos, n_ctx) without materializing
+// the attention scores. The keys are visited one tile at a time and the scores of a tile
+// are folded into a running max, sum of exponentials and exponential-weighted sum of the
+// values of each query row (online softmax), which are rescaled when the max grows. This
+// needs O(n_ctx) memory per thread instead of O(n_heads * n_ctx^2). The keys and values
+// of a tile are read from the contiguous rows of their head in the page of the kv cache
+// that holds the tile.
+//
+// The query heads that share a kv head (GQA) are computed together: each key and value
+// row is loaded once and used for the rows of all the heads of the group, i.e a small
+// GEMM instead of one GEMV per query head.
+//
+// The cache may have a different dtype than the queries, `kv_dtype`. The keys and values
+// are then read in their dtype and the queries of each task are converted once to the
+// dtype that the dot product kernels pair with the keys.
+template <Dtype dtype, Dtype kv_dtype>
+static void qkv_attn_impl(const Tensor& q, const KVCache& cache, Tensor& qkv, const int n_heads, const int start_pos)
 {
-    GTEN_ASSERT(x0.is_2d());
-    GTEN_ASSERT(x1.is_2d());
-    GTEN_ASSERT(out.is_2d());
-    GTEN_ASSERT(x0.shape_eq(x1.shape()));
-    GTEN_ASSERT(x0.shape_eq(out.shape()));
-    GTEN_ASSERT(x0.dtype() == x1.dtype() && x0.dtype() == out.dtype());
-
-    add_impl(x0, x1, out, start_pos);
-}
-
+    constexpr bool kv_quantized = kv_dtype == kQint8 || kv_dtype == kQint4;
+    constexpr Dtype dot_dtype = kv_quantized ? kQint8 : (dtype == kFloat16 ? kFloat16 : kFloat32);
+    constexpr bool convert_q = dot_dtype != dtype;
 
-static void qk_masked_softmax(const Tensor& q, const Tensor& k, Tensor& qk_out, float scale_factor, const int start_pos)
-{
     const char* q_data = q.data_ptr<char>();
-    const char* k_data = k.data_ptr<char>();
-    char* out_data = qk_out.data_ptr<char>();
-
-    const int q_heads = q.dimsize(0);
-    const int n_ctx = q.dimsize(1);
-    const int d_head = q.dimsize(2);
-    const int k_heads = k.dimsize(0);
-    const int q_heads_per_group = q_heads / k_heads;
-
-    const int qst0 = q.bstride(0);
-    const int qst1 = q.bstride(1);
-    const int kst0 = k.bstride(0);
-    const int kst1 = k.bstride(1);
-    const int qkst0 = qk_out.stride(0);
-    const int qkst1 = qk_out.stride(1);
-
-    const Dtype inp_dtype = q.dtype();
-    const Dtype out_dtype = qk_out.dtype();
-
-    float* out_buf = g_ops_state.buf(n_ctx);
-
-    for (int qrow = start_pos; qrow < n_ctx; qrow++) {
-       for (int h = 0; h < q_heads; h++) {
-            // `kcol_max` represents number of the dot products that are not subsequently masked.
-            const int kcol_max = qrow + 1;
-            for (int kcol = 0; kcol < kcol_max; kcol++) {
-                const char* qrow_data = q_data + (h * qst0 + qrow * qst1);
-                const char* kcol_data = k_data + ((h / q_heads_per_group) * kst0 + kcol * kst1); // col_data is contigous.
-
-                const float dot_prod = vec_dot_product(qrow_data, inp_dtype, kcol_data, inp_dtype, d_head);
-                out_buf[kcol] = dot_prod * scale_factor;
-            }
+    char* qkv_data = qkv.data_ptr<char>();
 
-            /// Masking operation.
-            const int kcol_start = qrow + 1;
-            for (int kcol = kcol_start; kcol < n_ctx; kcol++) {
-                out_buf[kcol] = -std::numeric_limits<float>::infinity();  // zero TODO
-            }
+    const int n_ctx = q.dimsize(0);
+    const int d_head = q.dimsize(1) / n_heads;
+    const int kv_heads = cache.n_heads();
+    const int q_heads_per_group = n_heads / kv_heads;
+
+    const int q_st0 = q.bstride(0);
+    // The strides of the heads and positions in the pages of the cache.
+    const int kv_st0 = cache.k_page(0).bstride(0);
+    const int kv_st1 = cache.k_page(0).bstride(1);
+    const int qkv_st0 = qkv.bstride(0);
+    // Offset of a head in a row.
+    const int head_nbytes = row_offset_nbytes<dtype>(d_head);
+    // Size of a converted query row and the number of floats of scratch space it takes.
+    const int dot_q_nbytes = row_offset_nbytes<dot_dtype>(d_head);
+    const int dot_q_bufsize = convert_q ? (dot_q_nbytes + sizeof(float) - 1) / sizeof(float) : 0;
 
-            // SOFTMAX
-            // Max
-            float max = -std::numeric_limits<float>::infinity();
-            for (int i = 0; i < n_ctx; i++) {
-                const float x = out_buf[i];
-                if (x > max)
-                    max = x;
+    const float scale_factor = 1.0f / std::sqrt((float)d_head);
+    const Kernels& kern = kernels();
+
+    // The tasks are (kv head, query heads of the group, row block) tiles. When there are
+    // too few kv heads and row blocks to keep the threads busy (e.g decode with 4 kv heads),
+    // the query heads of each group are split into several tasks.
+    const int n_row_blocks = (n_ctx - start_pos + kAttnRowBlock - 1) / kAttnRowBlock;
+    const int min_tasks = kMatmulTasksPerThread * thread_pool().n_threads();
+    int n_head_splits = 1;
+    while (kv_heads * n_head_splits * n_row_blocks < min_tasks && q_heads_per_group % (2 * n_head_splits) == 0) {
+        n_head_splits *= 2;
+    }
+    const int task_heads = q_heads_per_group / n_head_splits;
+    const int n_head_tasks = kv_heads * n_head_splits;
+
+    // The later rows attend to more keys so the row blocks are claimed last to first so
+    // that the largest tasks are not left for the end.
+    thread_pool().parallel_for(n_head_tasks * n_row_blocks, [&](const int task) {
+        const int head_task = task % n_head_tasks;
+        const int kv_h = head_task / n_head_splits;
+        const int h_start = kv_h * q_heads_per_group + (head_task % n_head_splits) * task_heads;
+        const int row_block = n_row_blocks - 1 - task / n_head_tasks;
+        const int row_start = start_pos + row_block * kAttnRowBlock;
+        const int row_end = std::min(row_start + kAttnRowBlock, n_ctx);
+        const int n_rows = row_end - row_start;
+        // The query rows of the task are indexed by `hi * n_rows + r` for the head
+        // `h_start + hi` and the row `row_start + r`.
+        const int n_queries = task_heads * n_rows;
+
+        // The scores (then weights) of a key tile for each query and the running softmax
+        // state of each query.
+        float* scores = thread_scratch_buf(n_queries * (kAttnKeyTile + d_head + 2 + dot_q_bufsize) + (convert_q ? d_head : 0));
+        float* acc = scores + n_queries * kAttnKeyTile;
+        float* row_max = acc + n_queries * d_head;
+        float* row_sum = row_max + n_queries;
+        std::fill(acc, acc + n_queries * d_head, 0.0f);
+        std::fill(row_max, row_max + n_queries, -std::numeric_limits<float>::infinity());
+        std::fill(row_sum, row_sum + n_queries, 0.0f);
+
+        // The converted queries, if any.
+        char* dot_q_data = reinterpret_cast<char*>(row_sum + n_queries);
+        const int dot_q_st = dot_q_bufsize * sizeof(float);
+        if constexpr (convert_q) {
+            float* q_buf = row_sum + n_queries + n_queries * dot_q_bufsize;
+            for (int hi = 0; hi < task_heads; hi++) {
+                for (int r = 0; r < n_rows; r++) {
+                    read_row_to_float(q_data + (row_start + r) * q_st0 + (h_start + hi) * head_nbytes, dtype, q_buf, d_head);
+                    write_row_from_float(q_buf, dot_q_data + (hi * n_rows + r) * dot_q_st, dot_dtype, d_head);
+                }
             }
-
-            // out[i] = exp(xi - xi_max)
-            float sum_exp = 0;
-            for (int i = 0; i < n_ctx; i++) {
-                const float x = out_buf[i];
-                const float exp_val = std::exp(x - max);
-                out_buf[i] = exp_val;
-                sum_exp += exp_val;
+        }
+        // Returns the query row of head `h_start + hi` and row `row_start + r`, in `dot_dtype`.
+        auto query_row = [&](const int hi, const int r) -> const char* {
+            if constexpr (convert_q) {
+                return dot_q_data + (hi * n_rows + r) * dot_q_st;
+            } else {
+                return q_data + (row_start + r) * q_st0 + (h_start + hi) * head_nbytes;
             }
-
-            // out[i] = out[i] / sum[exp(xi - xi_max)]
-            for (int i = 0; i < n_ctx; i++) {
-                const float qkw = out_buf[i];
-                out_buf[i] = qkw / sum_exp;
+        };
+
+        for (int key_start = 0; key_start < row_end; key_start += kAttnKeyTile) {
+            const int key_tile_end = std::min(key_start + kAttnKeyTile, row_end);
+            // The rows of the head in the page of the tile, starting at position `page_start`.
+            const int page = key_start / KVCache::kPagePositions;
+            const int page_start = page * KVCache::kPagePositions;
+            const char* k_head_data = cache.k_page(page).data_ptr<char>() + kv_h * kv_st0;
+            const char* v_head_data = cache.v_page(page).data_ptr<char>() + kv_h * kv_st0;
+
+            // Scores. The rows before the key are masked.
+            for (int key = key_start; key < key_tile_end; key++) {
+                const char* k_row = k_head_data + (key - page_start) * kv_st1;
+                const int r_start = std::max(0, key - row_start);
+                for (int hi = 0; hi < task_heads; hi++) {
+                    for (int r = r_start; r < n_rows; r++) {
+                        const float score = vec_dot_product<dot_dtype, kv_dtype>(kern, query_row(hi, r), k_row, d_head) * scale_factor;
+                        scores[(hi * n_rows + r) * kAttnKeyTile + key - key_start] = score;
+                    }
+                }
             }
 
-            char* out_row_data = out_data + h * qkst0 + qrow * qkst1;
-            write_row_from_float(out_buf, out_row_data, out_dtype, n_ctx);
-        }
-    }
-}
+            // Softmax state update and conversion of the scores to weights.
+            for (int i = 0; i < n_queries; i++) {
+                const int qrow = row_start + i % n_rows;
+                const int key_end = std::min(key_tile_end, qrow + 1);
+                if (key_start >= key_end) {
+                    continue;
+                }
 
+                float* query_scores = scores + i * kAttnKeyTile;
+                const float tile_max = kern.vec_max_f32(query_scores, key_end - key_start);
 
-// Transpose and dequantize v.
-static void transpose_v(const Tensor& inp, float* out_buf)
-{
-    // v.view({n_ctx, kv_n_head, d_head}).permute({1, 2, 0});
-    const char* inp_data = inp.data_ptr<char>();
-    const int n_head = inp.dimsize(0);
-    const int d_head = inp.dimsize(1);
-    const int n_ctx = inp.dimsize(2);
-    const int n_embd = n_head*d_head;
+                if (tile_max > row_max[i]) {
+                    // Rescale the sums computed relative to the previous max.
+                    const float correction = std::exp(row_max[i] - tile_max);
+                    row_sum[i] *= correction;
+                    kern.vec_scale_f32(acc + i * d_head, correction, d_head);
+                    row_max[i] = tile_max;
+                }
 
-    // Dequantize v and transpose it.
-    const int n_blocks = (n_head*d_head) / globs::q8_block_size;
+                row_sum[i] += kern.vec_exp_sum_f32(query_scores, row_max[i], key_end - key_start);
+            }
 
-    switch (inp.dtype())
-    {
-        case kQint8:
-        {
-            for (int i = 0; i < n_ctx; i++) {
-            for (int j = 0; j < n_blocks; j++) {
-                const Q8Block* blk = (Q8Block*)inp_data + i * n_blocks + j;
-                const float block_delta = fp16_to_fp32(blk->delta);
-                
-                for (int k = 0; k < globs::q8_block_size; k++) {
-                    const int col_idx = j * globs::q8_block_size + k;
-                    out_buf[i + col_idx * n_ctx] = q8_dequantize_single(blk->data[k], block_delta);
+            // Values.
+            for (int key = key_start; key < key_tile_end; key++) {
+                const char* v_row = v_head_data + (key - page_start) * kv_st1;
+                const int r_start = std::max(0, key - row_start);
+                for (int hi = 0; hi < task_heads; hi++) {
+                    for (int r = r_start; r < n_rows; r++) {
+                        const int i = hi * n_rows + r;
+                        vec_axpy_row<kv_dtype>(kern, scores[i * kAttnKeyTile + key - key_start], v_row, acc + i * d_head, d_head);
+                    }
                 }
-            }   
+            }
         }
-        } break;
 
-        case kFloat16:
-        {
-            for (int i = 0; i < n_ctx; i++) {
-            for (int j = 0; j < n_embd; j++) {
-                out_buf[i + j * n_ctx] = fp16_to_fp32(((Float16*)inp_data)[i * n_embd + j]);
-            }
+        for (int i = 0; i < n_queries; i++) {
+            const int qrow = row_start + i % n_rows;
+            const int h = h_start + i / n_rows;
+            float* query_acc = acc + i * d_head;
+            kern.vec_scale_f32(query_acc, 1.0f / row_sum[i], d_head);
+            write_row_from_float(query_acc, qkv_data + qrow * qkv_st0 + h * head_nbytes, qkv.dtype(), d_head);
         }
-        } break;
-        default: {
-            GTEN_ASSERT(false);
-        } break;
-    }
+    });
 }
 
 
-static void qkv_matmul(const Tensor& qk, const Tensor& v, Tensor& qkv_out, const int start_pos)
+void kv_cache_shift(KVCache& cache, const int n_keep, const int n_discard, const int n_past, const RopeTable& rope)
 {
-    const char* qk_data = qk.data_ptr<char>();
-    char* out_data = qkv_out.data_ptr<char>();
-
-    const int n_ctx = qk.dimsize(1);
-    const int q_heads = qk.dimsize(0);
-    const int v_heads = v.dimsize(0);
-    const int dhead = v.dimsize(1);
-    const int q_heads_per_group = q_heads / v_heads;
-
-    const int qkst0 = qk.stride(0);
-    const int qkst1 = qk.stride(1);
-    const int qkv_st0 = qkv_out.bstride(0);
-
-    const int v_n_embd = v_heads*dhead;
-    float* qk_row_buf = g_ops_state.buf(n_ctx + n_ctx*v_n_embd + q_heads*dhead);
-    float* v_buf = qk_row_buf + n_ctx;
-    float* out_buf = v_buf + n_ctx*v_n_embd;
-
-    // transpose and dequantize v.
-    /// TODO: Improve this.
-    transpose_v(v, v_buf);
-
-    const Dtype inp_dtype = qk.dtype();
-    const Dtype out_dtype = qkv_out.dtype();
-
-    for (int qkr = start_pos; qkr < n_ctx; qkr++) {
-        for (int h = 0; h < q_heads; h++) {
-            const char* qkr_data = qk_data + (h * qkst0 + qkr * qkst1);  // qk_row_data
-            read_row_to_float(qkr_data, inp_dtype, qk_row_buf, n_ctx);
-
-            for (int vc = 0; vc < dhead; vc++) {
-                const float* v_col_buf = v_buf + ((h / q_heads_per_group) * dhead*n_ctx + vc * n_ctx);
-
-                const float dot_prod = vec_dot_product_f32(qk_row_buf, v_col_buf, n_ctx);
-                out_buf[h*dhead + vc] = dot_prod;
+    GTEN_ASSERT(n_keep >= 0 && n_discard > 0 && n_keep + n_discard <= n_past && n_past <= cache.capacity());
+    GTEN_ASSERT(rope.d_head() == cache.d_head() && rope.n_positions() > n_discard);
+
+    const int n_heads = cache.n_heads();
+    const int d_head = cache.d_head();
+    const Dtype dtype = cache.dtype();
+    const int d_half = rope.rope_d_head() / 2;
+    // Rotating by -n_discard uses the cosines of n_discard and the negated sines.
+    const float* cos = rope.cos(n_discard);
+    std::vector<float> neg_sin(d_half);
+    for (int j = 0; j < d_half; j++) {
+        neg_sin[j] = -rope.sin(n_discard)[j];
+    }
+    const int page_st0 = cache.k_page(0).bstride(0);
+    const int head_nbytes = cache.k_page(0).bstride(1);
+
+    // Returns the row of the given head and position in the keys (or values) pages.
+    auto cache_row = [&](const bool keys, const int h, const int pos) -> char* {
+        Tensor& page = keys ? cache.k_page(pos / KVCache::kPagePositions) : cache.v_page(pos / KVCache::kPagePositions);
+        return page.data_ptr<char>() + h * page_st0 + (pos % KVCache::kPagePositions) * head_nbytes;
+    };
+
+    // The tasks are the keys and the values of each head. The positions of a head are moved
+    // in increasing order so that each position is read before it is overwritten.
+    thread_pool().parallel_for(2 * n_heads, [&](const int task) {
+        const bool keys = task < n_heads;
+        const int h = task % n_heads;
+        float* row_buf = thread_scratch_buf(d_head);
+        for (int pos = n_keep + n_discard; pos < n_past; pos++) {
+            const char* src = cache_row(keys, h, pos);
+            char* dest = cache_row(keys, h, pos - n_discard);
+            if (keys) {
+                // The keys were rotated for their old position, rotating them back by the
+                // number of discarded positions rotates them for their new position.
+                read_row_to_float(src, dtype, row_buf, d_head);
+                kernels().vec_rope_f32(row_buf, cos, neg_sin.data(), d_half);
+                write_row_from_float(row_buf, dest, dtype, d_head);
+            } else {
+                std::memcpy(dest, src, head_nbytes);
             }
         }
-
-        write_row_from_float(out_buf, out_data + qkr * qkv_st0, out_dtype, q_heads*dhead);      
-    }
-
-}
-
-
-static void qkv_attn_impl(const Tensor& q, const Tensor& k, const Tensor& v, Tensor& qk, Tensor& qkv, int max_ctx, const int start_pos)
-{
-    const int n_ctx = q.dimsize(0);
-    const int n_embd = q.dimsize(1);
-    const int q_n_head = qk.dimsize(0);
-    const int d_head = n_embd / q_n_head;
-    const int kv_n_head = k.dimsize(1) / d_head;
-
-    const Tensor q0 = q.view({n_ctx, q_n_head, d_head}).permute({1, 0, 2});
-    
-    const Tensor k0 = k.view({n_ctx, kv_n_head, d_head}).permute({1, 0, 2});
-    qk.set_strides({max_ctx * max_ctx, max_ctx, 1});
-
-    const float scale_factor = 1.0f / std::sqrt((float)d_head);
-    ops::qk_masked_softmax(q0, k0, qk, scale_factor, start_pos);
-
-    Tensor v0 = v.view({n_ctx, kv_n_head, d_head}).permute({1, 2, 0});
-
-    Tensor qkv0 = qkv.view({n_ctx, q_n_head, d_head});
-    
-    ops::qkv_matmul(qk, v0, qkv0, start_pos);
+    });
 }
 
 
-void qkv_attn(const Tensor& q, const Tensor& k, const Tensor& v, Tensor& qk, Tensor& qkv, const int max_ctx, const int start_pos)
+void qkv_attn(const Tensor& q, const KVCache& cache, Tensor& qkv, const int n_heads, const int start_pos)
 {
     const int n_ctx = q.dimsize(0);
     const int n_embd = q.dimsize(1);
-    const int n_head = qk.dimsize(0);
 
     GTEN_ASSERT(q.is_2d());
-    GTEN_ASSERT(k.is_2d());
-    GTEN_ASSERT(v.is_2d());
-    GTEN_ASSERT(qk.is_3d() && qk.shape_eq({n_head, n_ctx, n_ctx}));
+    GTEN_ASSERT(cache.capacity() >= n_ctx && cache.d_head() * n_heads == n_embd);
     GTEN_ASSERT(qkv.is_2d() && qkv.shape_eq({n_ctx, n_embd}));
-    GTEN_ASSERT(q.dtype() == k.dtype() && k.dtype() == v.dtype() && v.dtype() == qk.dtype() && qk.dtype() == qkv.dtype())
-    GTEN_ASSERT(max_ctx > 0 && max_ctx >= n_ctx);
+    GTEN_ASSERT(q.dtype() == qkv.dtype());
+    GTEN_ASSERT(n_heads > 0 && n_heads % cache.n_heads() == 0);
 
-    qkv_attn_impl(q, k, v, qk, qkv, max_ctx, start_pos);
+    dispatch_attn_dtypes(q.dtype(), cache.dtype(), [&](auto dtype, auto kv_dtype) {
+        qkv_attn_impl<decltype(dtype)::value, decltype(kv_dtype)::value>(q, cache, qkv, n_heads, start_pos);
+    });
 }
 
 } // namespace ops
 } // namespace gten
-
-
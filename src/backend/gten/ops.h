@@ -1,36 +1,72 @@
 #pragma once
 
 
+#include "kv_cache.h"
+#include "rope_table.h"
 #include "tensor.h"
 
 
 namespace gten {
 namespace ops {
 
-void add(const Tensor& inp0, const Tensor& inp1, Tensor& out, const int start_pos=0);
-
-void bias_add_inplace(Tensor& inp, const Tensor& bias, const int start_pos=0);
+/// @brief Returns the weight of the gated MLP matmul: the rows of the gate and up weights
+///  interleaved in groups of `globs::q_pack_rows` rows, i.e gate rows [0, 8), up rows [0, 8),
+///  gate rows [8, 16), ... so that the row groups of a packed weight are each of one kind.
+Tensor interleave_gate_up(const Tensor& gate_weight, const Tensor& up_weight);
 
 void layer_norm(const Tensor& inp, const Tensor& weight, const Tensor& bias, Tensor& out, const int start_pos = 0);
 
-void matmul_2d(const Tensor& inp, const Tensor& weight, Tensor& out, const int start_pos=0);
-
-void multiply(const Tensor& inp0, const Tensor& inp1, Tensor& out, const int start_pos=0);
-
-void multiply_inplace(Tensor& inp0, const Tensor& inp1, const int start_pos=0);
-
-void qkv_attn(const Tensor& q, const Tensor& k, const Tensor& v, Tensor& qk, Tensor& qkv, const int max_ctx, const int start_pos=0);
+/// @brief Operations applied to the output rows of a matmul, in fp32, before they are
+///  written to the output: out = scale * (inp @ weight.T + bias) + residual.
+struct MatmulEpilogue {
+    /// Optional fp16 bias of shape (d_out,).
+    const Tensor* bias = nullptr;
+    float scale = 1.0f;
+    /// Optional 2d tensor with the shape of the output, e.g the residual stream.
+    const Tensor* residual = nullptr;
+    /// Optional norm of the output rows which is written to `norm_out`, a tensor with the
+    ///  shape of the output, e.g the norm that follows the residual add in transformer blocks.
+    ///  It is a layer norm if `norm_bias` is set and an rms norm otherwise.
+    const Tensor* norm_weight = nullptr;
+    const Tensor* norm_bias = nullptr;
+    Tensor* norm_out = nullptr;
+};
+
+void matmul_2d(const Tensor& inp, const Tensor& weight, Tensor& out, const int start_pos=0, const MatmulEpilogue& epilogue=MatmulEpilogue{});
+
+/// @brief Computes silu(inp @ gate.T) * (inp @ up.T), the gated MLP activation, with a single
+///  matmul of the weight returned by `interleave_gate_up`. The product is computed on the
+///  output rows of the matmul before they are written to `out`.
+void matmul_2d_gated(const Tensor& inp, const Tensor& gate_up_weight, Tensor& out, const int start_pos=0);
+
+/// @brief Computes the fused qkv projection of the input with a weight made of the
+///  concatenated rows of the query, key and value weights, in a single pass over the input.
+///  The queries are written to `q` and the keys and values of the positions [start_pos, n_ctx)
+///  are written straight to the `cache`, whose pages are allocated if needed.
+/// @param bias An optional fp16 bias of the concatenated projections (or nullptr).
+/// @param rope The rotary embedding applied to the heads of the queries and keys before they
+///  are written. It must hold the positions of the input rows.
+void matmul_2d_qkv(const Tensor& inp, const Tensor& weight, const Tensor* bias, Tensor& q, KVCache& cache, const RopeTable& rope, const int start_pos=0);
+
+/// @brief Returns a copy of a 2d quantized weight in the packed layout used by the matmul
+///  kernels (see quants.h), or the weight itself if it cannot be packed or the kernels of
+///  the cpu do not support the packed layout.
+Tensor pack_weight(const Tensor& weight);
+
+/// @brief Evicts the positions [n_keep, n_keep + n_discard) of the first `n_past` positions of
+///  the `cache` and moves the following ones back by `n_discard` positions. The moved keys
+///  are re-rotated for their new positions by the rotary embedding `rope`.
+void kv_cache_shift(KVCache& cache, const int n_keep, const int n_discard, const int n_past, const RopeTable& rope);
+
+/// @brief Computes the causal self-attention of `q` (n_ctx, n_heads * d_head) with the first
+///  n_ctx positions of the key and value `cache` into `qkv`, without materializing the
+///  attention scores.
+void qkv_attn(const Tensor& q, const KVCache& cache, Tensor& qkv, const int n_heads, const int start_pos=0);
 
 void rms_norm(const Tensor& inp, const Tensor& weight, Tensor& out, const int start_pos=0);
 
-void rotary_emb(Tensor& inp, const int d_head, const float rope_pct, const int start_pos=0);
-
 void scale(Tensor& inp, float scaler, const int start_pos=0);
 
-void silu(const Tensor& inp, Tensor& out, const int start_pos=0);
-
-void silu_inplace(Tensor& inp, const int start_pos=0);
-
 /// @brief Copies the indexed rows of the source tensor to output tensor.
 /// @param src A 2-d tensor to be indexed.
 /// @param indices A 1-d tensor of indices with dtype = int.
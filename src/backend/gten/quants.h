@@ -11,6 +11,10 @@
 namespace globs {
 static const int q8_block_size = 32;
 static const int q4_block_size = 32;
+// Number of weight rows that are interleaved in a row group of the packed layout.
+static const int q_pack_rows = 8;
+// Alignment in bytes of the row groups of the packed layout.
+static const int q_pack_align = 64;
 }
 
 struct Q8Block
@@ -46,11 +50,64 @@ void q8_quantize_row(const float* inp, Q8Block* out, const int rowsize);
 void q8_dequantize_row(const Q8Block* inp, float* out, int rowsize);
 
 
+void q4_quantize_row(const float* inp, Q4Block* out, int rowsize);
+
+
 void q4_dequantize_row(const Q4Block* inp, float* out, int rowsize);
 
 
 void q8_dequantize_row_delta(const Qint8* x, float* out, float delta, int size);
 
+
+// PACKED LAYOUT.
+// Quantized weights can be repacked after loading into a layout that lets the matmul kernels
+// compute the dot products of an input row with `q_pack_rows` weight rows at once, loading
+// each input block once for all the rows. The weight rows are split into groups of
+// `q_pack_rows` rows and each group is stored as:
+//   [deltas: blk0(row0..row7), blk1(row0..row7), ... | padding to q_pack_align]
+//   [quants: blk0(row0..row7), blk1(row0..row7), ...]
+// i.e the fp16 deltas are in a separate array from the quants and the quants of block `i` of
+// all the rows in the group are contiguous. Each group is `q_pack_align` aligned which aligns
+// the quants of each row block to its size (32 bytes for q8, 16 bytes for q4).
+
+// Returns the size of the deltas array of a row group, including the padding.
+static constexpr int q_packed_deltas_nbytes(int n_blocks) {
+    const int nbytes = n_blocks * globs::q_pack_rows * sizeof(Float16);
+    return (nbytes + globs::q_pack_align - 1) / globs::q_pack_align * globs::q_pack_align;
+}
+
+// Returns the size of a row group of a packed q8 weight with `n_blocks` blocks per row.
+static constexpr int q8_packed_group_nbytes(int n_blocks) {
+    return q_packed_deltas_nbytes(n_blocks) + n_blocks * globs::q_pack_rows * globs::q8_block_size;
+}
+
+// Returns the size of a row group of a packed q4 weight with `n_blocks` blocks per row.
+static constexpr int q4_packed_group_nbytes(int n_blocks) {
+    return q_packed_deltas_nbytes(n_blocks) + n_blocks * globs::q_pack_rows * globs::q4_block_size / 2;
+}
+
+// Returns the deltas of block `blk` of a packed row group.
+static inline const Float16* q_packed_group_deltas(const uint8_t* group, int blk) {
+    return reinterpret_cast<const Float16*>(group) + blk * globs::q_pack_rows;
+}
+
+// Returns the quants of block `blk` of a packed q8 row group with `n_blocks` blocks per row.
+static inline const Qint8* q8_packed_group_quants(const uint8_t* group, int n_blocks, int blk) {
+    const Qint8* quants = reinterpret_cast<const Qint8*>(group + q_packed_deltas_nbytes(n_blocks));
+    return quants + blk * globs::q_pack_rows * globs::q8_block_size;
+}
+
+// Returns the quants of block `blk` of a packed q4 row group with `n_blocks` blocks per row.
+static inline const Qint8* q4_packed_group_quants(const uint8_t* group, int n_blocks, int blk) {
+    const Qint8* quants = reinterpret_cast<const Qint8*>(group + q_packed_deltas_nbytes(n_blocks));
+    return quants + blk * globs::q_pack_rows * globs::q4_block_size / 2;
+}
+
+// Packs `q_pack_rows` consecutive rows of `rowsize` elements into a row group.
+void q8_pack_row_group(const Q8Block* rows, uint8_t* out, int rowsize);
+
+void q4_pack_row_group(const Q4Block* rows, uint8_t* out, int rowsize);
+
 } // namespace ops
 
 } // namespace gten
\ No newline at end of file
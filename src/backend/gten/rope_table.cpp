@@ -0,0 +1,42 @@
+#include <algorithm>
+#include <cmath>
+
+#include "log.h"
+#include "rope_table.h"
+
+
+namespace gten {
+
+RopeTable::RopeTable(int d_head, float rope_pct, int n_positions)
+    : m_d_head{d_head}, m_rope_d_head{static_cast<int>((float)d_head * rope_pct)}
+{
+    GTEN_ASSERT(rope_pct <= 1.0f && rope_pct >= 0.0f);
+    GTEN_ASSERTM(m_rope_d_head % 2 == 0, "The rotated head size: %d must be even.", m_rope_d_head);
+    reserve(n_positions);
+}
+
+void RopeTable::reserve(int n_positions)
+{
+    if (n_positions <= m_n_positions) {
+        return;
+    }
+    // The table grows at least by doubling so that a context that grows one position at a
+    // time is not recomputed at each step.
+    const int old_n_positions = m_n_positions;
+    m_n_positions = std::max(n_positions, 2 * old_n_positions);
+    m_data.resize(m_n_positions * m_rope_d_head);
+
+    const float d = static_cast<float>(m_rope_d_head);
+    const int d_half = m_rope_d_head / 2;
+    for (int pos = old_n_positions; pos < m_n_positions; pos++) {
+        float* cos_data = m_data.data() + pos * m_rope_d_head;
+        float* sin_data = cos_data + d_half;
+        for (int j = 0; j < d_half; j++) {
+            const float m_theta_i = static_cast<float>(pos) * std::pow(10000.0f, -(2.0f*j/d));
+            cos_data[j] = std::cos(m_theta_i);
+            sin_data[j] = std::sin(m_theta_i);
+        }
+    }
+}
+
+} // namespace gten
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+
+#include "gten_types.h"
+
+
+namespace gten {
+
+/// The cosines and sines of the rotary embedding angles pos * 10000^(-2j / rope_d_head) of the
+/// positions [0, n_positions) and the frequencies j in [0, rope_d_head / 2), where
+/// `rope_d_head` is the number of leading elements of each head that are rotated. The table
+/// is computed once for the context the model was created with and extended when the
+/// positions grow past it, so the rotary embedding does not evaluate any pow, cos or sin in
+/// the forward pass. A single table is shared by all the attention layers of a model.
+class RopeTable {
+public:
+    /// `rope_pct` is the percentage (in range [0.0, 1.0]) of `d_head` that is rotated.
+    RopeTable(int d_head, float rope_pct, int n_positions);
+
+    /// Computes the angles of the positions [0, n_positions), if they are not computed yet.
+    /// It must not be called while the table is being read, e.g inside a parallel loop.
+    void reserve(int n_positions);
+
+    int d_head() const { return m_d_head; }
+    int rope_d_head() const { return m_rope_d_head; }
+    int n_positions() const { return m_n_positions; }
+    /// The cosines and sines of the `rope_d_head / 2` angles of position `pos`.
+    const float* cos(int pos) const { return m_data.data() + pos * m_rope_d_head; }
+    const float* sin(int pos) const { return m_data.data() + pos * m_rope_d_head + m_rope_d_head / 2; }
+
+private:
+    int m_d_head;
+    int m_rope_d_head;
+    int m_n_positions = 0;
+    // The cosines followed by the sines of each position.
+    std::vector<float> m_data;
+};
+
+} // namespace gten
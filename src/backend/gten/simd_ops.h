@@ -27,7 +27,7 @@ typedef __m256 Vec_f32x8;
 
 // FLOATING POINT VECTOR OPERATIONS
 
-inline Vec_f32x8 vec_f32x8_load(const Float16* src_ptr) {
+static inline Vec_f32x8 vec_f32x8_load(const Float16* src_ptr) {
 #if defined(__F16C__)
     return _mm256_cvtph_ps(_mm_loadu_si128((__m128i_u *)(const_cast<Float16*>(src_ptr))));
 #else
@@ -39,15 +39,24 @@ inline Vec_f32x8 vec_f32x8_load(const Float16* src_ptr) {
 #endif
 }
 
-inline Vec_f32x8 vec_f32x8_load(const float* src_ptr) {
+static inline Vec_f32x8 vec_f32x8_load(const float* src_ptr) {
     return _mm256_loadu_ps(const_cast<float*>(src_ptr));
 }
 
-inline void vec_f32x8_store(Vec_f32x8 vec, float* dest_ptr) {
+// bf16 values are the upper halves of the fp32 values, so interleaving them with zeros gives
+// the fp32 values. Unlike a zero-extension and shift, this does not need AVX2.
+static inline Vec_f32x8 vec_f32x8_load(const BFloat16* src_ptr) {
+    const __m128i bf16 = _mm_loadu_si128((const __m128i*)src_ptr);
+    const __m128i lo = _mm_unpacklo_epi16(_mm_setzero_si128(), bf16);
+    const __m128i hi = _mm_unpackhi_epi16(_mm_setzero_si128(), bf16);
+    return _mm256_castsi256_ps(_mm256_insertf128_si256(_mm256_castsi128_si256(lo), hi, 1));
+}
+
+static inline void vec_f32x8_store(Vec_f32x8 vec, float* dest_ptr) {
     _mm256_storeu_ps(dest_ptr, vec);
 }
 
-inline void vec_f32x8_store(Vec_f32x8 vec, Float16* dest_ptr) {
+static inline void vec_f32x8_store(Vec_f32x8 vec, Float16* dest_ptr) {
 #if defined(__F16C__)
     _mm_storeu_si128((__m128i_u *)dest_ptr, _mm256_cvtps_ph(vec, 0));
 #else
@@ -59,28 +68,99 @@ inline void vec_f32x8_store(Vec_f32x8 vec, Float16* dest_ptr) {
 #endif
 }
 
-inline Vec_f32x8 vec_f32x8_add(Vec_f32x8 a, Vec_f32x8 b) {
+static inline Vec_f32x8 vec_f32x8_add(Vec_f32x8 a, Vec_f32x8 b) {
     return _mm256_add_ps(a, b);
 }
 
-inline Vec_f32x8 vec_f32x8_mul(Vec_f32x8 a, Vec_f32x8 b) {
+static inline Vec_f32x8 vec_f32x8_sub(Vec_f32x8 a, Vec_f32x8 b) {
+    return _mm256_sub_ps(a, b);
+}
+
+static inline Vec_f32x8 vec_f32x8_mul(Vec_f32x8 a, Vec_f32x8 b) {
     return _mm256_mul_ps(a, b);
 }
 
 // Return A * B + C
-inline Vec_f32x8 vec_f32x8_fma(Vec_f32x8 a, Vec_f32x8 b, Vec_f32x8 c) {
+static inline Vec_f32x8 vec_f32x8_fma(Vec_f32x8 a, Vec_f32x8 b, Vec_f32x8 c) {
+#if defined(__FMA__)
+    return _mm256_fmadd_ps(a, b, c);
+#else
     return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
 }
 
-inline float vec_f32x8_sum(Vec_f32x8 vec) {
+static inline float vec_f32x8_sum(Vec_f32x8 vec) {
     float* f = (float *)(&vec);
     return f[0] + f[1] + f[2] + f[3] + f[4] + f[5] + f[6] + f[7];
 }
 
-inline Vec_f32x8 vec_f32x8_setzero() {
+static inline Vec_f32x8 vec_f32x8_setzero() {
     return _mm256_setzero_ps();
 }
 
+static inline Vec_f32x8 vec_f32x8_set1(float x) {
+    return _mm256_set1_ps(x);
+}
+
+static inline Vec_f32x8 vec_f32x8_div(Vec_f32x8 a, Vec_f32x8 b) {
+    return _mm256_div_ps(a, b);
+}
+
+static inline Vec_f32x8 vec_f32x8_max(Vec_f32x8 a, Vec_f32x8 b) {
+    return _mm256_max_ps(a, b);
+}
+
+static inline float vec_f32x8_max_reduce(Vec_f32x8 vec) {
+    __m128 m = _mm_max_ps(_mm256_castps256_ps128(vec), _mm256_extractf128_ps(vec, 1));
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+    return _mm_cvtss_f32(m);
+}
+
+// Returns exp(x), within 2 ulps of std::exp for the inputs whose exp is a normal float. The
+// inputs below that range give 0 and the inputs above 88 are clamped to 88, which gives a
+// large finite result instead of inf. It is computed as 2^n * exp(r) where n = round(x / ln2)
+// and r = x - n * ln2 is in [-ln2/2, ln2/2], where exp(r) is approximated by the Cephes expf
+// polynomial.
+static inline Vec_f32x8 vec_f32x8_exp(Vec_f32x8 x) {
+    const Vec_f32x8 min_x = _mm256_set1_ps(-87.33f);
+    const Vec_f32x8 underflow = _mm256_cmp_ps(x, min_x, _CMP_LT_OQ);
+    x = _mm256_min_ps(_mm256_max_ps(x, min_x), _mm256_set1_ps(88.0f));
+
+    const Vec_f32x8 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    // ln2 is split in a part that is exact in fp32 and the rest so that r is exact.
+    Vec_f32x8 r = vec_f32x8_fma(n, _mm256_set1_ps(-0.693359375f), x);
+    r = vec_f32x8_fma(n, _mm256_set1_ps(2.12194440e-4f), r);
+
+    Vec_f32x8 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = vec_f32x8_fma(p, r, _mm256_set1_ps(1.3981999507e-3f));
+    p = vec_f32x8_fma(p, r, _mm256_set1_ps(8.3334519073e-3f));
+    p = vec_f32x8_fma(p, r, _mm256_set1_ps(4.1665795894e-2f));
+    p = vec_f32x8_fma(p, r, _mm256_set1_ps(1.6666665459e-1f));
+    p = vec_f32x8_fma(p, r, _mm256_set1_ps(5.0000001201e-1f));
+    // exp(r) = 1 + r + r^2 * p(r)
+    p = vec_f32x8_fma(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+
+    // 2^n, built from its exponent bits.
+#if defined(__AVX2__)
+    const __m256i pow2n = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+#else
+    const __m256i ni = _mm256_cvtps_epi32(n);
+    const __m128i bias = _mm_set1_epi32(127);
+    const __m128i lo = _mm_slli_epi32(_mm_add_epi32(_mm256_castsi256_si128(ni), bias), 23);
+    const __m128i hi = _mm_slli_epi32(_mm_add_epi32(_mm256_extractf128_si256(ni, 1), bias), 23);
+    const __m256i pow2n = _mm256_insertf128_si256(_mm256_castsi128_si256(lo), hi, 1);
+#endif
+    return _mm256_andnot_ps(underflow, _mm256_mul_ps(p, _mm256_castsi256_ps(pow2n)));
+}
+
+// Returns silu(x) = x / (1 + exp(-x)).
+static inline Vec_f32x8 vec_f32x8_silu(Vec_f32x8 x) {
+    const Vec_f32x8 one = _mm256_set1_ps(1.0f);
+    const Vec_f32x8 neg_x = _mm256_sub_ps(_mm256_setzero_ps(), x);
+    return _mm256_div_ps(x, _mm256_add_ps(one, vec_f32x8_exp(neg_x)));
+}
+
 #endif
 
 } // namespace ops
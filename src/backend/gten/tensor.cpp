@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <iomanip>
 #include <fstream>
@@ -6,6 +9,10 @@
 #include "quants.h"
 #include "utils.h"
 
+#if defined(_MSC_VER)
+#include <malloc.h>
+#endif
+
 
 namespace gten {
 
@@ -27,6 +34,24 @@ static void tensor_data_deleter(uint8_t* ptr) {
     std::free(ptr);
 }
 
+// Allocates `size` bytes aligned to `alignment`, which must be a power of two that `size`
+// is a multiple of. The memory must be freed by `aligned_data_deleter`.
+static void* aligned_malloc(size_t alignment, size_t size) {
+#if defined(_MSC_VER)
+    return _aligned_malloc(size, alignment);
+#else
+    return std::aligned_alloc(alignment, size);
+#endif
+}
+
+static void aligned_data_deleter(uint8_t* ptr) {
+#if defined(_MSC_VER)
+    _aligned_free(ptr);
+#else
+    std::free(ptr);
+#endif
+}
+
 Tensor::Tensor(const std::vector<int>& shape, Dtype dtype)
     : M_dtype{dtype}
 {
@@ -36,30 +61,7 @@ Tensor::Tensor(const std::vector<int>& shape, Dtype dtype)
     const int numel = numel_from_shape(shape);
     m_numel = numel;
 
-    int alloc_bytes;
-    if (dtype == kQint8 && shape.size() != 1) {
-        const int last_dimsize = ndims() == 2 ? dimsize(1) : dimsize(2);
-        const int block_size = globs::q8_block_size;
-        const int blocks_per_row = (last_dimsize % block_size == 0)
-                                   ? last_dimsize / block_size
-                                   : last_dimsize / block_size + 1;
-        
-        const int n_blocks = ndims() == 2
-                             ? dimsize(0) * blocks_per_row
-                             : dimsize(0) * dimsize(1) * blocks_per_row;
-
-        alloc_bytes = n_blocks * sizeof(Q8Block);
-    } else if (dtype == kQint4) {
-        GTEN_ASSERT(ndims() == 2);
-        GTEN_ASSERT(dimsize(1) % globs::q8_block_size == 0);
-        const int blocks_per_row = dimsize(1) / globs::q8_block_size;
-        const int n_blocks = dimsize(0) * blocks_per_row;
-
-        alloc_bytes = n_blocks * sizeof(Q4Block);
-    }
-    else {
-        alloc_bytes = numel * itemsize();
-    }
+    const int alloc_bytes = storage_nbytes(shape);
 
     void* raw_data_ptr = std::malloc(alloc_bytes);
     GTEN_ASSERTM(raw_data_ptr, "Failed to allocate %dMB of memory.", alloc_bytes / 1000000);
@@ -70,6 +72,70 @@ Tensor::Tensor(const std::vector<int>& shape, Dtype dtype)
 }
 
 
+Tensor::Tensor(const std::vector<int>& shape, Dtype dtype, TensorLayout layout)
+    : Tensor()
+{
+    if (layout == TensorLayout::Strided) {
+        *this = Tensor(shape, dtype);
+        return;
+    }
+
+    GTEN_ASSERTM(shape.size() == 2, "Packed tensors must be 2d.");
+    GTEN_ASSERTM(dtype == kQint8 || dtype == kQint4, "Packed tensors must be quantized.");
+    validate_shape(shape);
+    M_dtype = dtype;
+    m_layout = layout;
+    m_shape = shape;
+    set_strides_from_shape(shape);
+    m_numel = numel_from_shape(shape);
+
+    const int n_rows = globs::q_pack_rows;
+    GTEN_ASSERTM(dimsize(0) % n_rows == 0, "Packed tensor dim 0: %d must be a multiple of %d.", dimsize(0), n_rows);
+    GTEN_ASSERT(dimsize(1) % globs::q8_block_size == 0);
+    const int alloc_bytes = (dimsize(0) / n_rows) * packed_group_nbytes();
+
+    // The kernels rely on the alignment of the row groups (group_nbytes is a multiple of it).
+    void* raw_data_ptr = aligned_malloc(globs::q_pack_align, alloc_bytes);
+    GTEN_ASSERTM(raw_data_ptr, "Failed to allocate %dMB of memory.", alloc_bytes / 1000000);
+
+    m_data_ptr = std::shared_ptr<uint8_t>(static_cast<uint8_t*>(raw_data_ptr), aligned_data_deleter);
+    m_storage_size = alloc_bytes;
+    Tensor::s_tensor_alloc_bytes += alloc_bytes;
+}
+
+
+int Tensor::storage_nbytes(const std::vector<int>& shape) const
+{
+    const int ndims = shape.size();
+    const int numel = numel_from_shape(shape);
+    if (M_dtype == kQint8 && ndims != 1) {
+        const int last_dimsize = shape[ndims - 1];
+        const int block_size = globs::q8_block_size;
+        const int blocks_per_row = (last_dimsize % block_size == 0)
+                                   ? last_dimsize / block_size
+                                   : last_dimsize / block_size + 1;
+        const int n_blocks = (numel / last_dimsize) * blocks_per_row;
+
+        return n_blocks * sizeof(Q8Block);
+    } else if (M_dtype == kQint4) {
+        // 2d weights or 3d caches whose rows are made of whole blocks.
+        GTEN_ASSERT(ndims == 2 || ndims == 3);
+        GTEN_ASSERT(shape[ndims - 1] % globs::q4_block_size == 0);
+        const int n_blocks = numel / globs::q4_block_size;
+
+        return n_blocks * sizeof(Q4Block);
+    }
+    return numel * itemsize();
+}
+
+
+int Tensor::packed_group_nbytes() const
+{
+    const int n_blocks = dimsize(1) / globs::q8_block_size;
+    return M_dtype == kQint8 ? ops::q8_packed_group_nbytes(n_blocks) : ops::q4_packed_group_nbytes(n_blocks);
+}
+
+
 // An empty deleter allows us to use external data storage that we do not own.
 static void empty_deleter(uint8_t* ptr) {  }
 
@@ -123,14 +189,27 @@ static std::string shape_to_str(const std::vector<int>& shape)
     return s.str();
 }
 
-// Contigous only???
 void Tensor::resize(const std::vector<int>& new_shape) {
     validate_shape(new_shape);
-    const int new_size = numel_from_shape(new_shape) * itemsize();
-    GTEN_ASSERTM(
-        new_size <= m_storage_size,
-        "The new shape provided %s with cap=%d exceeds shape %s with cap=%d.",
-        shape_to_str(new_shape).c_str(), new_size, shape_str().c_str(), m_storage_size);
+    GTEN_ASSERTM(!is_packed(), "Packed tensors cannot be resized.");
+    const int new_size = storage_nbytes(new_shape);
+    if (new_size > m_storage_size) {
+        GTEN_ASSERTM(
+            m_storage_size > 0,
+            "The new shape provided %s with cap=%d exceeds shape %s of external data with cap=%d.",
+            shape_to_str(new_shape).c_str(), new_size, shape_str().c_str(), m_storage_size);
+
+        // The storage at least doubles so that a tensor that grows one row at a time is only
+        // reallocated a logarithmic number of times.
+        const int alloc_bytes = std::max(new_size, 2 * m_storage_size);
+        void* raw_data_ptr = std::malloc(alloc_bytes);
+        GTEN_ASSERTM(raw_data_ptr, "Failed to allocate %dMB of memory.", alloc_bytes / 1000000);
+        std::memcpy(raw_data_ptr, m_data_ptr.get(), m_storage_size);
+
+        m_data_ptr = std::shared_ptr<uint8_t>(static_cast<uint8_t*>(raw_data_ptr), tensor_data_deleter);
+        Tensor::s_tensor_alloc_bytes += alloc_bytes - m_storage_size;
+        m_storage_size = alloc_bytes;
+    }
     m_shape = new_shape;
     set_strides_from_shape(new_shape);
     m_numel = numel_from_shape(new_shape);
@@ -172,6 +251,39 @@ Tensor Tensor::view(const std::vector<int>& new_shape) const {
 }
 
 
+Tensor Tensor::slice(int start, int end) const
+{
+    GTEN_ASSERTM(is_1d() || is_2d(), "Only 1d and 2d tensors can be sliced.");
+    GTEN_ASSERTM(0 <= start && start < end && end <= dimsize(0),
+                 "Invalid slice [%d, %d) of dimension 0 with size %d.", start, end, dimsize(0));
+
+    size_t offset;
+    size_t nbytes;
+    if (is_packed()) {
+        const int n_rows = globs::q_pack_rows;
+        GTEN_ASSERTM(start % n_rows == 0 && end % n_rows == 0,
+                     "Packed tensors must be sliced at multiples of %d rows.", n_rows);
+        offset = size_t(start / n_rows) * packed_group_nbytes();
+        nbytes = size_t((end - start) / n_rows) * packed_group_nbytes();
+    } else {
+        const int st0 = is_1d() ? itemsize() : bstride(0);
+        GTEN_ASSERTM(is_1d() || stride(1) == 1, "Only contiguous tensors can be sliced.");
+        offset = size_t(start) * st0;
+        nbytes = size_t(end - start) * st0;
+    }
+
+    Tensor out = *this;
+    // Shares the ownership of the data with this tensor but points at the start of the slice.
+    out.m_data_ptr = std::shared_ptr<uint8_t>(m_data_ptr, m_data_ptr.get() + offset);
+    out.m_shape[0] = end - start;
+    out.set_strides_from_shape(out.m_shape);
+    out.m_numel = numel_from_shape(out.m_shape);
+    out.m_storage_size = nbytes;
+
+    return out;
+}
+
+
 // Should we create and return a new tensor with the new shape?
 Tensor Tensor::permute(const std::vector<int> &indices)
 {
@@ -274,6 +386,12 @@ void Tensor::print_single(int item_idx, int row_idx, int col_idx, int n_cols) co
                   << std::setw(7)
                   << fp16_to_fp32(data_ptr<Float16>()[item_idx]);
     }
+    else if (M_dtype == kBFloat16) {
+        std::cout << std::fixed
+                  << std::setprecision(4)
+                  << std::setw(7)
+                  << bf16_to_fp32(data_ptr<BFloat16>()[item_idx]);
+    }
     else if (M_dtype == kFloat32) {
         std::cout << std::fixed
                   << std::setprecision(4)
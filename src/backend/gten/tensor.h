@@ -14,12 +14,21 @@
 
 namespace gten {
 
+// Memory layout of the tensor data. Quantized 2d weights can be repacked after loading into
+// a row interleaved layout used by the matmul kernels (see "PACKED LAYOUT" in quants.h).
+// Only the matmul can read the data of packed tensors.
+enum class TensorLayout {
+    Strided,
+    PackedRows
+};
+
 class Tensor {
 public:
     static int64_t s_tensor_alloc_bytes;
 public:
     Tensor() = default;
     Tensor(const std::vector<int>& shape, Dtype dtype);
+    Tensor(const std::vector<int>& shape, Dtype dtype, TensorLayout layout);
     Tensor(const void* data_ptr, const std::vector<int>& shape, Dtype dtype);
     Tensor(const Tensor& rhs) = default;
     Tensor(Tensor&& rhs) = default;
@@ -29,18 +38,24 @@ public:
     Tensor permute(const std::vector<int>& new_shape);
     void print() const;
     void print_info() const;
-    // Resize the tensor to have a new shape. This function does not perform
-    // any reallocation and therefore, the tensor must have enough capacity
-    // to accommodate the number of elements in the new shape.
-    // NOTE: The purpose of this function is to allow us to allocate for
-    // activations tensors to be able to hold all future predictions
-    // activations but reshape them as we continously add activations.
+    // Resize the tensor to have a new shape. If the tensor does not have enough
+    // capacity to accommodate the number of elements in the new shape, its storage
+    // is reallocated (keeping the current data) to at least twice its size.
+    // NOTE: The purpose of this function is to allow activations tensors to grow
+    // with the context as we continously add activations instead of allocating for
+    // the maximum context upfront. The tensors that share the previous storage,
+    // e.g slices of this tensor, keep pointing to it.
     void resize(const std::vector<int>& new_shape);
     void set_strides(const std::vector<int>& strides);
     std::string shape_str() const;
     std::string strides_str() const;
     void save(const std::string& path) const;
     Tensor view(const std::vector<int>& new_shape) const;
+    // Returns a tensor that shares the data of the range [start, end) of dimension 0 of this
+    // contiguous 1d or 2d tensor, e.g a range of rows of a weight. The data stays alive as
+    // long as any of the tensors that share it. Packed tensors can only be sliced at row
+    // group boundaries.
+    Tensor slice(int start, int end) const;
 
     // Get the pointer to internal data buffer.
     template <typename T>
@@ -54,6 +69,9 @@ public:
 
     Dtype dtype() const { return M_dtype; }
 
+    TensorLayout layout() const { return m_layout; }
+    bool is_packed() const { return m_layout == TensorLayout::PackedRows; }
+
     // Get the number of bytes that an element in the tensor occupies.
     int itemsize() const {
         switch (M_dtype) {
@@ -63,6 +81,8 @@ public:
                 return 4;
             case kFloat16:
                 return 2;
+            case kBFloat16:
+                return 2;
             case kFloat32:
                 return 4;
             default:
@@ -123,6 +143,7 @@ public:
 
 private:
     Dtype M_dtype = kInt32;
+    TensorLayout m_layout = TensorLayout::Strided;
     std::shared_ptr<uint8_t> m_data_ptr;
     int m_storage_size = 0;  // in_bytes
     int m_numel = 0;
@@ -133,6 +154,9 @@ private:
     void validate_shape(const std::vector<int>& shape) const;
     void set_strides_from_shape(const std::vector<int>& shape);
     int numel_from_shape(const std::vector<int>& shape) const;
+    // Number of bytes of the (strided) storage of a tensor of this dtype and the given shape.
+    int storage_nbytes(const std::vector<int>& shape) const;
+    int packed_group_nbytes() const;
     void print_single(int item_idx, int row_idx, int col_idx, int n_cols) const;
 };
 
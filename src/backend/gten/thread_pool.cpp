@@ -0,0 +1,239 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+
+#include "thread_pool.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#define GTEN_CPU_RELAX() _mm_pause()
+#else
+#define GTEN_CPU_RELAX() ((void)0)
+#endif
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+
+namespace gten {
+
+// Number of spin iterations a thread waits for the next loop (or for the workers to finish
+// the current one) before it sleeps (or yields). This is in the order of a millisecond which
+// is much longer than the gaps between the ops of a forward pass.
+static const int kSpinIters = 1 << 14;
+
+// Whether the current thread is running the tasks of a parallel loop.
+static thread_local bool t_in_parallel_for = false;
+
+// Returns the cpus that the process is allowed to run on, or an empty list if unknown.
+static std::vector<int> allowed_cpus()
+{
+    std::vector<int> cpus;
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+#endif
+    return cpus;
+}
+
+static int default_n_threads()
+{
+    const int n_cpus = static_cast<int>(allowed_cpus().size());
+    if (n_cpus > 0) {
+        return n_cpus;
+    }
+    return std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+}
+
+static void pin_current_thread(int cpu)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        std::cerr << "GTEN: failed to pin a worker thread to cpu " << cpu << "\n";
+    }
+#else
+    (void)cpu;
+#endif
+}
+
+
+ThreadPool::ThreadPool(const ThreadPoolConfig& config)
+{
+    const int n_threads = config.n_threads > 0 ? config.n_threads : default_n_threads();
+
+    std::vector<int> cpus;
+    if (config.pin_threads) {
+        cpus = config.cpus.empty() ? allowed_cpus() : config.cpus;
+    }
+
+    workers_.reserve(n_threads - 1);
+    for (int i = 0; i < n_threads - 1; i++) {
+        const int cpu = cpus.empty() ? -1 : cpus[(i + 1) % cpus.size()];
+        workers_.emplace_back(&ThreadPool::worker_main, this, cpu);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    stop_.store(true);
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        generation_.fetch_add(1);
+    }
+    wake_cv_.notify_all();
+    for (std::thread& worker : workers_) {
+        worker.join();
+    }
+}
+
+void ThreadPool::run(int n_tasks, TaskFn fn, const void* ctx)
+{
+    if (n_tasks <= 0) {
+        return;
+    }
+    if (workers_.empty() || n_tasks == 1 || t_in_parallel_for) {
+        for (int task = 0; task < n_tasks; task++) {
+            fn(ctx, task);
+        }
+        return;
+    }
+
+    task_fn_ = fn;
+    task_ctx_ = ctx;
+    n_tasks_ = n_tasks;
+    next_task_.store(0, std::memory_order_relaxed);
+    n_done_.store(0, std::memory_order_relaxed);
+
+    // Publishes the loop to the workers. The workers that went to sleep increment
+    // `n_sleeping_` before they check the generation so either they see the new generation
+    // or we see that they are (about to be) sleeping and wake them up.
+    generation_.fetch_add(1);
+    if (n_sleeping_.load() > 0) {
+        std::lock_guard<std::mutex> lock{mutex_};
+        wake_cv_.notify_all();
+    }
+
+    t_in_parallel_for = true;
+    run_tasks();
+    t_in_parallel_for = false;
+
+    // Wait for all the workers, even those that got no task, so that none of them reads
+    // the loop after we return.
+    const int n_workers = static_cast<int>(workers_.size());
+    int spins = 0;
+    while (n_done_.load(std::memory_order_acquire) != n_workers) {
+        if (spins < kSpinIters) {
+            spins++;
+            GTEN_CPU_RELAX();
+        } else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void ThreadPool::run_tasks()
+{
+    while (true) {
+        const int task = next_task_.fetch_add(1, std::memory_order_relaxed);
+        if (task >= n_tasks_) {
+            break;
+        }
+        task_fn_(task_ctx_, task);
+    }
+}
+
+void ThreadPool::worker_main(int cpu)
+{
+    if (cpu >= 0) {
+        pin_current_thread(cpu);
+    }
+    t_in_parallel_for = true;
+
+    // The workers are started before the first loop so they have seen no loop yet.
+    unsigned seen_generation = 0;
+    while (true) {
+        int spins = 0;
+        while (generation_.load(std::memory_order_acquire) == seen_generation) {
+            if (spins < kSpinIters) {
+                spins++;
+                GTEN_CPU_RELAX();
+                continue;
+            }
+            n_sleeping_.fetch_add(1);
+            {
+                std::unique_lock<std::mutex> lock{mutex_};
+                wake_cv_.wait(lock, [this, seen_generation] { return generation_.load() != seen_generation; });
+            }
+            n_sleeping_.fetch_sub(1);
+        }
+        seen_generation = generation_.load(std::memory_order_acquire);
+        if (stop_.load()) {
+            return;
+        }
+
+        run_tasks();
+        n_done_.fetch_add(1, std::memory_order_release);
+    }
+}
+
+
+static std::mutex g_pool_mutex;
+static std::unique_ptr<ThreadPool> g_pool;
+static std::unique_ptr<ThreadPoolConfig> g_pool_config;
+// The created pool, read without taking the lock by the ops once it is set.
+static std::atomic<ThreadPool*> g_pool_ptr{nullptr};
+
+static ThreadPoolConfig config_from_env()
+{
+    ThreadPoolConfig config;
+    const char* n_threads = std::getenv("GTEN_NUM_THREADS");
+    if (n_threads && n_threads[0] != '\0') {
+        config.n_threads = std::atoi(n_threads);
+        if (config.n_threads <= 0) {
+            std::cerr << "GTEN: ignoring GTEN_NUM_THREADS=" << n_threads << "\n";
+            config.n_threads = 0;
+        }
+    }
+    const char* pin_threads = std::getenv("GTEN_PIN_THREADS");
+    config.pin_threads = pin_threads && std::strcmp(pin_threads, "1") == 0;
+    return config;
+}
+
+ThreadPool& thread_pool()
+{
+    ThreadPool* pool = g_pool_ptr.load(std::memory_order_acquire);
+    if (pool) {
+        return *pool;
+    }
+
+    std::lock_guard<std::mutex> lock{g_pool_mutex};
+    if (!g_pool) {
+        g_pool = std::make_unique<ThreadPool>(g_pool_config ? *g_pool_config : config_from_env());
+        g_pool_ptr.store(g_pool.get(), std::memory_order_release);
+    }
+    return *g_pool;
+}
+
+void configure_thread_pool(const ThreadPoolConfig& config)
+{
+    std::lock_guard<std::mutex> lock{g_pool_mutex};
+    g_pool_config = std::make_unique<ThreadPoolConfig>(config);
+    g_pool_ptr.store(nullptr, std::memory_order_release);
+    g_pool.reset();
+}
+
+} // namespace gten
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace gten {
+
+struct ThreadPoolConfig {
+    // Total number of threads that run the parallel ops, including the thread that calls
+    // `parallel_for`. Zero means one thread per cpu that we are allowed to run on.
+    int n_threads = 0;
+    // Whether to pin each worker thread to a single cpu. The workers are pinned to the cpus
+    // in `cpus`, or to the cpus we are allowed to run on if it is empty, in order and
+    // starting from the second one which is left to the calling thread. Only supported on
+    // Linux, ignored elsewhere.
+    bool pin_threads = false;
+    std::vector<int> cpus;
+};
+
+// A pool of persistent worker threads that run the parallel loops of the ops. Starting a
+// parallel loop only requires waking up the workers, which spin for a while after a loop
+// completes before they go to sleep so that the back to back loops of a forward pass do
+// not pay for a context switch each.
+//
+// The pool runs one loop at a time and the ops share their scratch buffers (see ops.cpp) so
+// the ops must all be called from a single thread, e.g the thread running the inference.
+class ThreadPool {
+public:
+    explicit ThreadPool(const ThreadPoolConfig& config);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int n_threads() const { return static_cast<int>(workers_.size()) + 1; }
+
+    // Calls `fn(task)` for each task in [0, n_tasks) on the calling thread and the workers
+    // and returns once all the tasks are done. The threads claim the tasks one at a time
+    // from a shared counter so that the threads on faster (or less busy) cores end up doing
+    // more of them. Loops started from inside a task are run on the calling thread. Must not
+    // be called by two threads at the same time.
+    template <typename Fn>
+    void parallel_for(int n_tasks, const Fn& fn) {
+        auto run_task = [](const void* ctx, int task) {
+            (*static_cast<const Fn*>(ctx))(task);
+        };
+        run(n_tasks, run_task, &fn);
+    }
+
+private:
+    using TaskFn = void (*)(const void* ctx, int task);
+
+    void run(int n_tasks, TaskFn fn, const void* ctx);
+    void run_tasks();
+    void worker_main(int cpu);
+
+private:
+    std::vector<std::thread> workers_;
+
+    // The current loop. Written by the calling thread before it bumps `generation_`.
+    TaskFn task_fn_ = nullptr;
+    const void* task_ctx_ = nullptr;
+    int n_tasks_ = 0;
+    std::atomic<int> next_task_{0};
+
+    // Incremented for each loop (and on shutdown) to wake up the workers.
+    std::atomic<unsigned> generation_{0};
+    // Number of workers that are done with the current loop.
+    std::atomic<int> n_done_{0};
+    std::atomic<int> n_sleeping_{0};
+    std::atomic<bool> stop_{false};
+    std::mutex mutex_;
+    std::condition_variable wake_cv_;
+};
+
+// Returns the thread pool used by the ops. It is created on the first call with the config
+// set by `configure_thread_pool` or, if it was not called, from the `GTEN_NUM_THREADS` and
+// `GTEN_PIN_THREADS` (0 or 1) environment variables. Only the first call takes a lock.
+ThreadPool& thread_pool();
+
+// Sets the config of the thread pool, replacing the pool if it was already created. Must not
+// be called while an op is running.
+void configure_thread_pool(const ThreadPoolConfig& config);
+
+} // namespace gten
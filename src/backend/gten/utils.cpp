@@ -1,6 +1,7 @@
 #include <iomanip>
 
 #include "gten_types.h"
+#include "kernels.h"
 #include "utils.h"
 
 
@@ -19,6 +20,8 @@ const char* dtype_str(Dtype dtype) {
             return "Float16";
         case kFloat32:
             return "Float32";
+        case kBFloat16:
+            return "BFloat16";
         default: {
             GTEN_ASSERT(false);
             return "";
@@ -96,9 +99,11 @@ void print_performance_metrics(const PerformanceMetrics& metrics)
     std::cout << " " << "Mem usage (actvs)        : " << std::setw(4) << metrics.mem_usage_acvs_mb    << "MB\n";
     std::cout << "---------------------------------------\n";
     std::cout << " " << "Inference time (per tok) : " << std::setw(4) << metrics.inference_time_per_tok_ms << "ms\n";
-    std::cout << " " << "Lin time       (per tok) : " << std::setw(4) << metrics.linear_time_per_tok_ms    << "ms\n";
+    std::cout << " " << "Matmul time    (per tok) : " << std::setw(4) << metrics.linear_time_per_tok_ms    << "ms\n";
     std::cout << " " << "Attn time      (per tok) : " << std::setw(4) << metrics.attn_time_per_tok_ms      << "ms\n";
     std::cout << " " << "Other          (per tok) : " << std::setw(4) << metrics.other_time_ms             << "ms\n";
+    std::cout << "---------------------------------------\n";
+    std::cout << " " << "Kernels                  : " << std::setw(4) << kernel_tier_str(kernels().tier)   << "\n";
     std::cout << "---------------------------------------\n\n";
 }
 
@@ -24,6 +24,9 @@ struct PerformanceMetrics {
     int load_time_secs = 0;          
     int total_runtime_secs = 0;
     int inference_time_per_tok_ms = 0;
+    // The time of the matmuls, including their fused epilogues: the residual adds and the norms
+    // that follow them, the gated silu, and the rotary embedding and kv cache writes of the
+    // qkv projection.
     int linear_time_per_tok_ms = 0;   
     int attn_time_per_tok_ms = 0;     
     int other_time_ms = 0;             
@@ -28,21 +28,17 @@ static const MiniCPMConfig minicpm_cfg = MiniCPMConfig{};
 
 class MiniCPMAttentionBlock {
 public:
-    MiniCPMAttentionBlock(int n_heads, int d_embed, int n_query_groups, int n_mlp, int max_ctx, ModuleDtype dtype);
-    Tensor forward(Tensor& inp, Tensor& scratch, const int start_pos);
-    Tensor mlp_forward(const Tensor& inp, const int start_pos=0);
+    MiniCPMAttentionBlock(int n_heads, int d_embed, int n_query_groups, int n_mlp, ModuleDtype dtype, std::shared_ptr<RopeTable> rope);
+    /// `inp_norm` is the input norm of `inp`. The norm of the output of the block, i.e the
+    /// input norm of the next block or the final norm, is computed by the mlp down
+    /// projection into `out_norm`.
+    Tensor forward(const Tensor& inp, const Tensor& inp_norm, RMSNorm& out_norm, const int start_pos);
 
 public:
     RMSNorm m_input_norm;
     SelfAttention m_self_attn;
-    Residual m_inp_residual;
     RMSNorm m_post_attn_norm;
-    Linear m_mlp_gate_proj;
-    Linear m_mlp_up_proj;
-    SiLU m_mlp_silu;
-    Multiply m_mlp_mul;
-    Linear m_mlp_down_proj;
-    Residual m_attn_res;
+    GatedMLP m_mlp;
 };
 
 
@@ -54,12 +50,15 @@ public:
     MiniCPM(const int n_ctx, ModuleDtype dtype);
 
     Tensor logits(const Tensor& tokens, const int start_pos=0);
+    void reset_kv_cache();
+    void shift_kv_cache(int n_keep, int n_discard, int n_past);
     void load_from_ckpt(std::ifstream& ckpt);
     void print_perf(const int n_pred_tokens);
 
 private:
+    // The rotary embedding angles shared by the attention of all the blocks.
+    std::shared_ptr<RopeTable> rope_;
     TiedEmbedding tok_emb_;
     RMSNorm norm_;
     std::vector<MiniCPMAttentionBlock> blocks_;
-    Tensor res_scratch; // Used to hold a tensor copy for residual ops.
 };
@@ -28,21 +28,17 @@ static const TinyLLamaConfig tinyllama_cfg = TinyLLamaConfig{};
 
 class TinyLLamaBlock {
 public:
-    TinyLLamaBlock(int n_heads, int d_embed, int n_query_groups, int n_mlp, int max_ctx, ModuleDtype dtype);
-    Tensor forward(Tensor& inp, const int start_pos);
-    Tensor ffn_forward(const Tensor& inp, const int start_pos=0);
+    TinyLLamaBlock(int n_heads, int d_embed, int n_query_groups, int n_mlp, ModuleDtype dtype, std::shared_ptr<RopeTable> rope);
+    /// `inp_norm` is the attention norm of `inp`. The norm of the output of the block, i.e the
+    /// attention norm of the next block or the final norm, is computed by the mlp down
+    /// projection into `out_norm`.
+    Tensor forward(const Tensor& inp, const Tensor& inp_norm, RMSNorm& out_norm, const int start_pos);
 
 public:
     RMSNorm m_attn_norm;
     SelfAttention m_self_attn;
-    Residual m_inp_res;
     RMSNorm m_mlp_norm;
-    Linear m_mlp_gate_proj;
-    Linear m_mlp_up_proj;
-    SiLU m_mlp_silu;
-    Multiply m_mlp_mul;
-    Linear m_mlp_down_proj;
-    Residual m_attn_res;
+    GatedMLP m_mlp;
 };
 
 
@@ -52,11 +48,15 @@ public:
     TinyLLama(const int n_ctx, ModuleDtype dtype);
 
     Tensor logits(const Tensor& tokens, const int start_pos=0);
+    void reset_kv_cache();
+    void shift_kv_cache(int n_keep, int n_discard, int n_past);
     void load_from_ckpt(std::ifstream& ckpt);
     void print_perf(const int n_pred_tokens);
 
 private:
     ModuleDtype m_dtype;
+    // The rotary embedding angles shared by the attention of all the blocks.
+    std::shared_ptr<RopeTable> m_rope;
     Embedding m_tok_emb;
     RMSNorm m_norm;
     EmbeddingLinear m_lm_head;
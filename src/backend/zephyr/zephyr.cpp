@@ -7,36 +7,31 @@
 using namespace gten;
 
 
-ZephyrBlock::ZephyrBlock(int n_heads, int n_embd, int n_query_groups, int n_mlp, int max_ctx, ModuleDtype dtype, float rope_pct)
-    : m_attn_norm{LayerNorm(n_embd, max_ctx, dtype)},
-      m_self_attn{SelfAttention(n_heads, n_embd, n_query_groups, max_ctx, dtype, rope_pct, /*qkv_bias=*/true)},
-      m_inp_res{Residual(max_ctx, n_embd, dtype.adtype)},
-      m_mlp_norm{LayerNorm(n_embd, max_ctx, dtype)},
-      m_mlp_gate_proj{Linear(n_embd, n_mlp, max_ctx, dtype)},
-      m_mlp_up_proj{Linear(n_embd, n_mlp, max_ctx, dtype)},
-      m_mlp_silu{SiLU(max_ctx, n_mlp, dtype.adtype, /*inplace=*/true)},
-      m_mlp_mul{Multiply(max_ctx, n_mlp, dtype.adtype, /*inplace=*/true)},
-      m_mlp_down_proj{Linear(n_mlp, n_embd, max_ctx, dtype)},
-      m_attn_res{Residual(max_ctx, n_embd, dtype.adtype)}
+ZephyrBlock::ZephyrBlock(int n_heads, int n_embd, int n_query_groups, int n_mlp, ModuleDtype dtype, std::shared_ptr<RopeTable> rope)
+    : m_attn_norm{LayerNorm(n_embd, dtype)},
+      m_self_attn{SelfAttention(n_heads, n_embd, n_query_groups, dtype, std::move(rope), /*qkv_bias=*/true)},
+      m_mlp_norm{LayerNorm(n_embd, dtype)},
+      m_mlp{GatedMLP(n_embd, n_mlp, dtype)}
 {
 }
 
-Tensor ZephyrBlock::ffn_forward(const Tensor& inp, const int start_pos) {
-    // self.w2(F.silu(self.w1(x)) * self.w3(x))
-    Tensor w1 = m_mlp_gate_proj.forward(inp, start_pos);
-    const Tensor w3 = m_mlp_up_proj.forward(inp, start_pos);
-    Tensor sw1 = m_mlp_silu.forward(w1, start_pos);
-    const Tensor w1w2 = m_mlp_mul.forward(sw1, w3, start_pos);
-    Tensor out = m_mlp_down_proj.forward(w1w2, start_pos);
 
-    return out;
-}
+Tensor ZephyrBlock::forward(const Tensor& inp, const Tensor& inp_norm, LayerNorm& out_norm, const int start_pos)
+{
+    // The output projections of the attention and the mlp add the residual to their output
+    // and compute the norm that follows.
+    const int n_ctx = inp.dimsize(0);
 
+    ops::MatmulEpilogue attn_epilogue;
+    attn_epilogue.residual = &inp;
+    m_mlp_norm.fuse_into(attn_epilogue, n_ctx);
+    Tensor h = m_self_attn.forward(inp_norm, attn_epilogue, start_pos);
+
+    ops::MatmulEpilogue mlp_epilogue;
+    mlp_epilogue.residual = &h;
+    out_norm.fuse_into(mlp_epilogue, n_ctx);
+    Tensor out = m_mlp.forward(m_mlp_norm.m_acv, mlp_epilogue, start_pos);
 
-Tensor ZephyrBlock::forward(Tensor &inp, const int start_pos)
-{
-    Tensor h = m_inp_res.forward(inp, m_self_attn.forward(m_attn_norm.forward(inp, start_pos), start_pos), start_pos);
-    Tensor out = m_attn_res.forward(h, ffn_forward(m_mlp_norm.forward(h, start_pos), start_pos), start_pos);
     return out;
 }
 
@@ -44,33 +39,33 @@ Tensor ZephyrBlock::forward(Tensor &inp, const int start_pos)
 Zephyr::Zephyr(const int n_ctx, ModuleDtype dtype)
     : Model(n_ctx, zephyr_cfg.max_ctx),
       m_dtype{dtype},
-      m_tok_emb{Embedding(zephyr_cfg.n_vocab, zephyr_cfg.n_embd, n_ctx, dtype)},
-      m_norm{LayerNorm(zephyr_cfg.n_embd, n_ctx, {kFloat16, dtype.adtype})},
-      m_lm_head{EmbeddingLinear{zephyr_cfg.n_embd, zephyr_cfg.n_vocab, n_ctx, {dtype.wdtype, kFloat32}}}
+      m_rope{std::make_shared<RopeTable>(zephyr_cfg.n_embd / zephyr_cfg.n_heads, zephyr_cfg.rope_pct, n_ctx)},
+      m_tok_emb{Embedding(zephyr_cfg.n_vocab, zephyr_cfg.n_embd, dtype)},
+      m_norm{LayerNorm(zephyr_cfg.n_embd, {kFloat16, dtype.adtype})},
+      m_lm_head{EmbeddingLinear{zephyr_cfg.n_embd, zephyr_cfg.n_vocab, {dtype.wdtype, kFloat32}}}
 {
     m_blocks.reserve(zephyr_cfg.n_layers);
     for (int i = 0; i < zephyr_cfg.n_layers; i++) {
         m_blocks.push_back(
-            ZephyrBlock(zephyr_cfg.n_heads, zephyr_cfg.n_embd, zephyr_cfg.n_query_groups, zephyr_cfg.n_ffn, n_ctx, dtype, zephyr_cfg.rope_pct)
+            ZephyrBlock(zephyr_cfg.n_heads, zephyr_cfg.n_embd, zephyr_cfg.n_query_groups, zephyr_cfg.n_ffn, dtype, m_rope)
         );
     }
 }
 
 
 Tensor Zephyr::logits(const Tensor& tokens, const int start_pos) {
-    if (tokens.numel() > m_max_inference_ctx) {
-        std::cerr << "Number of prompt tokens (" << tokens.numel() << ") exceed provided maximum ctx size (" << m_max_inference_ctx << ")\n";
-        std::exit(EXIT_FAILURE);
+    Tensor x = m_tok_emb.forward(tokens, start_pos);
+    Tensor x_norm = m_blocks[0].m_attn_norm.forward(x, start_pos);
+
+    // Each block computes the norm of its output for the next block (or the final norm).
+    const int n_blocks = m_blocks.size();
+    for (int i = 0; i < n_blocks; i++) {
+        LayerNorm& out_norm = i + 1 < n_blocks ? m_blocks[i + 1].m_attn_norm : m_norm;
+        x = m_blocks[i].forward(x, x_norm, out_norm, start_pos);
+        x_norm = out_norm.m_acv;
     }
 
-    Tensor logits = m_tok_emb.forward(tokens, start_pos);
-
-    for (auto& block : m_blocks) {
-        logits = block.forward(logits, start_pos);
-    }
-
-    logits = m_norm.forward(logits, start_pos);
-    logits = m_lm_head.forward(logits);
+    Tensor logits = m_lm_head.forward(x_norm);
 
     return logits;
 }
@@ -117,15 +112,15 @@ void Zephyr::load_from_ckpt(std::ifstream &ckpt)
 
         // ffn_gate_proj
         read_layer_header(ckpt);
-        read_into_weight(ckpt, block.m_mlp_gate_proj.m_weight, m_dtype);
+        read_into_weight(ckpt, block.m_mlp.m_gate_weight, m_dtype);
 
         // ffn_up_proj
         read_layer_header(ckpt);
-        read_into_weight(ckpt, block.m_mlp_up_proj.m_weight, m_dtype);
+        read_into_weight(ckpt, block.m_mlp.m_up_weight, m_dtype);
 
         // ffn_down_proj
         read_layer_header(ckpt);
-        read_into_weight(ckpt, block.m_mlp_down_proj.m_weight, m_dtype);
+        read_into_weight(ckpt, block.m_mlp.m_down_proj.m_weight, m_dtype);
 
         // attn_norm
         read_layer_header(ckpt);
@@ -138,6 +133,10 @@ void Zephyr::load_from_ckpt(std::ifstream &ckpt)
         read_into_weight(ckpt, block.m_mlp_norm.m_weight, {kFloat16, m_dtype.adtype});
         read_layer_header(ckpt);
         read_into_weight(ckpt, block.m_mlp_norm.m_bias, {kFloat16, m_dtype.adtype});
+
+        // Fuse and repack the linear weights for the matmul kernels.
+        block.m_self_attn.pack_weights();
+        block.m_mlp.pack_weights();
     }
     
     read_layer_header(ckpt);
@@ -147,6 +146,21 @@ void Zephyr::load_from_ckpt(std::ifstream &ckpt)
 
     read_layer_header(ckpt);
     read_into_weight(ckpt, m_lm_head.m_weight, m_dtype);
+    m_lm_head.pack_weight();
+}
+
+void Zephyr::reset_kv_cache()
+{
+    for (auto& block : m_blocks) {
+        block.m_self_attn.reset_cache();
+    }
+}
+
+void Zephyr::shift_kv_cache(int n_keep, int n_discard, int n_past)
+{
+    for (auto& block : m_blocks) {
+        block.m_self_attn.shift_cache(n_keep, n_discard, n_past);
+    }
 }
 
 void Zephyr::print_perf(const int n_pred_tokens)
@@ -157,32 +171,26 @@ void Zephyr::print_perf(const int n_pred_tokens)
 
     {
         const int emb_time = m_tok_emb.m_exec_time_ms;
-        int norm_time = m_norm.m_exec_time_ms;
-        int res_time = 0;
-        int rope_time = 0;
-        int activ_time = 0;
-        int mul_time = 0;
+        // The other norms are computed by the epilogues of the output projections so their
+        // time is counted in the linear time.
+        const int norm_time = m_blocks[0].m_attn_norm.m_exec_time_ms;
         linear_time_ms += m_lm_head.m_exec_time_ms;
 
         for (const auto& b : m_blocks) {
-            norm_time += b.m_attn_norm.m_exec_time_ms + b.m_mlp_norm.m_exec_time_ms;
             attn_time_ms += b.m_self_attn.m_exec_time_attn_ms;
-            res_time  += b.m_attn_res.ms_exec_time_ms + b.m_inp_res.ms_exec_time_ms;
-            rope_time += b.m_self_attn.m_q_rope.m_exec_time_ms + b.m_self_attn.m_k_rope.m_exec_time_ms;
-            activ_time += b.m_mlp_norm.m_exec_time_ms;
-            mul_time  += b.m_mlp_mul.m_exec_time_ms;
-            linear_time_ms += b.m_self_attn.m_query.m_exec_time_ms + b.m_self_attn.m_key.m_exec_time_ms + b.m_self_attn.m_value.m_exec_time_ms + b.m_self_attn.m_qkv_proj.m_exec_time_ms;
-            linear_time_ms += b.m_mlp_gate_proj.m_exec_time_ms + b.m_mlp_up_proj.m_exec_time_ms + b.m_mlp_down_proj.m_exec_time_ms;
+            // The fused qkv projection is timed by the query projection.
+            linear_time_ms += b.m_self_attn.m_query.m_exec_time_ms + b.m_self_attn.m_qkv_proj.m_exec_time_ms;
+            linear_time_ms += b.m_mlp.m_exec_time_ms + b.m_mlp.m_down_proj.m_exec_time_ms;
         }
 
-        non_linear_time_ms = emb_time + norm_time + res_time + rope_time + activ_time + mul_time;
+        non_linear_time_ms = emb_time + norm_time;
     }
     const int tot_inf_time_ms = linear_time_ms + attn_time_ms + non_linear_time_ms;
 
     const int total_tensor_mem_mb = Tensor::s_tensor_alloc_bytes / 1000000;
 
     int weights_mem_mb;
-    if (m_dtype.wdtype== kFloat16) { weights_mem_mb = zephyr_cfg.fp16_size_mb; }
+    if (m_dtype.wdtype == kFloat16 || m_dtype.wdtype == kBFloat16) { weights_mem_mb = zephyr_cfg.fp16_size_mb; }
     else if (m_dtype.wdtype== kQint8) { weights_mem_mb = zephyr_cfg.q8_size_mb; }
     else { weights_mem_mb = zephyr_cfg.q4_size_mb; }
 
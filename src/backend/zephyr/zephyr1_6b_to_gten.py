@@ -108,6 +108,13 @@ def write_layer(fout, name: str, w0: torch.Tensor, dtype: str):
         w0_bytes = w0.tobytes()
         fout.write(itob(len(w0_bytes)))
         fout.write(w0_bytes)
+    elif dtype == "bf16":
+        # numpy has no bf16 dtype so we write the bit patterns of the bf16 values.
+        w0 = w0.to(torch.bfloat16).view(torch.int16)
+        w0 = w0.numpy().flatten()
+        w0_bytes = w0.tobytes()
+        fout.write(itob(len(w0_bytes)))
+        fout.write(w0_bytes)
     elif dtype == "q8":
         assert w0.ndim == 2
         deltas, w0 = q8_quantize(w0)
@@ -222,7 +229,7 @@ def convert_model_to_gten(model_path, dtype):
 
 parser = argparse.ArgumentParser()
 parser.add_argument("mpath", help="Model path to be converted.")
-parser.add_argument("dtype", help="output dtype.", choices=("fp16", "q8", "q4"))
+parser.add_argument("dtype", help="output dtype.", choices=("fp16", "bf16", "q8", "q4"))
 
 args = parser.parse_args()
 convert_model_to_gten(args.mpath, args.dtype)
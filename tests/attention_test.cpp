@@ -0,0 +1,142 @@
+// Checks the streaming attention against a naive causal softmax attention computed in double
+// precision, for multi-head and grouped-query attention, prompts that span several pages of
+// the kv cache, new rows appended after a cached prefix (start_pos > 0) and each kv cache
+// dtype. The reference reads the queries, keys and values back from the tensors so it is
+// only off by the rounding of the attention itself and of the queries, which the attention
+// quantizes to q8 for the quantized caches.
+// Returns a non-zero exit code if any check fails.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include "gten/ops.h"
+#include "test_utils.h"
+
+
+using namespace gten;
+using namespace gten::test;
+
+// Returns the largest error of the rows of `out` [start_pos, n_ctx) relative to the rows
+// of the reference attention, which are scaled by their norm or by the norm of a typical
+// value row if they are smaller.
+static double attention_error(const Tensor& q, KVCache& cache, const Tensor& out, int n_heads, int start_pos)
+{
+    const int n_ctx = q.dimsize(0);
+    const int d_head = cache.d_head();
+    const int kv_heads = cache.n_heads();
+    const int heads_per_group = n_heads / kv_heads;
+    const double min_norm = 0.5 * std::sqrt(double(d_head));
+
+    // The keys and values of the positions of each kv head.
+    std::vector<std::vector<float>> keys(kv_heads * n_ctx);
+    std::vector<std::vector<float>> values(kv_heads * n_ctx);
+    for (int h = 0; h < kv_heads; h++) {
+        for (int pos = 0; pos < n_ctx; pos++) {
+            keys[h * n_ctx + pos] = read_cache_row(cache, /*keys=*/true, h, pos);
+            values[h * n_ctx + pos] = read_cache_row(cache, /*keys=*/false, h, pos);
+        }
+    }
+
+    double max_err = 0.0;
+    std::vector<double> scores(n_ctx);
+    std::vector<double> expected(d_head);
+    for (int r = start_pos; r < n_ctx; r++) {
+        const std::vector<float> q_row = tensor_row(q, r);
+        const std::vector<float> out_row = tensor_row(out, r);
+        for (int h = 0; h < n_heads; h++) {
+            const int kv_h = h / heads_per_group;
+
+            double max_score = -INFINITY;
+            for (int pos = 0; pos <= r; pos++) {
+                const float* k = keys[kv_h * n_ctx + pos].data();
+                double dot = 0.0;
+                for (int i = 0; i < d_head; i++) {
+                    dot += double(q_row[h * d_head + i]) * k[i];
+                }
+                scores[pos] = dot / std::sqrt(double(d_head));
+                max_score = std::max(max_score, scores[pos]);
+            }
+            double sum = 0.0;
+            for (int pos = 0; pos <= r; pos++) {
+                scores[pos] = std::exp(scores[pos] - max_score);
+                sum += scores[pos];
+            }
+
+            std::fill(expected.begin(), expected.end(), 0.0);
+            for (int pos = 0; pos <= r; pos++) {
+                const float* v = values[kv_h * n_ctx + pos].data();
+                for (int i = 0; i < d_head; i++) {
+                    expected[i] += scores[pos] / sum * v[i];
+                }
+            }
+
+            double diff_sq = 0.0;
+            double norm_sq = 0.0;
+            for (int i = 0; i < d_head; i++) {
+                const double d = out_row[h * d_head + i] - expected[i];
+                diff_sq += d * d;
+                norm_sq += expected[i] * expected[i];
+            }
+            max_err = std::max(max_err, std::sqrt(diff_sq) / std::max(std::sqrt(norm_sq), min_norm));
+        }
+    }
+    return max_err;
+}
+
+static void test_attention(Dtype dtype, Dtype kv_dtype, int n_ctx, int n_heads, int kv_heads, int d_head, int start_pos, float q_scale)
+{
+    KVCache cache{kv_heads, d_head, kv_dtype};
+    cache.reserve(n_ctx);
+    for (int pos = 0; pos < n_ctx; pos++) {
+        for (int h = 0; h < kv_heads; h++) {
+            for (bool keys : {true, false}) {
+                const std::vector<float> x = rand_floats(d_head, -1.0f, 1.0f);
+                write_row(x.data(), cache_row(cache, keys, h, pos), kv_dtype, d_head);
+            }
+        }
+    }
+    // Larger queries give sharper softmaxes whose max changes across the key tiles.
+    const Tensor q = rand_tensor(n_ctx, n_heads * d_head, dtype, -q_scale, q_scale);
+    Tensor out{{n_ctx, n_heads * d_head}, dtype};
+
+    ops::qkv_attn(q, cache, out, n_heads, start_pos);
+
+    // The queries and the output are rounded to q8 in the quantized configurations.
+    const bool quantized = dtype == kQint8 || kv_dtype == kQint8 || kv_dtype == kQint4;
+    const double tol = quantized ? 3e-2 : 1e-3;
+    char what[128];
+    std::snprintf(what, sizeof(what), "qkv_attn %s kv=%s n_ctx=%d heads=%d/%d d_head=%d start_pos=%d q_scale=%g",
+                  dtype_str(dtype), dtype_str(kv_dtype), n_ctx, n_heads, kv_heads, d_head, start_pos, q_scale);
+    check_err(what, attention_error(q, cache, out, n_heads, start_pos), tol);
+}
+
+int main()
+{
+    struct HeadConfig { int n_heads, kv_heads, d_head; };
+    // Multi-head, grouped-query and multi-query attention.
+    const HeadConfig head_configs[] = {{4, 4, 64}, {8, 2, 64}, {6, 1, 32}};
+
+    int n_tests = 0;
+    for (Dtype dtype : {kFloat16, kFloat32, kQint8}) {
+        for (Dtype kv_dtype : {kFloat16, kQint8, kQint4}) {
+            for (const HeadConfig& hc : head_configs) {
+                // Up to several pages of 64 positions and sizes that are not multiples of the
+                // attention row blocks and key tiles. The rows after a cached prefix are a
+                // prompt chunk (several row blocks) or a single decoded row.
+                for (int n_ctx : {1, 17, 64, 65, 130}) {
+                    for (int start_pos : {0, std::max(0, n_ctx - 20), n_ctx - 1}) {
+                        for (float q_scale : {1.0f, 8.0f}) {
+                            test_attention(dtype, kv_dtype, n_ctx, hc.n_heads, hc.kv_heads, hc.d_head, start_pos, q_scale);
+                            n_tests++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    std::printf("%d attention tests, %d failures\n", n_tests, g_n_failures);
+    return g_n_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,423 @@
+// Checks every kernel tier that is built and supported by the cpu against the scalar kernels
+// (and the math kernels against libm) on random inputs of many lengths, including lengths that
+// are not multiples of the vector widths so that the tail code of the kernels runs too.
+// Returns a non-zero exit code if any kernel does not match.
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "gten/kernels.h"
+#include "gten/quants.h"
+
+
+using namespace gten;
+
+static std::mt19937 g_rng{1234};
+static int g_n_failures = 0;
+
+static float rand_float(float lo, float hi)
+{
+    return std::uniform_real_distribution<float>{lo, hi}(g_rng);
+}
+
+static int rand_int(int lo, int hi)
+{
+    return std::uniform_int_distribution<int>{lo, hi}(g_rng);
+}
+
+static std::vector<float> rand_floats(int n, float lo, float hi)
+{
+    std::vector<float> v(n);
+    for (float& x : v) {
+        x = rand_float(lo, hi);
+    }
+    return v;
+}
+
+static std::vector<Q8Block> rand_q8_blocks(int n_blocks)
+{
+    std::vector<Q8Block> blocks(n_blocks);
+    for (Q8Block& blk : blocks) {
+        blk.delta = fp32_to_fp16(rand_float(0.001f, 0.05f));
+        for (int j = 0; j < globs::q8_block_size; j++) {
+            // The quantizers produce quants in [-127, 127].
+            blk.data[j] = static_cast<Qint8>(rand_int(-127, 127));
+        }
+    }
+    return blocks;
+}
+
+static std::vector<Q4Block> rand_q4_blocks(int n_blocks)
+{
+    std::vector<Q4Block> blocks(n_blocks);
+    for (Q4Block& blk : blocks) {
+        blk.delta = fp32_to_fp16(rand_float(0.001f, 0.05f));
+        for (int j = 0; j < globs::q4_block_size / 2; j++) {
+            blk.data[j] = static_cast<Qint8>(rand_int(0, 255));
+        }
+    }
+    return blocks;
+}
+
+// Returns the quant `j` of the given block as a signed int.
+static int q4_quant(const Q4Block& blk, int j)
+{
+    // The first 16 quants are in the higher 4 bits of the 16 bytes and the next 16 in the lower.
+    const int half = globs::q4_block_size / 2;
+    const uint8_t byte = static_cast<uint8_t>(blk.data[j % half]);
+    return (j < half ? byte >> 4 : byte & 0x0F) - 7;
+}
+
+// Reports a failure if `actual` differs from `expected` by more than `tol`.
+static void check(bool ok, const char* tier, const char* kernel, int size, double actual, double expected)
+{
+    if (!ok) {
+        g_n_failures++;
+        std::printf("FAIL %s %s size=%d: got %.9g expected %.9g\n", tier, kernel, size, actual, expected);
+    }
+}
+
+static void check_close(const char* tier, const char* kernel, int size, double actual, double expected, double tol)
+{
+    check(std::fabs(actual - expected) <= tol, tier, kernel, size, actual, expected);
+}
+
+// The fp dot products may only differ by the order in which the products are added, so the
+// tolerance is relative to the sum of the magnitudes of the products.
+static void test_fp_dots(const Kernels& k, const Kernels& ref, const char* tier, int n)
+{
+    const std::vector<float> a = rand_floats(n, -2.0f, 2.0f);
+    const std::vector<float> b = rand_floats(n, -2.0f, 2.0f);
+    std::vector<Float16> a16(n), b16(n);
+    std::vector<BFloat16> abf(n), bbf(n);
+    double abs_sum = 0.0;
+    for (int i = 0; i < n; i++) {
+        a16[i] = fp32_to_fp16(a[i]);
+        b16[i] = fp32_to_fp16(b[i]);
+        abf[i] = fp32_to_bf16(a[i]);
+        bbf[i] = fp32_to_bf16(b[i]);
+        abs_sum += std::fabs(a[i] * b[i]);
+    }
+    const double tol = 1e-5 * abs_sum + 1e-6;
+
+    check_close(tier, "vec_dot_product_f32", n, k.vec_dot_product_f32(a.data(), b.data(), n), ref.vec_dot_product_f32(a.data(), b.data(), n), tol);
+    check_close(tier, "vec_dot_product_f16", n, k.vec_dot_product_f16(a16.data(), b16.data(), n), ref.vec_dot_product_f16(a16.data(), b16.data(), n), tol);
+    check_close(tier, "vec_dot_product_f32_f16", n, k.vec_dot_product_f32_f16(a.data(), b16.data(), n), ref.vec_dot_product_f32_f16(a.data(), b16.data(), n), tol);
+    check_close(tier, "vec_dot_product_bf16", n, k.vec_dot_product_bf16(abf.data(), bbf.data(), n), ref.vec_dot_product_bf16(abf.data(), bbf.data(), n), tol);
+    check_close(tier, "vec_dot_product_f32_bf16", n, k.vec_dot_product_f32_bf16(a.data(), bbf.data(), n), ref.vec_dot_product_f32_bf16(a.data(), bbf.data(), n), tol);
+}
+
+// The block dot products are computed in integer arithmetic so the results may only differ by
+// the fp32 rounding of the scaled block sums.
+static double q8_dot_tol(const Q8Block* a, const Q8Block* b, int n_blocks)
+{
+    double abs_sum = 0.0;
+    for (int i = 0; i < n_blocks; i++) {
+        int block_abs_sum = 0;
+        for (int j = 0; j < globs::q8_block_size; j++) {
+            block_abs_sum += std::abs(a[i].data[j] * b[i].data[j]);
+        }
+        abs_sum += fp16_to_fp32(a[i].delta) * fp16_to_fp32(b[i].delta) * block_abs_sum;
+    }
+    return 1e-5 * abs_sum + 1e-6;
+}
+
+static double q4_dot_tol(const Q8Block* a, const Q4Block* b, int n_blocks)
+{
+    double abs_sum = 0.0;
+    for (int i = 0; i < n_blocks; i++) {
+        int block_abs_sum = 0;
+        for (int j = 0; j < globs::q4_block_size; j++) {
+            block_abs_sum += std::abs(a[i].data[j] * q4_quant(b[i], j));
+        }
+        abs_sum += fp16_to_fp32(a[i].delta) * fp16_to_fp32(b[i].delta) * block_abs_sum;
+    }
+    return 1e-5 * abs_sum + 1e-6;
+}
+
+static void test_quant_dots(const Kernels& k, const Kernels& ref, const char* tier, int n_blocks)
+{
+    const int n = n_blocks * globs::q8_block_size;
+    const std::vector<Q8Block> a = rand_q8_blocks(n_blocks);
+    const std::vector<Q8Block> b = rand_q8_blocks(n_blocks);
+    const std::vector<Q4Block> c = rand_q4_blocks(n_blocks);
+
+    check_close(tier, "vec_dot_product_q8", n, k.vec_dot_product_q8(a.data(), b.data(), n), ref.vec_dot_product_q8(a.data(), b.data(), n), q8_dot_tol(a.data(), b.data(), n_blocks));
+    check_close(tier, "vec_dot_product_q8_q4", n, k.vec_dot_product_q8_q4(a.data(), c.data(), n), ref.vec_dot_product_q8_q4(a.data(), c.data(), n), q4_dot_tol(a.data(), c.data(), n_blocks));
+
+    if (!k.vec_dot_product_q8_packed || !k.vec_dot_product_q8_q4_packed) {
+        return;
+    }
+
+    // A row group of random rows, of which we compute the dot products over a random range of
+    // the blocks as the split-K matmul does.
+    const int n_rows = globs::q_pack_rows;
+    const std::vector<Q8Block> b_rows = rand_q8_blocks(n_rows * n_blocks);
+    const std::vector<Q4Block> c_rows = rand_q4_blocks(n_rows * n_blocks);
+    std::vector<uint8_t> b_group(ops::q8_packed_group_nbytes(n_blocks) + globs::q_pack_align);
+    std::vector<uint8_t> c_group(ops::q4_packed_group_nbytes(n_blocks) + globs::q_pack_align);
+    // The kernels rely on the alignment of the row groups.
+    uint8_t* b_group_data = b_group.data() + (globs::q_pack_align - reinterpret_cast<uintptr_t>(b_group.data()) % globs::q_pack_align);
+    uint8_t* c_group_data = c_group.data() + (globs::q_pack_align - reinterpret_cast<uintptr_t>(c_group.data()) % globs::q_pack_align);
+    ops::q8_pack_row_group(b_rows.data(), b_group_data, n);
+    ops::q4_pack_row_group(c_rows.data(), c_group_data, n);
+
+    const int blk0 = rand_int(0, n_blocks - 1);
+    const int blk1 = rand_int(blk0 + 1, n_blocks);
+    const int range_size = (blk1 - blk0) * globs::q8_block_size;
+    float q8_actual[n_rows];
+    float q4_actual[n_rows];
+    k.vec_dot_product_q8_packed(a.data() + blk0, ops::q_packed_group_deltas(b_group_data, blk0), ops::q8_packed_group_quants(b_group_data, n_blocks, blk0), q8_actual, range_size);
+    k.vec_dot_product_q8_q4_packed(a.data() + blk0, ops::q_packed_group_deltas(c_group_data, blk0), ops::q4_packed_group_quants(c_group_data, n_blocks, blk0), q4_actual, range_size);
+    for (int r = 0; r < n_rows; r++) {
+        const Q8Block* b_row = b_rows.data() + r * n_blocks + blk0;
+        const Q4Block* c_row = c_rows.data() + r * n_blocks + blk0;
+        check_close(tier, "vec_dot_product_q8_packed", range_size, q8_actual[r], ref.vec_dot_product_q8(a.data() + blk0, b_row, range_size), q8_dot_tol(a.data() + blk0, b_row, blk1 - blk0));
+        check_close(tier, "vec_dot_product_q8_q4_packed", range_size, q4_actual[r], ref.vec_dot_product_q8_q4(a.data() + blk0, c_row, range_size), q4_dot_tol(a.data() + blk0, c_row, blk1 - blk0));
+    }
+}
+
+// The quantizers may round the deltas and quants differently from the scalar ones, but the
+// dequantized rows must be within a quantization step of the input. The dequantizers and the
+// dtype conversions must be exact.
+static void test_conversions(const Kernels& k, const Kernels& ref, const char* tier, int n_blocks)
+{
+    const int n = n_blocks * globs::q8_block_size;
+    const std::vector<float> x = rand_floats(n, -4.0f, 4.0f);
+
+    std::vector<Q8Block> q8(n_blocks), q8_ref(n_blocks);
+    std::vector<Q4Block> q4(n_blocks), q4_ref(n_blocks);
+    std::vector<float> out(n), out_ref(n);
+    k.q8_quantize_row(x.data(), q8.data(), n);
+    ref.q8_quantize_row(x.data(), q8_ref.data(), n);
+    k.q8_dequantize_row(q8.data(), out.data(), n);
+    ref.q8_dequantize_row(q8.data(), out_ref.data(), n);
+    for (int i = 0; i < n; i++) {
+        const float step = fp16_to_fp32(q8_ref[i / globs::q8_block_size].delta);
+        check(out[i] == out_ref[i], tier, "q8_dequantize_row", n, out[i], out_ref[i]);
+        check_close(tier, "q8_quantize_row", n, out[i], x[i], step * 1.01f);
+    }
+    k.q4_quantize_row(x.data(), q4.data(), n);
+    ref.q4_quantize_row(x.data(), q4_ref.data(), n);
+    k.q4_dequantize_row(q4.data(), out.data(), n);
+    ref.q4_dequantize_row(q4.data(), out_ref.data(), n);
+    for (int i = 0; i < n; i++) {
+        const float step = fp16_to_fp32(q4_ref[i / globs::q4_block_size].delta);
+        check(out[i] == out_ref[i], tier, "q4_dequantize_row", n, out[i], out_ref[i]);
+        check_close(tier, "q4_quantize_row", n, out[i], x[i], step * 1.01f);
+    }
+
+    // Any length for the fp conversions.
+    const int m = n - rand_int(0, globs::q8_block_size - 1);
+    std::vector<Float16> h(m), h_ref(m);
+    std::vector<BFloat16> bf(m), bf_ref(m);
+    k.fp32_to_fp16_row(x.data(), h.data(), m);
+    ref.fp32_to_fp16_row(x.data(), h_ref.data(), m);
+    k.fp32_to_bf16_row(x.data(), bf.data(), m);
+    ref.fp32_to_bf16_row(x.data(), bf_ref.data(), m);
+    for (int i = 0; i < m; i++) {
+        check(fp16_to_fp32(h[i]) == fp16_to_fp32(h_ref[i]), tier, "fp32_to_fp16_row", m, fp16_to_fp32(h[i]), fp16_to_fp32(h_ref[i]));
+        check(bf16_to_fp32(bf[i]) == bf16_to_fp32(bf_ref[i]), tier, "fp32_to_bf16_row", m, bf16_to_fp32(bf[i]), bf16_to_fp32(bf_ref[i]));
+    }
+    k.fp16_to_fp32_row(h_ref.data(), out.data(), m);
+    ref.fp16_to_fp32_row(h_ref.data(), out_ref.data(), m);
+    for (int i = 0; i < m; i++) {
+        check(out[i] == out_ref[i], tier, "fp16_to_fp32_row", m, out[i], out_ref[i]);
+    }
+    k.bf16_to_fp32_row(bf_ref.data(), out.data(), m);
+    ref.bf16_to_fp32_row(bf_ref.data(), out_ref.data(), m);
+    for (int i = 0; i < m; i++) {
+        check(out[i] == out_ref[i], tier, "bf16_to_fp32_row", m, out[i], out_ref[i]);
+    }
+}
+
+static void test_elementwise(const Kernels& k, const Kernels& ref, const char* tier, int n)
+{
+    const std::vector<float> a = rand_floats(n, -4.0f, 4.0f);
+    const std::vector<float> b = rand_floats(n, -4.0f, 4.0f);
+    std::vector<float> out(n), out_ref(n);
+
+    k.vec_add_f32(a.data(), b.data(), out.data(), n);
+    ref.vec_add_f32(a.data(), b.data(), out_ref.data(), n);
+    for (int i = 0; i < n; i++) {
+        check(out[i] == out_ref[i], tier, "vec_add_f32", n, out[i], out_ref[i]);
+    }
+
+    out = a;
+    out_ref = a;
+    k.vec_scale_f32(out.data(), 0.37f, n);
+    ref.vec_scale_f32(out_ref.data(), 0.37f, n);
+    for (int i = 0; i < n; i++) {
+        check(out[i] == out_ref[i], tier, "vec_scale_f32", n, out[i], out_ref[i]);
+    }
+
+    // The rotation of a head of 2 * n elements.
+    std::vector<float> x = rand_floats(2 * n, -4.0f, 4.0f);
+    std::vector<float> x_ref = x;
+    std::vector<float> cos(n), sin(n);
+    for (int j = 0; j < n; j++) {
+        const float angle = rand_float(-100.0f, 100.0f);
+        cos[j] = std::cos(angle);
+        sin[j] = std::sin(angle);
+    }
+    k.vec_rope_f32(x.data(), cos.data(), sin.data(), n);
+    ref.vec_rope_f32(x_ref.data(), cos.data(), sin.data(), n);
+    for (int i = 0; i < 2 * n; i++) {
+        check_close(tier, "vec_rope_f32", n, x[i], x_ref[i], 1e-5);
+    }
+
+    std::vector<Float16> weight(n), bias(n);
+    for (int i = 0; i < n; i++) {
+        weight[i] = fp32_to_fp16(rand_float(-2.0f, 2.0f));
+        bias[i] = fp32_to_fp16(rand_float(-1.0f, 1.0f));
+    }
+    k.vec_norm_f32(a.data(), weight.data(), bias.data(), 0.25f, 0.8f, out.data(), n);
+    ref.vec_norm_f32(a.data(), weight.data(), bias.data(), 0.25f, 0.8f, out_ref.data(), n);
+    for (int i = 0; i < n; i++) {
+        check_close(tier, "vec_norm_f32", n, out[i], out_ref[i], 1e-5);
+    }
+    k.vec_norm_f32(a.data(), weight.data(), nullptr, 0.0f, 0.8f, out.data(), n);
+    ref.vec_norm_f32(a.data(), weight.data(), nullptr, 0.0f, 0.8f, out_ref.data(), n);
+    for (int i = 0; i < n; i++) {
+        check_close(tier, "vec_norm_f32 (no bias)", n, out[i], out_ref[i], 1e-5);
+    }
+
+    double abs_sum = 0.0;
+    double sq_sum = 0.0;
+    for (int i = 0; i < n; i++) {
+        abs_sum += std::fabs(a[i]);
+        sq_sum += (a[i] - 0.5) * (a[i] - 0.5);
+    }
+    check(k.vec_max_f32(a.data(), n) == ref.vec_max_f32(a.data(), n), tier, "vec_max_f32", n, k.vec_max_f32(a.data(), n), ref.vec_max_f32(a.data(), n));
+    check_close(tier, "vec_sum_f32", n, k.vec_sum_f32(a.data(), n), ref.vec_sum_f32(a.data(), n), 1e-5 * abs_sum + 1e-6);
+    check_close(tier, "vec_sum_squares_f32", n, k.vec_sum_squares_f32(a.data(), 0.5f, n), ref.vec_sum_squares_f32(a.data(), 0.5f, n), 1e-5 * sq_sum + 1e-6);
+}
+
+// The weighted sums may only differ by the rounding of a fused multiply-add.
+static void check_axpy(const char* tier, const char* kernel, int n, const std::vector<float>& acc0, const std::vector<float>& out, const std::vector<float>& out_ref)
+{
+    for (int i = 0; i < n; i++) {
+        check_close(tier, kernel, n, out[i], out_ref[i], 1e-6 * (std::fabs(acc0[i]) + std::fabs(out_ref[i] - acc0[i])) + 1e-7);
+    }
+}
+
+static void test_weighted_sums(const Kernels& k, const Kernels& ref, const char* tier, int n_blocks)
+{
+    const int n = n_blocks * globs::q8_block_size;
+    const std::vector<float> acc0 = rand_floats(n, -4.0f, 4.0f);
+    const float w = rand_float(0.0f, 1.0f);
+    const std::vector<Q8Block> q8 = rand_q8_blocks(n_blocks);
+    const std::vector<Q4Block> q4 = rand_q4_blocks(n_blocks);
+    std::vector<float> out, out_ref;
+
+    out = out_ref = acc0;
+    k.vec_axpy_q8(w, q8.data(), out.data(), n);
+    ref.vec_axpy_q8(w, q8.data(), out_ref.data(), n);
+    check_axpy(tier, "vec_axpy_q8", n, acc0, out, out_ref);
+
+    out = out_ref = acc0;
+    k.vec_axpy_q4(w, q4.data(), out.data(), n);
+    ref.vec_axpy_q4(w, q4.data(), out_ref.data(), n);
+    check_axpy(tier, "vec_axpy_q4", n, acc0, out, out_ref);
+
+    // Any length for the fp16 rows.
+    const int m = n - rand_int(0, globs::q8_block_size - 1);
+    std::vector<Float16> x(m);
+    for (Float16& v : x) {
+        v = fp32_to_fp16(rand_float(-4.0f, 4.0f));
+    }
+    out = out_ref = acc0;
+    k.vec_axpy_f16(w, x.data(), out.data(), m);
+    ref.vec_axpy_f16(w, x.data(), out_ref.data(), m);
+    check_axpy(tier, "vec_axpy_f16", m, acc0, out, out_ref);
+    // The elements past the row are left as they are.
+    for (int i = m; i < n; i++) {
+        check(out[i] == acc0[i], tier, "vec_axpy_f16 (past the row)", m, out[i], acc0[i]);
+    }
+}
+
+// The SIMD tiers compute exp with a polynomial approximation, so the math kernels are checked
+// against libm over the range of the softmax inputs (x - max <= 0) and of the silu inputs. The
+// results that are about the size of the smallest normal float may be flushed to zero.
+static void test_math(const Kernels& k, const char* tier, int n)
+{
+    const float tol = 2e-6f;
+    const float min_normal = 2.0f * std::numeric_limits<float>::min();
+    const std::vector<float> x = rand_floats(n, -90.0f, 20.0f);
+    // exp(-x) overflows in libm near x = -88, which rounds the silu to 0.
+    const std::vector<float> silu_x = rand_floats(n, -80.0f, 20.0f);
+    const std::vector<float> up = rand_floats(n, -4.0f, 4.0f);
+    const float shift = rand_float(0.0f, 20.0f);
+
+    std::vector<float> e = x;
+    const float sum = k.vec_exp_sum_f32(e.data(), shift, n);
+    double sum_expected = 0.0;
+    for (int i = 0; i < n; i++) {
+        const float expected = std::exp(x[i] - shift);
+        sum_expected += expected;
+        check_close(tier, "vec_exp_sum_f32", n, e[i], expected, tol * expected + min_normal);
+    }
+    // The sum is also off by the rounding of the fp32 additions.
+    check_close(tier, "vec_exp_sum_f32 (sum)", n, sum, sum_expected, 1e-5 * sum_expected + min_normal);
+
+    std::vector<float> silu(n), silu_mul(n);
+    k.vec_silu_f32(silu_x.data(), silu.data(), n);
+    k.vec_silu_mul_f32(silu_x.data(), up.data(), silu_mul.data(), n);
+    for (int i = 0; i < n; i++) {
+        const float expected = silu_x[i] / (1.0f + std::exp(-silu_x[i]));
+        check_close(tier, "vec_silu_f32", n, silu[i], expected, tol * std::fabs(expected) + min_normal);
+        check_close(tier, "vec_silu_mul_f32", n, silu_mul[i], expected * up[i], tol * std::fabs(expected * up[i]) + min_normal);
+    }
+}
+
+int main()
+{
+    const Kernels& ref = *tier_kernels(KernelTier::Scalar);
+
+    // Every length up to a few times the widest vectors and some larger ones.
+    std::vector<int> sizes;
+    for (int n = 1; n <= 160; n++) {
+        sizes.push_back(n);
+    }
+    for (int n : {255, 256, 257, 1000, 2048, 4099}) {
+        sizes.push_back(n);
+    }
+    std::vector<int> block_counts;
+    for (int n_blocks = 1; n_blocks <= 24; n_blocks++) {
+        block_counts.push_back(n_blocks);
+    }
+    for (int n_blocks : {63, 64, 65, 171}) {
+        block_counts.push_back(n_blocks);
+    }
+
+    int n_tested_tiers = 0;
+    for (int t = static_cast<int>(KernelTier::Scalar); t <= static_cast<int>(KernelTier::AVX512BF16); t++) {
+        const KernelTier tier = static_cast<KernelTier>(t);
+        const char* tier_name = kernel_tier_str(tier);
+        const Kernels* k = tier_kernels(tier);
+        if (!k) {
+            std::printf("skip %s (not built or not supported by the cpu)\n", tier_name);
+            continue;
+        }
+        const int n_failures = g_n_failures;
+        for (int n : sizes) {
+            test_fp_dots(*k, ref, tier_name, n);
+            test_elementwise(*k, ref, tier_name, n);
+            test_math(*k, tier_name, n);
+        }
+        for (int n_blocks : block_counts) {
+            test_quant_dots(*k, ref, tier_name, n_blocks);
+            test_conversions(*k, ref, tier_name, n_blocks);
+            test_weighted_sums(*k, ref, tier_name, n_blocks);
+        }
+        std::printf("%s %s\n", g_n_failures == n_failures ? "ok" : "FAILED", tier_name);
+        n_tested_tiers++;
+    }
+
+    std::printf("%d tiers tested, %d failures\n", n_tested_tiers, g_n_failures);
+    return g_n_failures == 0 ? 0 : 1;
+}
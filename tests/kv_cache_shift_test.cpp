@@ -0,0 +1,226 @@
+// Checks the context shift. The op test fills a kv cache with keys rotated at their positions
+// and checks that, after the shift, the moved keys match the same keys rotated directly at
+// their new positions, the moved values are unchanged and the sink positions are untouched.
+// The inference test runs the generation loop of perform_inference past the context size with
+// a model that mirrors its kv cache with the token ids and checks that the positions fed to
+// the model and the shifts match the tokens of the context.
+// Returns a non-zero exit code if any check fails.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "api.h"
+#include "test_utils.h"
+
+
+using namespace gten;
+using namespace gten::test;
+
+// Rotates the heads of a row of `n_heads` keys for position `pos`.
+static void rotate_keys(float* row, int n_heads, const RopeTable& rope, int pos)
+{
+    for (int h = 0; h < n_heads; h++) {
+        kernels().vec_rope_f32(row + h * rope.d_head(), rope.cos(pos), rope.sin(pos), rope.rope_d_head() / 2);
+    }
+}
+
+static void test_shift_op(Dtype dtype, float rope_pct, int n_past, int n_keep, int n_discard)
+{
+    const int n_heads = 4;
+    const int d_head = 64;
+    const RopeTable rope{d_head, rope_pct, n_past};
+
+    // The unrotated keys and the values of each position.
+    std::vector<std::vector<float>> keys(n_past);
+    std::vector<std::vector<float>> values(n_past);
+    KVCache cache{n_heads, d_head, dtype};
+    cache.reserve(n_past);
+    for (int pos = 0; pos < n_past; pos++) {
+        keys[pos] = rand_floats(n_heads * d_head, -1.0f, 1.0f);
+        values[pos] = rand_floats(n_heads * d_head, -1.0f, 1.0f);
+        std::vector<float> rotated = keys[pos];
+        rotate_keys(rotated.data(), n_heads, rope, pos);
+        for (int h = 0; h < n_heads; h++) {
+            write_row(rotated.data() + h * d_head, cache_row(cache, /*keys=*/true, h, pos), dtype, d_head);
+            write_row(values[pos].data() + h * d_head, cache_row(cache, /*keys=*/false, h, pos), dtype, d_head);
+        }
+    }
+    // The rows before the shift, to compare the bytes of the rows that must not change.
+    const int row_nbytes = cache.k_page(0).bstride(1);
+    auto row_bytes = [&](bool keys, int h, int pos) {
+        const char* row = cache_row(cache, keys, h, pos);
+        return std::vector<char>(row, row + row_nbytes);
+    };
+    std::vector<std::vector<char>> k_before, v_before;
+    for (int pos = 0; pos < n_past; pos++) {
+        for (int h = 0; h < n_heads; h++) {
+            k_before.push_back(row_bytes(true, h, pos));
+            v_before.push_back(row_bytes(false, h, pos));
+        }
+    }
+
+    ops::kv_cache_shift(cache, n_keep, n_discard, n_past, rope);
+
+    char what[128];
+    std::snprintf(what, sizeof(what), "kv_cache_shift %s rope_pct=%g n_past=%d n_keep=%d n_discard=%d",
+                  dtype_str(dtype), rope_pct, n_past, n_keep, n_discard);
+    // The keys are requantized after they are rotated back, which adds up to a quantization
+    // step to each element.
+    const double tol = dtype == kFloat16 ? 2e-3 : (dtype == kQint8 ? 2e-2 : 0.25);
+    double max_key_err = 0.0;
+    int n_changed_rows = 0;
+    for (int pos = 0; pos < n_past - n_discard; pos++) {
+        const int src_pos = pos < n_keep ? pos : pos + n_discard;
+        std::vector<float> expected = keys[src_pos];
+        rotate_keys(expected.data(), n_heads, rope, pos);
+        for (int h = 0; h < n_heads; h++) {
+            const bool same_values = row_bytes(false, h, pos) == v_before[src_pos * n_heads + h];
+            const bool same_sink_keys = pos >= n_keep || row_bytes(true, h, pos) == k_before[src_pos * n_heads + h];
+            n_changed_rows += !same_values + !same_sink_keys;
+
+            const std::vector<float> k = read_cache_row(cache, /*keys=*/true, h, pos);
+            double diff_sq = 0.0;
+            double norm_sq = 0.0;
+            for (int i = 0; i < d_head; i++) {
+                const double d = k[i] - expected[h * d_head + i];
+                diff_sq += d * d;
+                norm_sq += double(expected[h * d_head + i]) * expected[h * d_head + i];
+            }
+            max_key_err = std::max(max_key_err, std::sqrt(diff_sq / norm_sq));
+        }
+    }
+    check_err(what, max_key_err, tol);
+    // The values and the sink keys must be moved (or left) as they are.
+    check_err(what, n_changed_rows, 0);
+}
+
+
+// A model whose kv cache holds the ids of the tokens fed to it, which checks that each call
+// feeds the tokens after the cached ones and that the shifts evict cached positions.
+class ShiftCheckModel : public Model {
+public:
+    static const int kVocabSize = 64;
+    std::vector<int> m_cache;
+    std::vector<int> m_prompt;
+    int m_n_shifts = 0;
+    int m_n_errors = 0;
+
+public:
+    explicit ShiftCheckModel(int n_ctx) : Model(n_ctx, n_ctx) {}
+
+    Tensor logits(const Tensor& tokens, const int start_pos) override {
+        const int n_ctx = tokens.numel();
+        const int* tokens_data = tokens.data_ptr<int>();
+        expect(n_ctx <= m_max_inference_ctx, "more tokens than the context size were fed");
+        expect(start_pos == int(m_cache.size()), "the tokens fed do not start after the cached ones");
+        for (int i = 0; i < std::min(start_pos, n_ctx); i++) {
+            expect(tokens_data[i] == m_cache[i], "the cached tokens do not match the context");
+        }
+        // The sink tokens are the start of the prompt.
+        const int n_keep = std::min(m_n_sink_tokens, m_max_inference_ctx / 2);
+        for (int i = 0; i < std::min({n_keep, n_ctx, int(m_prompt.size())}); i++) {
+            expect(tokens_data[i] == m_prompt[i], "the sink tokens were evicted");
+        }
+        m_cache.assign(tokens_data, tokens_data + n_ctx);
+
+        Tensor logits{{kVocabSize}, kFloat32};
+        std::fill(logits.data_ptr<float>(), logits.data_ptr<float>() + kVocabSize, 0.0f);
+        return logits;
+    }
+
+    void reset_kv_cache() override { m_cache.clear(); }
+
+    void shift_kv_cache(int n_keep, int n_discard, int n_past) override {
+        expect(n_past == int(m_cache.size()), "the shift does not cover the cached positions");
+        expect(n_keep >= 0 && n_discard > 0 && n_keep + n_discard <= n_past, "the shift evicts positions outside the cache");
+        if (n_keep >= 0 && n_discard > 0 && n_keep + n_discard <= int(m_cache.size())) {
+            m_cache.erase(m_cache.begin() + n_keep, m_cache.begin() + n_keep + n_discard);
+        }
+        m_n_shifts++;
+    }
+
+    void load_from_ckpt(std::ifstream&) override {}
+    void print_perf(const int) override {}
+
+private:
+    void expect(bool ok, const char* msg) {
+        if (!ok && m_n_errors++ == 0) {
+            std::printf("ShiftCheckModel: %s\n", msg);
+        }
+    }
+};
+
+class FixedTokenizer : public Tokenizer {
+public:
+    std::vector<int> m_prompt;
+
+public:
+    explicit FixedTokenizer(const std::vector<int>& prompt)
+        : Tokenizer(ShiftCheckModel::kVocabSize, /*eos_token=*/-1, "", "", {}, {}), m_prompt{prompt} {}
+
+    const char* decode(int, int) override { return "x"; }
+    std::vector<int> encode(std::string&) override { return m_prompt; }
+};
+
+static void test_shift_inference(int n_ctx, int n_prompt, int max_new_tokens)
+{
+    std::vector<int> prompt(n_prompt);
+    for (int i = 0; i < n_prompt; i++) {
+        prompt[i] = (i * 7 + 3) % ShiftCheckModel::kVocabSize;
+    }
+    ShiftCheckModel model{n_ctx};
+    model.m_prompt = prompt;
+    FixedTokenizer tokenizer{prompt};
+    InferencePackage pkg{&model, &tokenizer, "test", max_new_tokens};
+
+    int n_pieces = 0;
+    std::string last_piece;
+    std::string text = "";
+    perform_inference(&pkg, text, [&](const char* piece) {
+        n_pieces++;
+        last_piece = piece;
+    });
+
+    char what[128];
+    std::snprintf(what, sizeof(what), "perform_inference n_ctx=%d n_prompt=%d max_new_tokens=%d", n_ctx, n_prompt, max_new_tokens);
+    check_err(what, model.m_n_errors, 0);
+    // The generation stops after `max_new_tokens` with an end of text.
+    check_err(what, std::abs(n_pieces - (max_new_tokens + 1)), 0);
+    check_err(what, last_piece != "<endoftext>", 0);
+    // The context is shifted each time it fills up.
+    if (max_new_tokens > n_ctx) {
+        check_err(what, model.m_n_shifts == 0, 0);
+    }
+}
+
+int main()
+{
+    int n_tests = 0;
+    for (Dtype dtype : {kFloat16, kQint8, kQint4}) {
+        // Full and partial (25%) rotary embeddings.
+        for (float rope_pct : {1.0f, 0.25f}) {
+            // Shifts within a page, across pages, without sink tokens and of all but the sinks.
+            test_shift_op(dtype, rope_pct, 64, 4, 30);
+            test_shift_op(dtype, rope_pct, 200, 4, 98);
+            test_shift_op(dtype, rope_pct, 130, 0, 1);
+            test_shift_op(dtype, rope_pct, 300, 4, 296);
+            n_tests += 4;
+        }
+    }
+
+    for (int n_ctx : {8, 33, 100}) {
+        // Prompts shorter than, as long as and longer than the context.
+        for (int n_prompt : {3, n_ctx, 2 * n_ctx + 5}) {
+            for (int max_new_tokens : {1, n_ctx / 2, 3 * n_ctx}) {
+                test_shift_inference(n_ctx, n_prompt, max_new_tokens);
+                n_tests++;
+            }
+        }
+    }
+
+    std::printf("%d context shift tests, %d failures\n", n_tests, g_n_failures);
+    return g_n_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,143 @@
+// Checks the matmul against a naive matmul computed in double precision under several thread
+// counts. The thread count decides how the matmul is partitioned: the output columns alone
+// when there are enough of them, and otherwise also the input rows (2D tiles, in prefill) or
+// the reduction (split-K, in decode). The shapes include small outputs which trigger both,
+// prompt chunks longer than the matmul row chunk and rows after a cached prefix, for the
+// GEMV, GEMM and packed matmuls of q8 and q4 weights and for fp16 weights.
+// Returns a non-zero exit code if any check fails.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include "gten/ops.h"
+#include "gten/thread_pool.h"
+#include "test_utils.h"
+
+
+using namespace gten;
+using namespace gten::test;
+
+// Returns an input row as the dot products see it: the matmul quantizes the fp32 inputs of
+// the quantized weights to q8.
+static std::vector<float> matmul_inp_row(const Tensor& inp, int r, Dtype w_dtype)
+{
+    std::vector<float> row = tensor_row(inp, r);
+    if (inp.dtype() == kFloat32 && (w_dtype == kQint8 || w_dtype == kQint4)) {
+        std::vector<Q8Block> q8(row.size() / globs::q8_block_size);
+        write_row(row.data(), q8.data(), kQint8, row.size());
+        read_row(q8.data(), kQint8, row.data(), row.size());
+    }
+    return row;
+}
+
+// Returns the largest error of the output rows [start_pos, n_ctx), relative to the sum of the
+// magnitudes of the products of each dot product since the matmuls may only differ by the
+// order in which they add them up.
+static double matmul_error(const Tensor& inp, const Tensor& w, const Tensor& bias, const Tensor& residual, const Tensor& out, int start_pos)
+{
+    const int n_ctx = inp.dimsize(0);
+    const int d_out = w.dimsize(0);
+    const int n_embd = w.dimsize(1);
+
+    std::vector<std::vector<float>> w_rows(d_out);
+    for (int c = 0; c < d_out; c++) {
+        w_rows[c] = tensor_row(w, c);
+    }
+    const std::vector<float> bias_row = tensor_row(bias.view({1, d_out}), 0);
+
+    double max_err = 0.0;
+    for (int r = start_pos; r < n_ctx; r++) {
+        const std::vector<float> x = matmul_inp_row(inp, r, w.dtype());
+        const std::vector<float> res_row = tensor_row(residual, r);
+        const std::vector<float> out_row = tensor_row(out, r);
+        for (int c = 0; c < d_out; c++) {
+            double dot = 0.0;
+            double abs_sum = 0.0;
+            for (int i = 0; i < n_embd; i++) {
+                dot += double(x[i]) * w_rows[c][i];
+                abs_sum += std::fabs(double(x[i]) * w_rows[c][i]);
+            }
+            const double expected = dot + bias_row[c] + res_row[c];
+            max_err = std::max(max_err, std::fabs(out_row[c] - expected) / (abs_sum + 1.0));
+        }
+    }
+    return max_err;
+}
+
+struct MatmulShape {
+    int n_ctx;
+    int start_pos;
+    int d_out;
+    int n_embd;
+};
+
+static void test_matmul(Dtype inp_dtype, Dtype w_dtype, bool packed, const MatmulShape& shape, int n_threads)
+{
+    const Tensor inp = rand_tensor(shape.n_ctx, shape.n_embd, inp_dtype, -1.0f, 1.0f);
+    Tensor w = rand_tensor(shape.d_out, shape.n_embd, w_dtype, -1.0f, 1.0f);
+    const Tensor bias = rand_tensor(1, shape.d_out, kFloat16, -1.0f, 1.0f).view({shape.d_out});
+    const Tensor residual = rand_tensor(shape.n_ctx, shape.d_out, kFloat32, -1.0f, 1.0f);
+    const Tensor w_ref = w;
+    if (packed) {
+        w = ops::pack_weight(w);
+        if (!w.is_packed()) {
+            // The kernels of the cpu do not support the packed layout.
+            return;
+        }
+    }
+
+    Tensor out{{shape.n_ctx, shape.d_out}, kFloat32};
+    ops::MatmulEpilogue epilogue;
+    epilogue.bias = &bias;
+    epilogue.residual = &residual;
+    ops::matmul_2d(inp, w, out, shape.start_pos, epilogue);
+
+    char what[160];
+    std::snprintf(what, sizeof(what), "matmul_2d %s x %s%s n_ctx=%d start_pos=%d d_out=%d n_embd=%d threads=%d",
+                  dtype_str(inp_dtype), dtype_str(w_dtype), packed ? " (packed)" : "", shape.n_ctx, shape.start_pos,
+                  shape.d_out, shape.n_embd, n_threads);
+    check_err(what, matmul_error(inp, w_ref, bias, residual, out, shape.start_pos), 1e-5);
+}
+
+int main()
+{
+    // Decode rows, prompt chunks and a prompt longer than the matmul row chunk (64 rows), with
+    // outputs of one to seventeen packed row groups and inputs of 3 and 33 blocks.
+    const MatmulShape shapes[] = {
+        {1, 0, 8, 1056},
+        {1, 0, 40, 1056},
+        {1, 0, 136, 96},
+        {6, 5, 16, 1056},
+        {9, 0, 16, 1056},
+        {70, 0, 40, 96},
+        {70, 3, 136, 1056},
+    };
+    struct MatmulDtypes { Dtype inp_dtype, w_dtype; };
+    const MatmulDtypes dtypes[] = {
+        {kQint8, kQint8}, {kFloat32, kQint8}, {kQint8, kQint4}, {kFloat32, kQint4}, {kFloat16, kFloat16},
+    };
+
+    int n_tests = 0;
+    for (int n_threads : {1, 2, 3, 8, 16}) {
+        ThreadPoolConfig config;
+        config.n_threads = n_threads;
+        configure_thread_pool(config);
+        for (const MatmulDtypes& dt : dtypes) {
+            const bool quantized = dt.w_dtype == kQint8 || dt.w_dtype == kQint4;
+            for (bool packed : {false, true}) {
+                if (packed && !quantized) {
+                    continue;
+                }
+                for (const MatmulShape& shape : shapes) {
+                    test_matmul(dt.inp_dtype, dt.w_dtype, packed, shape, n_threads);
+                    n_tests++;
+                }
+            }
+        }
+    }
+
+    std::printf("%d matmul tests, %d failures\n", n_tests, g_n_failures);
+    return g_n_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,110 @@
+// Helpers shared by the op tests: random data, conversions of rows to and from the tensor
+// dtypes and a count of the failed checks.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "gten/kernels.h"
+#include "gten/kv_cache.h"
+#include "gten/tensor.h"
+#include "gten/utils.h"
+
+
+namespace gten {
+namespace test {
+
+inline std::mt19937 g_rng{1234};
+inline int g_n_failures = 0;
+
+inline float rand_float(float lo, float hi)
+{
+    return std::uniform_real_distribution<float>{lo, hi}(g_rng);
+}
+
+inline std::vector<float> rand_floats(int n, float lo, float hi)
+{
+    std::vector<float> v(n);
+    for (float& x : v) {
+        x = rand_float(lo, hi);
+    }
+    return v;
+}
+
+// Writes the fp32 row `x` of `n` elements to `out` in the given dtype, quantizing or
+// rounding it like the ops do.
+inline void write_row(const float* x, void* out, Dtype dtype, int n)
+{
+    const Kernels& k = kernels();
+    switch (dtype) {
+        case kQint8: k.q8_quantize_row(x, static_cast<Q8Block*>(out), n); break;
+        case kQint4: k.q4_quantize_row(x, static_cast<Q4Block*>(out), n); break;
+        case kFloat16: k.fp32_to_fp16_row(x, static_cast<Float16*>(out), n); break;
+        case kBFloat16: k.fp32_to_bf16_row(x, static_cast<BFloat16*>(out), n); break;
+        case kFloat32: std::copy(x, x + n, static_cast<float*>(out)); break;
+        default: GTEN_ASSERT(false);
+    }
+}
+
+// Reads a row of `n` elements of the given dtype into the fp32 row `out`.
+inline void read_row(const void* x, Dtype dtype, float* out, int n)
+{
+    const Kernels& k = kernels();
+    switch (dtype) {
+        case kQint8: k.q8_dequantize_row(static_cast<const Q8Block*>(x), out, n); break;
+        case kQint4: k.q4_dequantize_row(static_cast<const Q4Block*>(x), out, n); break;
+        case kFloat16: k.fp16_to_fp32_row(static_cast<const Float16*>(x), out, n); break;
+        case kBFloat16: k.bf16_to_fp32_row(static_cast<const BFloat16*>(x), out, n); break;
+        case kFloat32: std::copy(static_cast<const float*>(x), static_cast<const float*>(x) + n, out); break;
+        default: GTEN_ASSERT(false);
+    }
+}
+
+// Returns the fp32 values of row `r` of a 2d tensor.
+inline std::vector<float> tensor_row(const Tensor& t, int r)
+{
+    std::vector<float> out(t.dimsize(1));
+    read_row(t.data_ptr<char>() + r * t.bstride(0), t.dtype(), out.data(), t.dimsize(1));
+    return out;
+}
+
+// Returns a 2d tensor of the given dtype whose rows are the random values in [lo, hi], rounded
+// to the dtype.
+inline Tensor rand_tensor(int n_rows, int n_cols, Dtype dtype, float lo, float hi)
+{
+    Tensor t{{n_rows, n_cols}, dtype};
+    for (int r = 0; r < n_rows; r++) {
+        const std::vector<float> x = rand_floats(n_cols, lo, hi);
+        write_row(x.data(), t.data_ptr<char>() + r * t.bstride(0), dtype, n_cols);
+    }
+    return t;
+}
+
+// Returns the key (or value) row of the given head and position in the pages of `cache`.
+inline char* cache_row(KVCache& cache, bool keys, int h, int pos)
+{
+    Tensor& page = keys ? cache.k_page(pos / KVCache::kPagePositions) : cache.v_page(pos / KVCache::kPagePositions);
+    return page.data_ptr<char>() + h * page.bstride(0) + (pos % KVCache::kPagePositions) * page.bstride(1);
+}
+
+inline std::vector<float> read_cache_row(KVCache& cache, bool keys, int h, int pos)
+{
+    std::vector<float> out(cache.d_head());
+    read_row(cache_row(cache, keys, h, pos), cache.dtype(), out.data(), cache.d_head());
+    return out;
+}
+
+// Reports a failure if `err` is larger than `tol`.
+inline void check_err(const char* what, double err, double tol)
+{
+    if (!(err <= tol)) {
+        g_n_failures++;
+        std::printf("FAIL %s: error %.3g > %.3g\n", what, err, tol);
+    }
+}
+
+} // namespace test
+} // namespace gten